@@ -1,43 +1,120 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "CHIP8emu.h"
 #include "font4x5.h"
+#ifdef CHIP8_PROFILE
+#include "profile/profile.h"
+#endif
 
 #define FONT_BASE 0
 #define FONT_SIZE 5*16
 
-CHIP8State* initCHIP8(void) {
-    CHIP8State *s = calloc(sizeof(CHIP8State), 1);          //calloc initialises every byte to 0; second argument is block size in bytes
-    
-    s -> pc = 0x200;
-    s -> sp = 0xfa0;
-    s -> memory = calloc(4 * 1024, 1);                      //4KB = 4 * 1024 = 4096 bytes
-    //s -> screen = &s -> memory[0xf00];                      //Display buffer at 0xF00
-    s -> screen = calloc(64 * 32, 1);
+//Largest batch handed to a core in one call, so counts always fit in an int
+#define CORE_BATCH_LIMIT 65536
+
+//Most instructions one fused handler runs, which is how far before a write its sequence can start
+#define MAX_FUSED 4
 
-    memcpy(&(s -> memory[FONT_BASE]), font4x5, FONT_SIZE);   //Put font in first 512 bytes of memory
+//Longest loop, in instructions, that runCHIP8 recognises as idle
+#define MAX_IDLE_LOOP 8
+
+CHIP8State* initCHIP8(void) {
+    //One aligned block for everything; the size is already a multiple of the alignment
+#ifdef _WIN32
+    CHIP8State *s = _aligned_malloc(sizeof(CHIP8State), _Alignof(CHIP8State));
+#else
+    CHIP8State *s = aligned_alloc(_Alignof(CHIP8State), sizeof(CHIP8State));
+#endif
+    if (s == NULL) {
+        return NULL;
+    }
+    setupCHIP8(s);
 
-    printf("Initialised CHIP8State.\n");
     return s;
 }
 
-void freeCHIP8(CHIP8State *state) {
-    if (state -> screen != NULL) {
-        //printf("Freeing CHIP8State screen...\n");
-        free(state -> screen);
+//Initialises a state in storage the caller owns, such as a pool, to the same power-on state initCHIP8 gives
+void setupCHIP8(CHIP8State *state) {
+    memset(state, 0, sizeof(CHIP8State));
+    state -> core = emulateCHIP8Threaded;
+    state -> ips = DEFAULT_IPS;
+    resetCHIP8(state, NULL, 0);
+}
+
+//Fills memory from start to end with what power-on holds there: the font, then the ROM at 0x200, and zeros elsewhere
+static void loadImage(CHIP8State *state, const uint8_t *rom, uint16_t size, int start, int end) {
+    memset(&(state -> memory[start]), 0, end - start);
+
+    int from = (start > FONT_BASE) ? start : FONT_BASE;
+    int to = (end < FONT_BASE + FONT_SIZE) ? end : FONT_BASE + FONT_SIZE;
+    if (from < to) {
+        memcpy(&(state -> memory[from]), &font4x5[from - FONT_BASE], to - from);
     }
-    
-    if (state -> memory != NULL) {
-        //printf("Freeing CHIP8State memory...\n");
-        free(state -> memory);
+
+    from = (start > ROM_BASE) ? start : ROM_BASE;
+    to = (end < ROM_BASE + size) ? end : ROM_BASE + size;
+    if (rom != NULL && from < to) {
+        memcpy(&(state -> memory[from]), &rom[from - ROM_BASE], to - from);
+    }
+}
+
+//Power-on reset with rom loaded at 0x200, keeping the core, hooks and speed
+//rom must stay unchanged while the state may be reset with it again, as resetting with the same ROM
+//only restores the blocks written since the last reset
+void resetCHIP8(CHIP8State *state, const uint8_t *rom, uint16_t size) {
+    if (size > MAX_ROM_SIZE) {
+        size = MAX_ROM_SIZE;
     }
 
-    if (state != NULL) {
-        //printf("Freeing CHIP8State...\n");
-        free(state);
+    if (rom != NULL && rom == state -> rom && size == state -> romSize) {
+        for (int block = 0; block < 64; block++) {
+            if ((state -> writtenBlocks >> block) & 1) {
+                loadImage(state, rom, size, block * 64, block * 64 + 64);
+                invalidateCHIP8(state, block * 64, 64);
+            }
+        }
+    }
+    else {
+        loadImage(state, rom, size, 0, 4096);
+        invalidateCHIP8(state, 0, 4096);
     }
+    state -> rom = rom;
+    state -> romSize = size;
+    state -> writtenBlocks = 0;
+
+    state -> pc = ROM_BASE;
+    state -> sp = 0xfa0;
+    memset(state -> V, 0, sizeof(state -> V));
+    state -> I = 0;
+    state -> delay = 0;
+    state -> sound = 0;
+    state -> halt = 0;
+    state -> fault = 0;
+    state -> faultAddress = 0;
+    memset(state -> keyState, 0, sizeof(state -> keyState));
+    memset(state -> savedKeyState, 0, sizeof(state -> savedKeyState));
+    state -> keyWait = 0;
+    state -> rng = seedRandomCHIP8(state -> seed);
+
+    memset(state -> screen, 0, sizeof(state -> screen));
+    state -> displayFlag = 1;
+
+    state -> cycles = 0;
+    state -> soundTicks = 0;
+    state -> fused = 0;
+    state -> idle = 0;
+    setSpeedCHIP8(state, state -> ips);
+}
+
+void freeCHIP8(CHIP8State *state) {
+#ifdef _WIN32
+    _aligned_free(state);
+#else
+    free(state);
+#endif
 }
 
 /*
@@ -48,234 +125,246 @@ void freeCHIP8(CHIP8State *state) {
 //N = fourth nibble, a 4-bit number (e.g. N in DXYN)
 //NN = third and fourth nibbles, an 8-bit number (e.g. NN in 6XNN)
 //NNN = second, third and fourth nibbles, a 12-bit immediate memory address (e.g. NNN in 1NNN)
+//"." after a mnemonic indicates the instruction modifies VF
 */
-void decodeCHIP8(uint8_t *buffer, int pc) {
-    uint8_t *code = &buffer[pc];
-    uint8_t firstNibble = code[0] >> 4;                     //>> shifts code[0] to the right by 4 bits
-    printf("%04x %02x %02x ", pc, code[0], code[1]);        //code[0] is first instruction byte, code[1] is the second
-
-    switch (firstNibble) {
-        case 0x0:
-            switch (code[1]) {
-                case 0xe0: printf("%-10s", "CLS\n"); break;   //00E0: Clear the screen
-                case 0xee: printf("%-10s", "RTS\n"); break;   //00EE: Return from a subroutine
-                default: printf("UNKNOWN 0\n"); break;
-            }
-            break;
+#define OPCODE_INFO(name, mask, match, mnemonic, operands, halts, pure) [OPCODE_##name] = {#name, mnemonic, operands, mask, match},
+const CHIP8OpcodeInfo opcodeInfoCHIP8[OPCODE_COUNT] = {
+    [OPCODE_UNKNOWN] = {"UNKNOWN", "UNKNOWN", "", 0, 0},
+    [OPCODE_IGNORED] = {"IGNORED", "UNKNOWN", "", 0, 0},
+    CHIP8_OPCODES(OPCODE_INFO)
+};
+#undef OPCODE_INFO
+
+//Expands an operand template from CHIP8_OPCODES with the decoded fields
+static int formatOperands(const char *operands, const CHIP8Instruction *ins, char *out, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    static const char HEX[] = "0123456789ABCDEF";
+    size_t length = 0;
+    for (const char *c = operands; *c; c++) {
+        char digits[3];
+        int count = 0;
+        if (*c == 'x') {
+            digits[count++] = HEX[ins -> x];
+        }
+        else if (*c == 'y') {
+            digits[count++] = HEX[ins -> y];
+        }
+        else if (strncmp(c, "nnn", 3) == 0) {
+            digits[count++] = hex[ins -> nnn >> 8];
+            digits[count++] = hex[(ins -> nnn >> 4) & 0xf];
+            digits[count++] = hex[ins -> nnn & 0xf];
+            c += 2;
+        }
+        else if (strncmp(c, "nn", 2) == 0) {
+            digits[count++] = hex[ins -> nn >> 4];
+            digits[count++] = hex[ins -> nn & 0xf];
+            c += 1;
+        }
+        else if (*c == 'n') {
+            digits[count++] = hex[ins -> n];
+        }
+        else {
+            digits[count++] = *c;
+        }
 
-        //code[0] & 0xf is bitmasking
-        //0xf = 0b1111 so 0xf is the bitmask to mask out 4 bits i.e. a nibble, in this case the first
-        case 0x1: printf("%-10s $%01x%02x", "JUMP\n", code[0] & 0xf, code[1]); break;              //1NNN: Jump to address NNN
-        case 0x2: printf("%-10s $%01x%02x", "CALL\n", code[0] & 0xf, code[1]); break;              //2NNN: Execute subroutine starting at address NNN
-        case 0x3: printf("%-10s V%01X,#$%02x", "SKIP_EQ\n", code[0] & 0xf, code[1]); break;        //3XNN: Skip following instruction if value of VX equals NN
-        case 0x4: printf("%-10s V%01X,#$%02x", "SKIP_NE\n", code[0 ]& 0xf, code[1]); break;        //4XNN: Skip following instruction if value of VX doesn't equal NN
-        case 0x5: printf("%-10s V%01X,V%01X", "SKIP_EQ\n", code[0] & 0xf, code[1] >> 4); break;    //5XY0: Skip following instruction if value of VX equals value of VY
-        case 0x6: printf("%-10s V%01X,#$%02x", "MVI\n", code[0] & 0xf, code[1]); break;            //6XNN: Store NN in VX
-        case 0x7: printf("%-10s V%01X,#$%02x", "ADI\n", code[0] & 0xf, code[1]); break;            //7XNN: Add NN to VX
-        case 0x8:
-            uint8_t fourthNibble = code[1] & 0xf;
-            switch (fourthNibble) {
-                case 0: printf("%-10s V%01X,V%01X", "MOV\n", code[0] & 0xf, code[1] >> 4); break;   //8XY0: Store value of VY in VX
-                case 1: printf("%-10s V%01X,V%01X", "OR\n", code[0] & 0xf, code[1] >> 4); break;    //8XY1: Set VX to (VX OR VY)
-                case 2: printf("%-10s V%01X,V%01X", "AND\n", code[0] & 0xf, code[1] >> 4); break;   //8XY2: Set VX to (VX AND VY)
-                case 3: printf("%-10s V%01X,V%01X", "XOR\n", code[0] & 0xf, code[1] >> 4); break;   //8XY3: Set VX to (VX XOR VY)
-
-                //"." indicates instruction modifies VF
-
-                //8XY4: Add value of VY to VX; set VF to 01 if a carry occurs, else set VF to 00
-                case 4: printf("%-10s V%01X,V%01X", "ADD.\n", code[0] & 0xf, code[1] >> 4); break;
-
-                //8XY5: Subtract value of VY from VX; set VF to 01 if a borrow occurs, else set VF to 00  
-                case 5: printf("%-10s V%01X,V%01X,V%01X", "SUB.\n", code[0] & 0xf, code[0] & 0xf, code[1] >> 4); break;
-
-                //8XY6: Store value of VY shifted right one bit in VX; set VF to least significant bit prior to shift; VY unchanged   
-                case 6: printf("%-10s V%01X,V%01X", "SHR.\n", code[0] & 0xf, code[1] >> 4); break;
-
-                //8XY7: Set VX to value of VY minus VX; set VF to 01 if a borrow occurs, else set VF to 00  
-                case 7: printf("%-10s V%01X,V%01X,V%01X", "SUBB.\n", code[0] & 0xf, code[1] >> 4, code[1] >> 4); break;
-
-                //8XYE: Store value of VY shifted left one bit in VX; set VF to most significant bit prior to shift; VY unchanged 
-                case 0xe: printf("%-10s V%01X,V%01X", "SHL.\n", code[0] & 0xf, code[1] >> 4); break;
-
-                default: printf("UNKNOWN 8\n"); break;
+        for (int i = 0; i < count; i++, length++) {
+            if (length + 1 < size) {
+                out[length] = digits[i];
             }
-            break;
-        //9XY0: Skip following instruction if value of VX doesn't equal value of VY
-        case 0x9: printf("%-10s V%01X,V%01X", "SKIP_NE\n", code[0] & 0xf, code[1] >> 4); break; 
-
-        //ANNN: Store memory address NNN in I
-        case 0xa: printf("%-10s I,#$%01x%02x", "MVI\n", code[0] & 0xf, code[1]); break;
-
-        //BNNN: Jump to address NNN + V0 
-        case 0xb: printf("%-10s $%01x%02x(V0)", "JUMP\n", code[0] & 0xf, code[1]); break;
-
-        //CXNN: Set VX to random number with mask NN 
-        case 0xc: printf("%-10s V%01X,#$%02x", "RNDMSK\n", code[0] & 0xf, code[1]); break;
+        }
+    }
+    if (size) {
+        out[length < size ? length : size - 1] = '\0';
+    }
+    return length;
+}
 
-        //DXYN: Draw sprite at (VX, VY) with N bytes of data starting at address stored in I  
-        case 0xd: printf("%-10s V%01X,V%01X,#$%01x", "SPRITE\n", code[0] & 0xf, code[1] >> 4, code[1]&0xf); break; 
+//Writes one line of disassembly for the instruction at address into out, without a newline
+//Returns the length it needed, like snprintf, so a short buffer truncates rather than overflows
+int disassembleCHIP8(const uint8_t *memory, uint16_t address, char *out, size_t size) {
+    address &= 0xfff;
+    uint8_t code[2] = {memory[address], memory[(address + 1) & 0xfff]};
+    CHIP8Instruction ins;
+    decodeInstructionCHIP8(code, &ins);
+    const CHIP8OpcodeInfo *info = &opcodeInfoCHIP8[ins.opcode];
+
+    char operands[16];
+    formatOperands(info -> operands, &ins, operands, sizeof(operands));
+    if (operands[0] == '\0') {
+        return snprintf(out, size, "%04x %02x %02x %s", address, code[0], code[1], info -> mnemonic);
+    }
+    return snprintf(out, size, "%04x %02x %02x %-10s %s", address, code[0], code[1], info -> mnemonic, operands);
+}
 
-        case 0xe:
-            switch (code[1]) {
-                //EX9E: Skip following instruction if key corresponding to hex value stored in VX is pressed
-                case 0x9e: printf("%-10s V%01X", "SKIPKEY_Y\n", code[0] & 0xf); break;
+void decodeCHIP8(uint8_t *buffer, int pc) {
+    char line[64];
+    disassembleCHIP8(buffer, pc, line, sizeof(line));
+    printf("%s\n", line);
+}
 
-                //EXA1: Skip following instruction if key corresponding to hex value stored in VX isn't pressed  
-                case 0xa1: printf("%-10s V%01X", "SKIPKEY_N\n", code[0] & 0xf); break;
+//Halts rather than exiting, so one bad ROM can't take down a process running many machines
+//The caller decides how to report it, using faultAddress
+void unimplementedInstruction(CHIP8State *state) {
+    state -> fault = 1;
+    state -> faultAddress = (state -> pc - 2) & 0xfff;      //Program counter has advanced by 2, needs to be set back
+    state -> halt = 1;
 
-                default: printf("UNKNOWN E\n"); break;
-            }
-            break;
-        
-        case 0xf:
-            switch (code[1]) {
-                //FX07: Store value of delay timer in VX
-                case 0x07: printf("%-10s V%01X,DELAY", "MOV\n", code[0] & 0xf); break;
-                
-                //FX0A: Wait for keypress and store result in VX
-                case 0x0a: printf("%-10s V%01X", "KEY\n", code[0] & 0xf); break;
+    uint16_t address = state -> faultAddress;
+    logCHIP8(state, "Error: Unimplemented instruction %02x%02x at %03x.", state -> memory[address], state -> memory[(address + 1) & 0xfff], address);
+}
 
-                //FX15: Set delay timer to value of VX
-                case 0x15: printf("%-10s DELAY,V%01X", "MOV\n", code[0] & 0xf); break;
+//Formats a message for the log hook, if there is one; nothing is formatted otherwise, so logging costs nothing unused
+void logCHIP8(CHIP8State *state, const char *format, ...) {
+    if (state -> logHook == NULL) {
+        return;
+    }
 
-                //FX18: Set sound timer to value of VX
-                case 0x18: printf("%-10s SOUND,V%01X", "MOV\n", code[0] & 0xf); break;
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
 
-                //FX1E: Add value of VX to I  
-                case 0x1e: printf("%-10s I,V%01X", "ADI\n", code[0] & 0xf); break;
+    state -> logHook(state -> logHookData, message);
+}
 
-                //FX29: Set I to memory address of sprite data corresponding to hex digit stored in VX
-                case 0x29: printf("%-10s I,V%01X", "SPRITECHAR\n", code[0] & 0xf); break;
+//Seeds CXNN's generator; the seed is kept, so resetting the machine repeats the same numbers
+void seedCHIP8(CHIP8State *state, uint32_t seed) {
+    state -> seed = seed;
+    state -> rng = seedRandomCHIP8(seed);
+}
 
-                //FX33: Store binary-coded decimal equivalent of value of VX at addresses I, I + 1, and I + 2
-                case 0x33: printf("%-10s (I),V%01X", "MOVBCD\n", code[0] & 0xf); break;
+void invalidateCHIP8(CHIP8State *state, uint16_t address, uint16_t length) {
+    //An instruction starting one byte before the write also contains a written byte,
+    //and a fused sequence can start up to MAX_FUSED instructions before it
+    for (int i = -(2 * MAX_FUSED - 1); i < length; i++) {
+        state -> decodeCache[(address + i) & 0xfff].handler = NULL;
+    }
+    for (int i = 0; i < length; i += 64) {
+        state -> writtenBlocks |= 1ull << (((address + i) & 0xfff) >> 6);
+    }
+    state -> writtenBlocks |= 1ull << (((address + length - 1) & 0xfff) >> 6);
 
-                //FX55: Store values of V0 to VX inclusive in memory starting at address I, then set I to I + X + 1
-                case 0x55: printf("%-10s (I),V0-V%01X", "MOVM\n", code[0] & 0xf); break;
+    if (state -> invalidateHook != NULL) {
+        state -> invalidateHook(state -> invalidateHookData, address, length);
+    }
 
-                //FX65: Fill V0 to VX inclusive with values stored in memory starting at address I, then set I to I + X + 1
-                case 0x65: printf("%-10s V0-V%01X,(I)", "MOVM\n", code[0] & 0xf); break;
+    //Every write comes through here, so this keeps the guard after memory equal to its first bytes
+    memcpy(&(state -> memory[4096]), state -> memory, MEMORY_GUARD);
+}
 
-                default: printf("UNKNOWN F\n"); break;
-            }
-            break;
-    }
+static void opUnknown(CHIP8State *state, const CHIP8Instruction *ins) {
+    unimplementedInstruction(state);
 }
 
-void unimplementedInstruction(CHIP8State *state) {
-    decodeCHIP8(state -> memory, state -> pc);      //Program counter has advanced by 2, needs to be set back
-    printf("Error: Unimplemented instruction.\n");
-    exit(1);
+static void opIgnored(CHIP8State *state, const CHIP8Instruction *ins) {
+    //Unknown FX instructions have always been skipped silently rather than treated as errors
 }
 
-void op00E0(CHIP8State *state, uint8_t *code) {
+void op00E0(CHIP8State *state, const CHIP8Instruction *ins) {
     //CLS
-    //Copies 0 into display (64x32) bytes; originally 1 bit per pixel but the emulated screen is 8-bit 
-    memset(state -> screen, 0, 64 * 32);
+    //Clears all 32 rows of the display, each one a 64-bit word with 1 bit per pixel
+    memset(state -> screen, 0, 32 * sizeof(uint64_t));
     state -> displayFlag = 1;   
 }
 
-void op00EE(CHIP8State *state, uint8_t *code) {
+void op00EE(CHIP8State *state, const CHIP8Instruction *ins) {
     //RTS
-    uint16_t target = (state -> memory[state -> sp] << 8) | (state -> memory[(state -> sp) + 1]);   //logical OR
+    //A stack pointer that has wandered anywhere still reads inside memory, the second byte from the guard at 0xfff
+    const uint8_t *top = &(state -> memory[(state -> sp) & 0xfff]);
+    uint16_t target = (top[0] << 8) | top[1];   //logical OR
     state -> sp += 2;
     state -> pc = target;
 }
 
-void op1NNN(CHIP8State *state, uint8_t *code) {
+void op1NNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //JUMP
-    uint16_t target = ((code[0] & 0xf) << 8) | code[1];
+    uint16_t target = ins -> nnn;
     
     if (target == (state -> pc) - 2) {
         state -> halt = 1;
-        printf("Set a halt flag as an infinite loop was detected.\n");
+        logCHIP8(state, "Set a halt flag as an infinite loop was detected at %03x.", target);
     }
 
     state -> pc = target;
 }
 
-void op2NNN(CHIP8State *state, uint8_t *code) {
+void op2NNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //CALL
     state -> sp -= 2;
-    state -> memory[state -> sp] = ((state -> pc) & 0xFF00) >> 8;
-    state -> memory[(state -> sp) + 1] = (state -> pc) & 0xFF;
-    state -> pc = ((code[0] & 0xf) << 8) | code[1]; 
+    //Writes mask each address, so a push at 0xfff puts its second byte at 0 rather than in the guard
+    state -> memory[(state -> sp) & 0xfff] = ((state -> pc) & 0xFF00) >> 8;
+    state -> memory[((state -> sp) + 1) & 0xfff] = (state -> pc) & 0xFF;
+    state -> pc = ins -> nnn; 
+
+    //The stack lives in guest memory, so a ROM could be executing code where the return address went
+    invalidateCHIP8(state, (state -> sp) & 0xfff, 2);
 }
 
-void op3XNN(CHIP8State *state, uint8_t *code) {
+void op3XNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //SKIP_EQ NN
-    uint8_t reg = code[0] & 0xf;
-    
-    if (state -> V[reg] == code[1]) {
+    if (state -> V[ins -> x] == ins -> nn) {
         state -> pc += 2;
     }
 }
 
-void op4XNN(CHIP8State *state, uint8_t *code) {
+void op4XNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //SKIP_NE NN
-    uint8_t reg = code[0] & 0xf;
-
-    if (state -> V[reg] != code[1]) {
+    if (state -> V[ins -> x] != ins -> nn) {
         state -> pc += 2;
     }
 }
 
-void op5XY0(CHIP8State *state, uint8_t *code) {
+void op5XY0(CHIP8State *state, const CHIP8Instruction *ins) {
     //SKIP_EQ VY
-    //0xf0 = 0b11110000
-    uint8_t regX = code[0] & 0xf;
-    uint8_t regY = (code[1] & 0xf0) >> 4;
-
-    if (state -> V[regX] == state -> V[regY]) {
+    if (state -> V[ins -> x] == state -> V[ins -> y]) {
         state -> pc +=2;
     }
 }
 
-void op6XNN(CHIP8State *state, uint8_t *code) {
+void op6XNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //MVI NN
-    uint8_t reg = code[0] & 0xf;
-    state -> V[reg] = code[1];
+    state -> V[ins -> x] = ins -> nn;
 }
 
-void op7XNN(CHIP8State *state, uint8_t *code) {
+void op7XNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //ADI
-    uint8_t reg = code[0] & 0xf;
-    state -> V[reg] += code[1];
+    state -> V[ins -> x] += ins -> nn;
 }
 
-void op8XY0(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY0(CHIP8State *state, const CHIP8Instruction *ins) {
     //MOV
-    state -> V[regX] = state -> V[regY];
+    state -> V[ins -> x] = state -> V[ins -> y];
 }
 
-void op8XY1(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY1(CHIP8State *state, const CHIP8Instruction *ins) {
     //OR
-    state -> V[regX] |= state -> V[regY];
+    state -> V[ins -> x] |= state -> V[ins -> y];
 
     //On the original CHIP-8, the flag register is reset, so this is purely to pass the quirks test
     state -> V[0xF] = 0;
 }
 
-void op8XY2(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY2(CHIP8State *state, const CHIP8Instruction *ins) {
     //AND
-    state -> V[regX] &= state -> V[regY];
+    state -> V[ins -> x] &= state -> V[ins -> y];
 
     state -> V[0xF] = 0;
 }
 
-void op8XY3(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY3(CHIP8State *state, const CHIP8Instruction *ins) {
     //XOR
-    state -> V[regX] ^= state -> V[regY];
+    state -> V[ins -> x] ^= state -> V[ins -> y];
 
     state -> V[0xF] = 0;
 }
 
-void op8XY4(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY4(CHIP8State *state, const CHIP8Instruction *ins) {
     //ADD and set VF
-    uint16_t result = (state -> V[regX]) + (state -> V[regY]);
+    uint16_t result = (state -> V[ins -> x]) + (state -> V[ins -> y]);
 
     //Registers are 8-bit, not 16-bit so we need to bitmask with 0xff = 0b11111111
-    state -> V[regX] = result & 0xff;
+    state -> V[ins -> x] = result & 0xff;
 
     //Has carry occured? Bitmask here is 0xff00 = 0b111111100000000
     uint16_t carry = result & 0xff00;
@@ -287,11 +376,11 @@ void op8XY4(CHIP8State *state, uint8_t regX, uint8_t regY) {
     }
 }
 
-void op8XY5(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY5(CHIP8State *state, const CHIP8Instruction *ins) {
     //SUB and set VF
     //Has borrow occured?
-    uint8_t borrow = (state -> V[regY]) > (state -> V[regX]);
-    state -> V[regX] -= state -> V[regY];
+    uint8_t borrow = (state -> V[ins -> y]) > (state -> V[ins -> x]);
+    state -> V[ins -> x] -= state -> V[ins -> y];
     if (borrow) {
         state -> V[0xF] = 0;
     }
@@ -300,22 +389,22 @@ void op8XY5(CHIP8State *state, uint8_t regX, uint8_t regY) {
     }
 }
 
-void op8XY6(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY6(CHIP8State *state, const CHIP8Instruction *ins) {
     //SHR and set VF to least significant bit
     //Original CHIP-8 interpreter sets VX to VY, modern ones shift VX in place, so this is purely to pass quirk test
-    state -> V[regX] = state -> V[regY];
+    state -> V[ins -> x] = state -> V[ins -> y];
 
-    uint8_t lsb = (state -> V[regX]) & 0x1;
+    uint8_t lsb = (state -> V[ins -> x]) & 0x1;
 
-    state -> V[regX] = (state -> V[regX]) >> 1;
+    state -> V[ins -> x] = (state -> V[ins -> x]) >> 1;
     state -> V[0xF] = lsb;
 }
 
-void op8XY7(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XY7(CHIP8State *state, const CHIP8Instruction *ins) {
     //SUBB and set VF
     //Has borrow occured?
-    uint8_t borrow = (state -> V[regX]) > (state -> V[regY]);
-    state -> V[regX] = (state -> V[regY]) - (state -> V[regX]);
+    uint8_t borrow = (state -> V[ins -> x]) > (state -> V[ins -> y]);
+    state -> V[ins -> x] = (state -> V[ins -> y]) - (state -> V[ins -> x]);
     if (borrow) {
         state -> V[0xF] = 0;
     }
@@ -324,118 +413,103 @@ void op8XY7(CHIP8State *state, uint8_t regX, uint8_t regY) {
     }
 }
 
-void op8XYE(CHIP8State *state, uint8_t regX, uint8_t regY) {
+void op8XYE(CHIP8State *state, const CHIP8Instruction *ins) {
     //SHL and set VF to most significant bit
-    state -> V[regX] = state -> V[regY];
+    state -> V[ins -> x] = state -> V[ins -> y];
 
     //0x80 = 0b10000000
-    uint8_t msb = (0x80 == ((state -> V[regX]) & 0x80));
-    state -> V[regX] = (state -> V[regX]) << 1;
+    uint8_t msb = (0x80 == ((state -> V[ins -> x]) & 0x80));
+    state -> V[ins -> x] = (state -> V[ins -> x]) << 1;
     state -> V[0xF] = msb;
 }
 
-void op9XY0(CHIP8State *state, uint8_t *code) {
+void op9XY0(CHIP8State *state, const CHIP8Instruction *ins) {
     //SKIP_NE VY
-    uint8_t regX = code[0] & 0xf;
-    uint8_t regY = (code[1] & 0xf0) >> 4;
-
-    if (state -> V[regX] != state -> V[regY]) {
+    if (state -> V[ins -> x] != state -> V[ins -> y]) {
         state -> pc +=2;
     }
 }
 
-void opANNN(CHIP8State *state, uint8_t *code) {
+void opANNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //MVI NNN
-    state -> I = ((code[0] & 0xf) << 8) | code[1];
+    state -> I = ins -> nnn;
 }
 
-void opBNNN(CHIP8State *state, uint8_t *code) {
+void opBNNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //JUMP +V0    
-    uint16_t target = ((code[0] & 0xf) << 8) | code[1];
+    uint16_t target = ins -> nnn;
     target += state -> V[0];
     
     if (target == (state -> pc) - 2) {
         state -> halt = 1;
-        printf("Set a halt flag as an infinite loop was detected.\n");
+        logCHIP8(state, "Set a halt flag as an infinite loop was detected at %03x.", target);
     }
 
     state -> pc = target;
 }
 
-void opCXNN(CHIP8State *state, uint8_t *code) {
+void opCXNN(CHIP8State *state, const CHIP8Instruction *ins) {
     //RNDMSK
-    uint8_t reg = code[0] & 0xf;
-    //rand() is from the stdlib
-    state -> V[reg] = rand() & code[1];   
+    //From the machine's own generator rather than rand(), so machines on different threads never share state
+    state -> V[ins -> x] = nextRandomCHIP8(&(state -> rng)) & ins -> nn;
 }
 
-void opDXYN(CHIP8State *state, uint8_t *code) {
+void opDXYN(CHIP8State *state, const CHIP8Instruction *ins) {
     //SPRITE
-    uint8_t regX = code[0] & 0xf;
-    uint8_t regY = (code[1] & 0xf0) >> 4;
-
     //Set X and Y coordinates to values of VX & 63 and VY & 31 respectively, and VF to 0
     //Go through N rows and draw the 8 pixels in the row, stop entirely if you reach the bottom of the screen
-    uint8_t x = (state -> V[regX]) & 0x3f;
-    uint8_t y = (state -> V[regY]) & 0x1f;
+    uint8_t x = (state -> V[ins -> x]) & 0x3f;
+    uint8_t y = (state -> V[ins -> y]) & 0x1f;
     state -> V[0xF] = 0;
-    int rows = code[1] & 0xf;
+    int rows = ins -> n;
 
-    for (int i = 0; i < rows; i++) {
-        uint8_t *sprite = &(state -> memory[(state -> I) + i]);
-
-        if (y + i > 32) {
-            break;
-        }
-
-        //For each of the 8 pixels/bits in the row, going from left to right i.e. most to least significant bit
-        //0x80 = 0b10000000 i.e. the most significant bit, so below statement will be iterated for each bit
-        for (int j = 0; j < 8; j++) {
-            if (x + j >= 64 || x + j < 0) {
-                continue;
-            }
+    //Rows 0 to 31 exist, so a sprite starting at row y has room for 32 - y of its rows
+    if (y + rows > 32) {
+        rows = 32 - y;
+    }
 
-            uint8_t spritePixel = *sprite & (0x80 >> j);
-
-            //If current 1-bit sprite pixel = on and 8-bit screen pixel at (X,Y) = on, turn off screen pixel and set VF to 1
-            //Otherwise, draw if current pixel = on and pixel at (X,Y) = off
-            //This is an XOR operation
-            if (spritePixel) {
-                uint8_t *screenPixel = &(state -> screen[(y + i) * 64 + (x + j)]);
-                if (*screenPixel) {
-                    state -> V[0xF] = 1;
-                } 
-                *screenPixel ^= 0xF;  
-            }
-        }
+    //At most 15 rows, so a sprite near 0xfff runs into the guard and wraps to the start of memory
+    const uint8_t *sprite = &(state -> memory[(state -> I) & 0xfff]);
+    uint64_t collision = 0;
+    for (int i = 0; i < rows; i++) {
+        //Each screen row is one 64-bit word with column 0 in the most significant bit
+        //Shifting the sprite byte into place drops any pixels past column 63, which clips at the right edge
+        uint64_t line = ((uint64_t) sprite[i] << 56) >> x;
+        uint64_t *row = &(state -> screen[y + i]);
+
+        //If a sprite pixel lands on a pixel that's already on, the XOR turns it off and VF gets set
+        collision |= *row & line;
+        *row ^= line;
     }
+
+    state -> V[0xF] = (collision != 0);
     state -> displayFlag = 1;
 }
 
-void opEX9E(CHIP8State *state, uint8_t *code) {
+void opEX9E(CHIP8State *state, const CHIP8Instruction *ins) {
     //SKIPKEY_Y
-    uint8_t reg = code[0] & 0xf;
-    uint8_t ks = state -> V[reg];
+    //Only 16 keys exist, so only the low nibble of VX picks one
+    uint8_t ks = state -> V[ins -> x] & 0xf;
     if (state -> keyState[ks]) {
         state -> pc += 2;
     }
 }
 
-void opEXA1(CHIP8State *state, uint8_t *code) {
+void opEXA1(CHIP8State *state, const CHIP8Instruction *ins) {
     //SKIPKEY_N
-    uint8_t reg = code[0] & 0xf;
-    uint8_t ks = state -> V[reg];
+    //Only 16 keys exist, so only the low nibble of VX picks one
+    uint8_t ks = state -> V[ins -> x] & 0xf;
     if (!state -> keyState[ks]) {
         state -> pc += 2;
     }
 }
 
-void opFX07(CHIP8State *state, uint8_t reg) {
+void opFX07(CHIP8State *state, const CHIP8Instruction *ins) {
     //MOV VX DELAY
-    state -> V[reg] = state -> delay;
+    state -> V[ins -> x] = state -> delay;
 }
 
-void opFX0A(CHIP8State *state, uint8_t reg) {
+void opFX0A(CHIP8State *state, const CHIP8Instruction *ins) {
     //KEY
     if (!state -> keyWait) {
         memcpy(&(state -> savedKeyState), &(state -> keyState), 16);
@@ -445,7 +519,7 @@ void opFX0A(CHIP8State *state, uint8_t reg) {
         //Check that a key was pressed before AND now released
         for (int i = 0; i < 16; i++) {
             if (state -> savedKeyState[i] && !(state -> keyState[i])) {
-                state -> V[reg] = i;
+                state -> V[ins -> x] = i;
                 state -> keyWait = 0;
             }
             state -> savedKeyState[i] = state -> keyState[i];
@@ -458,19 +532,19 @@ void opFX0A(CHIP8State *state, uint8_t reg) {
     }
 }
 
-void opFX15(CHIP8State *state, uint8_t reg) {
+void opFX15(CHIP8State *state, const CHIP8Instruction *ins) {
     //MOV DELAY VX
-    state -> delay = state -> V[reg];
+    state -> delay = state -> V[ins -> x];
 }
 
-void opFX18(CHIP8State *state, uint8_t reg) {
+void opFX18(CHIP8State *state, const CHIP8Instruction *ins) {
     //MOV SOUND
-    state -> sound = state -> V[reg];
+    state -> sound = state -> V[ins -> x];
 }
 
-void opFX1E(CHIP8State *state, uint8_t reg) {
+void opFX1E(CHIP8State *state, const CHIP8Instruction *ins) {
     //ADI
-    state -> I += state -> V[reg];
+    state -> I += state -> V[ins -> x];
 
     //Most interpreters check for an overflow
     if (state -> I > 0xFFF) {
@@ -481,110 +555,565 @@ void opFX1E(CHIP8State *state, uint8_t reg) {
     }
 }
 
-void opFX29(CHIP8State *state, uint8_t reg) {
+void opFX29(CHIP8State *state, const CHIP8Instruction *ins) {
     //SPRITECHAR
-    state -> I = FONT_BASE + ((state -> V[reg]) * 5);
+    state -> I = FONT_BASE + ((state -> V[ins -> x]) * 5);
 }
 
-void opFX33(CHIP8State *state, uint8_t reg) {
+void opFX33(CHIP8State *state, const CHIP8Instruction *ins) {
     //MOVBCD
     //Convert value of VX to 3 decimal digits and store these in memory at addresses I, I + 1, I + 2
-    uint8_t regValue = state -> V[reg];
+    uint8_t regValue = state -> V[ins -> x];
 
     uint8_t oneDigit = regValue % 10;
     uint8_t tenDigit = (regValue / 10) % 10;
     uint8_t hundredDigit = (regValue / 100) % 10;
 
-    state -> memory[state -> I] = hundredDigit;
-    state -> memory[(state -> I) + 1] = tenDigit;
-    state -> memory[(state -> I) + 2] = oneDigit;
+    state -> memory[(state -> I) & 0xfff] = hundredDigit;
+    state -> memory[((state -> I) + 1) & 0xfff] = tenDigit;
+    state -> memory[((state -> I) + 2) & 0xfff] = oneDigit;
+
+    //Self-modifying ROMs may have overwritten code that is already decoded
+    invalidateCHIP8(state, (state -> I) & 0xfff, 3);
 }
 
-void opFX55(CHIP8State *state, uint8_t reg) {
+void opFX55(CHIP8State *state, const CHIP8Instruction *ins) {
     //MOVM STORE I
+    //Stored from the masked address as one run, which may carry on into the guard
+    uint8_t reg = ins -> x;
+    uint16_t address = (state -> I) & 0xfff;
     for (int i = 0; i <= reg; i++) {
-        state -> memory[(state -> I) + i] = state -> V[i];
+        state -> memory[address + i] = state -> V[i];
     }
 
+    //If it did, the guard now holds the newer copy of the first bytes, otherwise memory does
+    //Whichever is newer goes to the start of memory, and invalidateCHIP8 then copies that back over the guard
+    const uint8_t *newer = (address + reg + 1 > 4096) ? &(state -> memory[4096]) : state -> memory;
+    uint8_t first[MEMORY_GUARD];
+    memcpy(first, newer, MEMORY_GUARD);
+    memcpy(state -> memory, first, MEMORY_GUARD);
+    invalidateCHIP8(state, address, reg + 1);
+
     //Original CHIP-8 interpreter sets I to new value I + X + 1
     //Modern interpreters leave I's value alone
     state -> I += reg + 1;
 }
 
-void opFX65(CHIP8State *state, uint8_t reg) {
+void opFX65(CHIP8State *state, const CHIP8Instruction *ins) {
     //MOVM FILL V0-VF
+    uint8_t reg = ins -> x;
+    const uint8_t *from = &(state -> memory[(state -> I) & 0xfff]);
     for (int i = 0; i <= reg; i++) {
-        state -> V[i] = state -> memory[(state -> I) + i];
+        state -> V[i] = from[i];
     }
 
     state -> I += reg + 1;
 }
 
-void emulateCHIP8(CHIP8State *state) {
-    //Fetch and decode instruction, also it's best to increment program counter here
-    uint8_t *code = &(state -> memory[state -> pc]);
-    //decodeCHIP8(state -> memory, state -> pc);
+//Handler for each opcode, indexed by CHIP8Opcode
+#define OPCODE_HANDLER(name, mask, match, mnemonic, operands, halts, pure) [OPCODE_##name] = op##name,
+static const CHIP8Handler handlers[OPCODE_COUNT] = {
+    [OPCODE_UNKNOWN] = opUnknown,
+    [OPCODE_IGNORED] = opIgnored,
+    CHIP8_OPCODES(OPCODE_HANDLER)
+};
+#undef OPCODE_HANDLER
+
+//Only runs when an address is first decoded or was overwritten, so a scan of the table is cheap enough
+static CHIP8Opcode selectOpcode(uint8_t *code) {
+    uint16_t opcode = (code[0] << 8) | code[1];
+    for (int op = OPCODE_IGNORED + 1; op < OPCODE_COUNT; op++) {
+        if ((opcode & opcodeInfoCHIP8[op].mask) == opcodeInfoCHIP8[op].match) {
+            return op;
+        }
+    }
+    return (opcode & 0xf000) == 0xf000 ? OPCODE_IGNORED : OPCODE_UNKNOWN;
+}
+
+void decodeInstructionCHIP8(uint8_t *code, CHIP8Instruction *ins) {
+    //Pull every operand field out once so handlers never touch the raw bytes
+    ins -> x = code[0] & 0xf;
+    ins -> y = (code[1] & 0xf0) >> 4;
+    ins -> n = code[1] & 0xf;
+    ins -> nn = code[1];
+    ins -> nnn = ((code[0] & 0xf) << 8) | code[1];
+    ins -> opcode = selectOpcode(code);
+    ins -> handler = handlers[ins -> opcode];
+    ins -> dispatch = ins -> opcode;
+}
+
+#ifndef CHIP8_PROFILE
+//Superinstructions: sequences real ROMs repeat constantly, run by one handler when the first of them is fetched
+//Each handler is entered with pc already past its first instruction, like any other, takes the later instructions'
+//operands from their own decode cache entries, and returns how many instructions it ran
+//FUSE(name, length, halts): length is the most instructions fused##name runs, and halts marks ones that can jump to self
+#define FUSED_SEQUENCES(FUSE) \
+    FUSE(Draw,          2, 0) \
+    FUSE(AddSkipJump,   3, 1) \
+    FUSE(DelaySkipJump, 3, 1) \
+    FUSE(Load2,         2, 0) \
+    FUSE(Load3,         3, 0) \
+    FUSE(Load4,         4, 0)
+
+#define FUSED_ENUM(name, length, halts) FUSED_##name,
+enum {
+    FUSED_NONE,
+    FUSED_SEQUENCES(FUSED_ENUM)
+    FUSED_COUNT
+};
+#undef FUSED_ENUM
+
+#define FUSED_LENGTH(name, length, halts) [FUSED_##name] = length,
+static const uint8_t fusedLength[FUSED_COUNT] = {
+    FUSED_SEQUENCES(FUSED_LENGTH)
+};
+#undef FUSED_LENGTH
+
+//ANNN DXYN: point I at a sprite and draw it
+static inline int fusedDraw(CHIP8State *state, const CHIP8Instruction *ins) {
+    state -> I = ins -> nnn;
     state -> pc += 2;
+    opDXYN(state, ins + 2);
+    return 2;
+}
 
-    uint8_t firstNibble = (*code & 0xf0) >> 4;
-    switch (firstNibble) {
-        case 0x00: 
-            switch (code[1]) {
-                case 0xe0: op00E0(state, code); break;
-                case 0xee: op00EE(state, code); break;
-                default: unimplementedInstruction(state); break;
-            }
-            break;
-        case 0x01: op1NNN(state, code); break;
-        case 0x02: op2NNN(state, code); break;
-        case 0x03: op3XNN(state, code); break;
-        case 0x04: op4XNN(state, code); break;
-        case 0x05: op5XY0(state, code); break;
-        case 0x06: op6XNN(state, code); break;
-        case 0x07: op7XNN(state, code); break;
-        case 0x08:
-            uint8_t fourthNibble = code[1] & 0xf;
-            uint8_t regX = code[0] & 0xf;
-            uint8_t regY = (code[1] & 0xf0) >> 4;
-            switch (fourthNibble) {
-                case 0: op8XY0(state, regX, regY); break;
-                case 1: op8XY1(state, regX, regY); break;
-                case 2: op8XY2(state, regX, regY); break;
-                case 3: op8XY3(state, regX, regY); break;
-                case 4: op8XY4(state, regX, regY); break;
-                case 5: op8XY5(state, regX, regY); break;
-                case 6: op8XY6(state, regX, regY); break;
-                case 7: op8XY7(state, regX, regY); break;
-                case 0xe: op8XYE(state, regX, regY); break;
-                default: unimplementedInstruction(state); break;
-            }
-            break;
-        case 0x09: op9XY0(state, code); break;
-        
-        case 0x0a: opANNN(state, code); break;
-        case 0x0b: opBNNN(state, code); break;
-        case 0x0c: opCXNN(state, code); break;
-        case 0x0d: opDXYN(state, code); break;
-        case 0x0e:
-            switch (code[1]) {
-                case 0x9e: opEX9E(state, code); break;
-                case 0xa1: opEXA1(state, code); break;
-                default: unimplementedInstruction(state); break;
+//3XNN or 4XNN then 1NNN: the test and jump that close a loop
+static inline int skipJump(CHIP8State *state, const CHIP8Instruction *skip) {
+    int equal = state -> V[skip -> x] == skip -> nn;
+    state -> pc += 4;
+    if (equal == (skip -> opcode == OPCODE_3XNN)) {
+        return 1;
+    }
+    op1NNN(state, skip + 2);
+    return 2;
+}
+
+//7XNN 3XNN/4XNN 1NNN: a counted loop
+static inline int fusedAddSkipJump(CHIP8State *state, const CHIP8Instruction *ins) {
+    state -> V[ins -> x] += ins -> nn;
+    return 1 + skipJump(state, ins + 2);
+}
+
+//FX07 3XNN/4XNN 1NNN: polling the delay timer
+static inline int fusedDelaySkipJump(CHIP8State *state, const CHIP8Instruction *ins) {
+    state -> V[ins -> x] = state -> delay;
+    return 1 + skipJump(state, ins + 2);
+}
+
+//Runs of 6XNN register loads
+static inline int loadRun(CHIP8State *state, const CHIP8Instruction *ins, int count) {
+    for (int i = 0; i < count; i++) {
+        state -> V[ins[2 * i].x] = ins[2 * i].nn;
+    }
+    state -> pc += 2 * (count - 1);
+    return count;
+}
+
+static inline int fusedLoad2(CHIP8State *state, const CHIP8Instruction *ins) {
+    return loadRun(state, ins, 2);
+}
+
+static inline int fusedLoad3(CHIP8State *state, const CHIP8Instruction *ins) {
+    return loadRun(state, ins, 3);
+}
+
+static inline int fusedLoad4(CHIP8State *state, const CHIP8Instruction *ins) {
+    return loadRun(state, ins, 4);
+}
+
+#define FUSED_HANDLER(name, length, halts) [FUSED_##name] = fused##name,
+static int (*const fusedHandlers[FUSED_COUNT])(CHIP8State *state, const CHIP8Instruction *ins) = {
+    FUSED_SEQUENCES(FUSED_HANDLER)
+};
+#undef FUSED_HANDLER
+
+static inline uint8_t opcodeAt(CHIP8State *state, uint16_t address) {
+    return selectOpcode(&(state -> memory[address]));
+}
+
+//Picks the sequence, if any, starting at address; the instructions after it are known to be within memory
+static uint8_t selectFused(CHIP8State *state, uint16_t address, uint8_t opcode) {
+    uint8_t next = opcodeAt(state, address + 2);
+    switch (opcode) {
+        case OPCODE_ANNN:
+            return (next == OPCODE_DXYN) ? FUSED_Draw : FUSED_NONE;
+        case OPCODE_7XNN:
+        case OPCODE_FX07:
+            if ((next != OPCODE_3XNN && next != OPCODE_4XNN) || opcodeAt(state, address + 4) != OPCODE_1NNN) {
+                return FUSED_NONE;
             }
-            break; 
-        case 0x0f:
-            uint8_t reg = code[0] & 0xf;
-            switch (code[1]) {
-                case 0x07: opFX07(state, reg); break;
-                case 0x0a: opFX0A(state, reg); break;
-                case 0x15: opFX15(state, reg); break;
-                case 0x18: opFX18(state, reg); break;
-                case 0x1e: opFX1E(state, reg); break;
-                case 0x29: opFX29(state, reg); break;
-                case 0x33: opFX33(state, reg); break;
-                case 0x55: opFX55(state, reg); break;
-                case 0x65: opFX65(state, reg); break;
+            return (opcode == OPCODE_7XNN) ? FUSED_AddSkipJump : FUSED_DelaySkipJump;
+        case OPCODE_6XNN: {
+            int run = 1;
+            while (run < MAX_FUSED && opcodeAt(state, address + 2 * run) == OPCODE_6XNN) {
+                run++;
             }
+            return (run == 1) ? FUSED_NONE : FUSED_Load2 + (run - 2);
+        }
+    }
+    return FUSED_NONE;
+}
+#endif
+
+//Decodes the instruction at address and, if a sequence starts there, the rest of it too
+//A write anywhere in the sequence clears this entry, since invalidateCHIP8 reaches back MAX_FUSED instructions
+static void decodeEntry(CHIP8State *state, uint16_t address) {
+    CHIP8Instruction *ins = &(state -> decodeCache[address]);
+    decodeInstructionCHIP8(&(state -> memory[address]), ins);
+#ifndef CHIP8_PROFILE
+    //Sequences never wrap past the end of memory, and profiling counts every instruction separately
+    if (address + 2 * MAX_FUSED > 4096) {
+        return;
+    }
+    uint8_t fused = selectFused(state, address, ins -> opcode);
+    if (fused == FUSED_NONE) {
+        return;
+    }
+    for (int i = 1; i < fusedLength[fused]; i++) {
+        CHIP8Instruction *next = &(state -> decodeCache[address + 2 * i]);
+        if (next -> handler == NULL) {
+            decodeInstructionCHIP8(&(state -> memory[address + 2 * i]), next);
+        }
+    }
+    ins -> dispatch = OPCODE_COUNT + fused;
+#endif
+}
+
+static inline CHIP8Instruction* fetchInstruction(CHIP8State *state) {
+    //Fetch the decoded instruction, decoding it on first execution
+    uint16_t address = (state -> pc) & 0xfff;
+    CHIP8Instruction *ins = &(state -> decodeCache[address]);
+    if (ins -> handler == NULL) {
+        decodeEntry(state, address);
+    }
+    return ins;
+}
+
+void emulateCHIP8(CHIP8State *state) {
+    //It's best to increment program counter here, before the handler runs
+    CHIP8Instruction *ins = fetchInstruction(state);
+#ifdef CHIP8_PROFILE
+    uint16_t address = (state -> pc) & 0xfff;
+    state -> pc += 2;
+    if (state -> profile != NULL) {
+        uint64_t start = profileClock();
+        ins -> handler(state, ins);
+        recordProfile(state -> profile, state, ins, address, start);
+        return;
+    }
+#else
+    state -> pc += 2;
+#endif
+
+    ins -> handler(state, ins);
+}
+
+int emulateCHIP8Batch(CHIP8State *state, int count) {
+    int executed = 0;
+    while (executed < count && !(state -> halt)) {
+#ifdef CHIP8_PROFILE
+        emulateCHIP8(state);
+        executed++;
+#else
+        CHIP8Instruction *ins = fetchInstruction(state);
+        state -> pc += 2;
+
+        //A sequence only runs fused when the whole of it fits in the batch, so timers still tick on the same cycle
+        uint8_t fused = ins -> dispatch - OPCODE_COUNT;
+        if (ins -> dispatch > OPCODE_COUNT && count - executed >= fusedLength[fused]) {
+            int ran = fusedHandlers[fused](state, ins);
+            state -> fused += ran;
+            executed += ran;
+        }
+        else {
+            ins -> handler(state, ins);
+            executed++;
+        }
+#endif
+    }
+    return executed;
+}
+
+#if defined(__GNUC__) && !defined(CHIP8_PROFILE)
+//Threaded interpreter using labels-as-values: every handler ends with its own copy of the dispatch,
+//so each indirect jump gets its own branch predictor history instead of sharing one in a switch
+//Handlers are called directly rather than through a pointer, which lets the compiler inline them
+int emulateCHIP8Threaded(CHIP8State *state, int count) {
+    #define THREADED_LABEL(name, mask, match, mnemonic, operands, halts, pure) [OPCODE_##name] = &&label##name,
+    #define THREADED_FUSED_LABEL(name, length, halts) [OPCODE_COUNT + FUSED_##name] = &&labelFused##name,
+    static void *labels[OPCODE_COUNT + FUSED_COUNT] = {
+        [OPCODE_UNKNOWN] = &&labelUnknown,
+        [OPCODE_IGNORED] = &&labelIgnored,
+        CHIP8_OPCODES(THREADED_LABEL)
+        FUSED_SEQUENCES(THREADED_FUSED_LABEL)
+    };
+    #undef THREADED_LABEL
+    #undef THREADED_FUSED_LABEL
+    CHIP8Instruction *ins;
+    int executed = 0;
+
+    #define DISPATCH() \
+        if (executed == count) { \
+            return executed; \
+        } \
+        ins = fetchInstruction(state); \
+        state -> pc += 2; \
+        executed++; \
+        goto *labels[ins -> dispatch]
+
+    //Only jumps and faults can set the halt flag, so only they check it
+    #define DISPATCH_UNLESS_HALTED() \
+        if (state -> halt) { \
+            return executed; \
+        } \
+        DISPATCH()
+
+    if (state -> halt) {
+        return 0;
+    }
+    DISPATCH();
+
+    labelUnknown: opUnknown(state, ins); DISPATCH_UNLESS_HALTED();
+    labelIgnored: opIgnored(state, ins); DISPATCH();
+
+    //halts is a constant, so each copy keeps only the dispatch it needs
+    #define THREADED_HANDLER(name, mask, match, mnemonic, operands, halts, pure) \
+        label##name: op##name(state, ins); \
+        if (halts) { \
+            DISPATCH_UNLESS_HALTED(); \
+        } \
+        DISPATCH();
+    CHIP8_OPCODES(THREADED_HANDLER)
+    #undef THREADED_HANDLER
+
+    //A fused sequence only runs when the whole of it fits in the batch, otherwise its first instruction runs alone
+    #define THREADED_FUSED_HANDLER(name, length, halts) \
+        labelFused##name: \
+        if (count - executed + 1 < length) { \
+            goto *labels[ins -> opcode]; \
+        } \
+        { \
+            int ran = fused##name(state, ins); \
+            state -> fused += ran; \
+            executed += ran - 1; \
+        } \
+        if (halts) { \
+            DISPATCH_UNLESS_HALTED(); \
+        } \
+        DISPATCH();
+    FUSED_SEQUENCES(THREADED_FUSED_HANDLER)
+    #undef THREADED_FUSED_HANDLER
+
+    #undef DISPATCH
+    #undef DISPATCH_UNLESS_HALTED
+}
+#else
+//Without labels-as-values, or when profiling, fall back to stepping emulateCHIP8
+int emulateCHIP8Threaded(CHIP8State *state, int count) {
+    return emulateCHIP8Batch(state, count);
+}
+#endif
+
+static void tickTimers(CHIP8State *state) {
+    //Several ticks can fall on the same cycle when IPS is below 60
+    while (state -> cycles >= state -> nextTimerCycle) {
+        if (state -> delay > 0) {
+            state -> delay -= 1;
+        }
+        if (state -> sound > 0) {
+            state -> sound -= 1;
+            state -> soundTicks++;
+        }
+
+        state -> timerTicks++;
+        state -> nextTimerCycle = state -> timerBase + ((state -> timerTicks + 1) * state -> ips) / TIMER_FREQUENCY;
+    }
+}
+
+void setSpeedCHIP8(CHIP8State *state, uint32_t ips) {
+    //Start counting ticks afresh from the current cycle, so changing speed never skips or repeats a tick
+    state -> ips = (ips > 0) ? ips : 1;
+    state -> timerBase = state -> cycles;
+    state -> timerTicks = 0;
+    state -> nextTimerCycle = state -> timerBase + (state -> ips / TIMER_FREQUENCY);
+    tickTimers(state);
+}
+
+#ifndef CHIP8_PROFILE
+#define OPCODE_PURE(name, mask, match, mnemonic, operands, halts, pure) [OPCODE_##name] = pure,
+static const uint8_t pureOpcodes[OPCODE_COUNT] = {
+    [OPCODE_IGNORED] = 1,
+    CHIP8_OPCODES(OPCODE_PURE)
+};
+#undef OPCODE_PURE
+
+//Whether pc could be in a loop skipIdleLoop would catch, judged from the code alone so other batches cost nothing:
+//pure instructions from pc up to FX0A, which waits by running itself again, or up to a jump back to pc or before
+//that closes a loop of at most MAX_IDLE_LOOP instructions
+static int inShortLoop(CHIP8State *state) {
+    uint16_t pc = (state -> pc) & 0xfff;
+    for (int i = 0; i < MAX_IDLE_LOOP; i++) {
+        uint16_t address = (pc + 2 * i) & 0xfff;
+        uint8_t opcode = opcodeAt(state, address);
+        if (!pureOpcodes[opcode]) {
+            return 0;
+        }
+        if (opcode == OPCODE_FX0A) {
+            return 1;
+        }
+
+        //A forward jump may be skipped over, so the scan carries on past it
+        uint16_t target = ((state -> memory[address] & 0xf) << 8) | state -> memory[address + 1];
+        if (opcode == OPCODE_1NNN && target <= pc && (address - target) / 2 < MAX_IDLE_LOOP) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//Steps the machine through its core one instruction at a time until pc is back at start, adding what it ran to *executed
+//Returns the loop's length, or 0 if it halted, reached an instruction that isn't pure, or ran limit instructions first
+static int stepLoop(CHIP8State *state, uint16_t start, int limit, int *executed) {
+    for (int length = 1; length <= limit; length++) {
+        if (state -> halt || !pureOpcodes[fetchInstruction(state) -> opcode]) {
+            return 0;
+        }
+        if (state -> core(state, 1) == 0) {
+            return 0;
+        }
+        (*executed)++;
+        if (state -> pc == start) {
+            return length;
+        }
+    }
+    return 0;
+}
+
+//Games mostly wait by polling the delay timer or in FX0A, in short loops that only touch registers
+//Within a batch, timers and keys can't change, so once one trip round such a loop leaves every register as it found
+//them, every later trip will too; the rest of the batch is skipped in whole trips, leaving the machine exactly where
+//running it would have
+//Checking takes up to two trips, stepped through the core so coverage hooks and compiled code still see every instruction
+//Returns how many instructions that accounted for, run and skipped
+static uint64_t skipIdleLoop(CHIP8State *state, uint64_t batch) {
+    int executed = 0;
+    uint16_t start = state -> pc;
+    int limit = (batch / 2 < MAX_IDLE_LOOP) ? batch / 2 : MAX_IDLE_LOOP;
+    if (limit == 0 || !inShortLoop(state)) {
+        return 0;
+    }
+
+    //The first trip may start partway through, with registers the loop hasn't set yet
+    if (stepLoop(state, start, limit, &executed) == 0) {
+        return executed;
+    }
+
+    uint8_t V[16];
+    memcpy(V, state -> V, 16);
+    uint16_t I = state -> I;
+    uint16_t sp = state -> sp;
+    uint8_t delay = state -> delay;
+    uint8_t sound = state -> sound;
+    uint8_t keyWait = state -> keyWait;
+
+    int length = stepLoop(state, start, limit, &executed);
+    if (length == 0 || memcmp(V, state -> V, 16) != 0 || I != state -> I || sp != state -> sp || delay != state -> delay
+        || sound != state -> sound || keyWait != state -> keyWait) {
+        return executed;
+    }
+
+    uint64_t skipped = (batch - executed) / length * length;
+    state -> idle += skipped;
+    return executed + skipped;
+}
+#endif
+
+uint64_t runCHIP8(CHIP8State *state, uint64_t count) {
+    uint64_t executed = 0;
+
+    while (executed < count && !(state -> halt)) {
+        //Batches stop at the next timer tick, so timers change on exactly the same cycle whichever core runs
+        uint64_t batch = state -> nextTimerCycle - state -> cycles;
+        if (batch > count - executed) {
+            batch = count - executed;
+        }
+        if (batch > CORE_BATCH_LIMIT) {
+            batch = CORE_BATCH_LIMIT;
+        }
+
+        //Idle detection runs its own instructions, so the core gets whatever is left of the batch
+        uint64_t ran = 0;
+#ifndef CHIP8_PROFILE
+        ran = skipIdleLoop(state, batch);
+#endif
+        if (ran < batch && !(state -> halt)) {
+            ran += state -> core(state, (int) (batch - ran));
+        }
+        executed += ran;
+        state -> cycles += ran;
+        tickTimers(state);
+
+        if (ran == 0) {
             break;
+        }
     }
-}
\ No newline at end of file
+
+    return executed;
+}
+
+uint64_t runFrameCHIP8(CHIP8State *state) {
+    //One 60Hz frame is everything up to and including the instruction that makes the timers tick
+    return runCHIP8(state, state -> nextTimerCycle - state -> cycles);
+}
+
+//Folds length bytes into hash 8 at a time, with a multiply and rotate per word; length must be a multiple of 8
+static uint64_t hashWords(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash = (hash << 31) | (hash >> 33);
+    }
+    return hash;
+}
+
+//Hash of everything that decides what the machine does next: registers, timers, keys, generator, clock, memory and screen
+//Pointers and caches are left out, so two machines in the same emulated state hash the same whichever core ran them
+uint64_t hashCHIP8(const CHIP8State *state) {
+    uint8_t registers[80] = {0};
+    memcpy(&registers[0], state -> V, 16);
+    memcpy(&registers[16], state -> keyState, 16);
+    memcpy(&registers[64], state -> savedKeyState, 16);    //FX0A compares against these to see a key released
+    registers[32] = state -> pc & 0xff;
+    registers[33] = state -> pc >> 8;
+    registers[34] = state -> sp & 0xff;
+    registers[35] = state -> sp >> 8;
+    registers[36] = state -> I & 0xff;
+    registers[37] = state -> I >> 8;
+    registers[38] = state -> delay;
+    registers[39] = state -> sound;
+    registers[40] = state -> halt;
+    registers[41] = state -> fault;
+    registers[42] = state -> keyWait;
+    for (int i = 0; i < 4; i++) {
+        registers[44 + i] = (uint8_t) (state -> rng >> (8 * i));
+    }
+    for (int i = 0; i < 8; i++) {
+        registers[48 + i] = (uint8_t) (state -> cycles >> (8 * i));
+        registers[56 + i] = (uint8_t) (state -> nextTimerCycle >> (8 * i));
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hashWords(hash, registers, sizeof(registers));
+    hash = hashWords(hash, state -> memory, 4096);  //The guard only repeats the first bytes
+    for (int i = 0; i < 32; i++) {
+        uint8_t row[8];
+        for (int b = 0; b < 8; b++) {
+            row[b] = (uint8_t) (state -> screen[i] >> (8 * b));
+        }
+        hash = hashWords(hash, row, 8);
+    }
+
+    return hash;
+}
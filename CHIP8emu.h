@@ -1,58 +1,245 @@
+#ifndef CHIP8EMU_H
+#define CHIP8EMU_H
+
 #include <stdint.h>
+#include <stddef.h>
+
+//Instructions per emulated second unless setSpeedCHIP8 says otherwise; delay and sound timers run at 60Hz
+#define DEFAULT_IPS 700
+#define TIMER_FREQUENCY 60
+
+//Programs load at 0x200, so they can fill the rest of the 4KB
+#define ROM_BASE 0x200
+#define MAX_ROM_SIZE (4096 - ROM_BASE)
+
+//Guest addresses are 12 bits and wrap at 4KB. Memory is followed by a copy of its first MEMORY_GUARD bytes,
+//so an access of up to that many bytes from any masked address stays in bounds and reads what wrapping would give
+//FX55 and FX65 move the most at once, 16 bytes
+#define MEMORY_GUARD 16
+
+typedef struct CHIP8State CHIP8State;
+typedef struct CHIP8Instruction CHIP8Instruction;
+typedef struct CHIP8Profile CHIP8Profile;
+
+//Runs up to count instructions, stopping early only on halt, and returns how many ran
+typedef int (*CHIP8Core)(CHIP8State *state, int count);
+
+//The one description of the instruction set: dispatch, disassembly and the profiler's names are all generated from it
+//OP(name, mask, match, mnemonic, operands, halts, pure)
+//An instruction is the first entry where (opcode & mask) == match; handlers are op##name
+//Operands are a template for the disassembler: x and y become register digits, nnn, nn and n the immediate in hex
+//halts marks handlers that can set the halt flag, which the threaded core checks after them
+//pure marks instructions that only change registers, so a loop of them that leaves the registers as they were is idle
+#define CHIP8_OPCODES(OP) \
+    OP(00E0, 0xf0ff, 0x00e0, "CLS",         "",             0, 0) \
+    OP(00EE, 0xf0ff, 0x00ee, "RTS",         "",             0, 0) \
+    OP(1NNN, 0xf000, 0x1000, "JUMP",        "$nnn",         1, 1) \
+    OP(2NNN, 0xf000, 0x2000, "CALL",        "$nnn",         0, 0) \
+    OP(3XNN, 0xf000, 0x3000, "SKIP_EQ",     "Vx,#$nn",      0, 1) \
+    OP(4XNN, 0xf000, 0x4000, "SKIP_NE",     "Vx,#$nn",      0, 1) \
+    OP(5XY0, 0xf000, 0x5000, "SKIP_EQ",     "Vx,Vy",        0, 1) \
+    OP(6XNN, 0xf000, 0x6000, "MVI",         "Vx,#$nn",      0, 1) \
+    OP(7XNN, 0xf000, 0x7000, "ADI",         "Vx,#$nn",      0, 1) \
+    OP(8XY0, 0xf00f, 0x8000, "MOV",         "Vx,Vy",        0, 1) \
+    OP(8XY1, 0xf00f, 0x8001, "OR",          "Vx,Vy",        0, 1) \
+    OP(8XY2, 0xf00f, 0x8002, "AND",         "Vx,Vy",        0, 1) \
+    OP(8XY3, 0xf00f, 0x8003, "XOR",         "Vx,Vy",        0, 1) \
+    OP(8XY4, 0xf00f, 0x8004, "ADD.",        "Vx,Vy",        0, 1) \
+    OP(8XY5, 0xf00f, 0x8005, "SUB.",        "Vx,Vx,Vy",     0, 1) \
+    OP(8XY6, 0xf00f, 0x8006, "SHR.",        "Vx,Vy",        0, 1) \
+    OP(8XY7, 0xf00f, 0x8007, "SUBB.",       "Vx,Vy,Vx",     0, 1) \
+    OP(8XYE, 0xf00f, 0x800e, "SHL.",        "Vx,Vy",        0, 1) \
+    OP(9XY0, 0xf000, 0x9000, "SKIP_NE",     "Vx,Vy",        0, 1) \
+    OP(ANNN, 0xf000, 0xa000, "MVI",         "I,#$nnn",      0, 1) \
+    OP(BNNN, 0xf000, 0xb000, "JUMP",        "$nnn(V0)",     1, 1) \
+    OP(CXNN, 0xf000, 0xc000, "RNDMSK",      "Vx,#$nn",      0, 0) \
+    OP(DXYN, 0xf000, 0xd000, "SPRITE",      "Vx,Vy,#$n",    0, 0) \
+    OP(EX9E, 0xf0ff, 0xe09e, "SKIPKEY_Y",   "Vx",           0, 1) \
+    OP(EXA1, 0xf0ff, 0xe0a1, "SKIPKEY_N",   "Vx",           0, 1) \
+    OP(FX07, 0xf0ff, 0xf007, "MOV",         "Vx,DELAY",     0, 1) \
+    OP(FX0A, 0xf0ff, 0xf00a, "KEY",         "Vx",           0, 1) \
+    OP(FX15, 0xf0ff, 0xf015, "MOV",         "DELAY,Vx",     0, 1) \
+    OP(FX18, 0xf0ff, 0xf018, "MOV",         "SOUND,Vx",     0, 1) \
+    OP(FX1E, 0xf0ff, 0xf01e, "ADI",         "I,Vx",         0, 1) \
+    OP(FX29, 0xf0ff, 0xf029, "SPRITECHAR",  "I,Vx",         0, 1) \
+    OP(FX33, 0xf0ff, 0xf033, "MOVBCD",      "(I),Vx",       0, 0) \
+    OP(FX55, 0xf0ff, 0xf055, "MOVM",        "(I),V0-Vx",    0, 0) \
+    OP(FX65, 0xf0ff, 0xf065, "MOVM",        "V0-Vx,(I)",    0, 1)
 
-typedef struct CHIP8State {
+//Every instruction in CHIP8_OPCODES, after the two ways an unrecognised one is handled:
+//unknown F-group instructions are ignored, anything else unrecognised faults
+#define CHIP8_OPCODE_ENUM(name, mask, match, mnemonic, operands, halts, pure) OPCODE_##name,
+typedef enum CHIP8Opcode {
+    OPCODE_UNKNOWN,
+    OPCODE_IGNORED,
+    CHIP8_OPCODES(CHIP8_OPCODE_ENUM)
+    OPCODE_COUNT
+} CHIP8Opcode;
+#undef CHIP8_OPCODE_ENUM
+
+typedef struct CHIP8OpcodeInfo {
+    const char *name;           //Pattern as written in the table, e.g. "8XY4"
+    const char *mnemonic;
+    const char *operands;
+    uint16_t mask;
+    uint16_t match;
+} CHIP8OpcodeInfo;
+
+extern const CHIP8OpcodeInfo opcodeInfoCHIP8[OPCODE_COUNT];
+
+typedef void (*CHIP8Handler)(CHIP8State *state, const CHIP8Instruction *ins);
+
+//Receives one line of diagnostics from the core, without a trailing newline
+typedef void (*CHIP8LogHook)(void *data, const char *message);
+
+//An instruction decoded once with its operand fields already extracted
+//A NULL handler means the address hasn't been decoded yet, or was overwritten since
+//dispatch is opcode, or above OPCODE_COUNT when a common sequence starts here that the interpreter cores can run
+//as one fused handler; handler and opcode still describe this instruction alone, for anything that steps one at a time
+struct CHIP8Instruction {
+    CHIP8Handler handler;
+    uint16_t nnn;
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint8_t nn;
+    uint8_t opcode;
+    uint8_t dispatch;
+};
+
+//One 64-byte aligned block: registers first, then memory, screen and decode cache inline, so a machine is a single allocation
+struct CHIP8State {
     uint16_t pc;
     uint16_t sp;
     uint8_t V[16];
     uint16_t I;
     uint8_t delay;
     uint8_t sound;
-    uint8_t *memory;
-    uint8_t *screen;
     uint8_t halt;
+    uint8_t fault;              //Set with halt when an instruction couldn't be executed
+    uint16_t faultAddress;      //Address of that instruction
     uint8_t keyState[16];
     uint8_t savedKeyState[16];
     uint8_t keyWait;
     uint8_t displayFlag;
-} CHIP8State;
+
+    //CXNN draws from this machine's own xorshift32, which every reset restarts from seed
+    uint32_t seed;
+    uint32_t rng;
+
+    //ROM the last reset loaded, and which 64-byte blocks of memory were written since, so a reset with the same ROM
+    //only has to restore those blocks
+    const uint8_t *rom;
+    uint16_t romSize;
+    uint64_t writtenBlocks;
+
+    //Called after every guest memory write, so other caches of decoded code can drop stale entries
+    void (*invalidateHook)(void *data, uint16_t address, uint16_t length);
+    void *invalidateHookData;
+
+    //Faults, detected infinite loops and other diagnostics go here; the core never prints, and drops them when this is NULL
+    CHIP8LogHook logHook;
+    void *logHookData;
+
+    //Emulated time is counted in instructions, and timers tick when the count reaches nextTimerCycle
+    //Tick k after the last speed change lands on cycle timerBase + k * ips / 60
+    uint64_t cycles;
+    uint32_t ips;
+    uint64_t timerBase;
+    uint64_t timerTicks;
+    uint64_t nextTimerCycle;
+
+    //Ticks since reset that found the sound timer running, so a host can hear tones as short as one tick even when
+    //the timer is back to 0 by the time it looks
+    uint64_t soundTicks;
+
+    //Instructions since reset that ran inside a fused handler, to see how much of a ROM fusion covers
+    uint64_t fused;
+
+    //Instructions since reset that runCHIP8 skipped over because the machine was idling in a loop; they still count in cycles
+    uint64_t idle;
+
+    //Batch core used by runCHIP8, and any data it needs
+    CHIP8Core core;
+    void *coreData;
+
+#ifdef CHIP8_PROFILE
+    CHIP8Profile *profile;      //Counts every instruction the interpreter runs while set; see profile/profile.h
+#endif
+
+    _Alignas(64) uint8_t memory[4096 + MEMORY_GUARD];    //Guard bytes mirror 0 onwards; see MEMORY_GUARD
+    _Alignas(64) uint64_t screen[32];               //32 rows, column 0 is the most significant bit of each row
+    _Alignas(64) CHIP8Instruction decodeCache[4096];  //One decoded entry per byte address, filled lazily
+};
+
+//xorshift32 behind CXNN, shared with the batch engine so a lane draws the same numbers as a machine with the same seed
+static inline uint32_t seedRandomCHIP8(uint32_t seed) {
+    uint32_t x = (seed + 1) * 0x9e3779b9u;
+    return x ? x : 1;           //xorshift never leaves 0
+}
+
+static inline uint32_t nextRandomCHIP8(uint32_t *rng) {
+    uint32_t x = *rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rng = x;
+    return x;
+}
 
 CHIP8State* initCHIP8(void);
+void setupCHIP8(CHIP8State *state);
+void resetCHIP8(CHIP8State *state, const uint8_t *rom, uint16_t size);
 void freeCHIP8(CHIP8State *state);
+int disassembleCHIP8(const uint8_t *memory, uint16_t address, char *out, size_t size);
 void decodeCHIP8(uint8_t *buffer, int pc);
+void decodeInstructionCHIP8(uint8_t *code, CHIP8Instruction *ins);
 void unimplementedInstruction(CHIP8State *state);
+void logCHIP8(CHIP8State *state, const char *format, ...);
+void seedCHIP8(CHIP8State *state, uint32_t seed);
+void invalidateCHIP8(CHIP8State *state, uint16_t address, uint16_t length);
 void emulateCHIP8(CHIP8State *state);
+int emulateCHIP8Batch(CHIP8State *state, int count);
+int emulateCHIP8Threaded(CHIP8State *state, int count);
+
+void setSpeedCHIP8(CHIP8State *state, uint32_t ips);
+uint64_t runCHIP8(CHIP8State *state, uint64_t count);
+uint64_t runFrameCHIP8(CHIP8State *state);
+uint64_t hashCHIP8(const CHIP8State *state);
+
+void op00E0(CHIP8State *state, const CHIP8Instruction *ins);
+void op00EE(CHIP8State *state, const CHIP8Instruction *ins);
+void op1NNN(CHIP8State *state, const CHIP8Instruction *ins);
+void op2NNN(CHIP8State *state, const CHIP8Instruction *ins);
+void op3XNN(CHIP8State *state, const CHIP8Instruction *ins);
+void op4XNN(CHIP8State *state, const CHIP8Instruction *ins);
+void op5XY0(CHIP8State *state, const CHIP8Instruction *ins);
+void op6XNN(CHIP8State *state, const CHIP8Instruction *ins);
+void op7XNN(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY0(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY1(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY2(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY3(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY4(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY5(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY6(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XY7(CHIP8State *state, const CHIP8Instruction *ins);
+void op8XYE(CHIP8State *state, const CHIP8Instruction *ins);
+void op9XY0(CHIP8State *state, const CHIP8Instruction *ins);
+void opANNN(CHIP8State *state, const CHIP8Instruction *ins);
+void opBNNN(CHIP8State *state, const CHIP8Instruction *ins);
+void opCXNN(CHIP8State *state, const CHIP8Instruction *ins);
+void opDXYN(CHIP8State *state, const CHIP8Instruction *ins);
+void opEX9E(CHIP8State *state, const CHIP8Instruction *ins);
+void opEXA1(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX07(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX0A(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX15(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX18(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX1E(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX29(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX33(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX55(CHIP8State *state, const CHIP8Instruction *ins);
+void opFX65(CHIP8State *state, const CHIP8Instruction *ins);
 
-void op00E0(CHIP8State *state, uint8_t *code);
-void op00EE(CHIP8State *state, uint8_t *code);
-void op1NNN(CHIP8State *state, uint8_t *code);
-void op2NNN(CHIP8State *state, uint8_t *code);
-void op3XNN(CHIP8State *state, uint8_t *code);
-void op4XNN(CHIP8State *state, uint8_t *code);
-void op5XY0(CHIP8State *state, uint8_t *code);
-void op6XNN(CHIP8State *state, uint8_t *code);
-void op7XNN(CHIP8State *state, uint8_t *code);
-void op8XY0(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XY1(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XY2(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XY3(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XY4(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XY5(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XY6(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XY7(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op8XYE(CHIP8State *state, uint8_t regX, uint8_t regY);
-void op9XY0(CHIP8State *state, uint8_t *code);
-void opANNN(CHIP8State *state, uint8_t *code);
-void opBNNN(CHIP8State *state, uint8_t *code);
-void opCXNN(CHIP8State *state, uint8_t *code);
-void opDXYN(CHIP8State *state, uint8_t *code);
-void opEX9E(CHIP8State *state, uint8_t *code);
-void opEXA1(CHIP8State *state, uint8_t *code);
-void opFX07(CHIP8State *state, uint8_t reg);
-void opFX0A(CHIP8State *state, uint8_t reg);
-void opFX15(CHIP8State *state, uint8_t reg);
-void opFX18(CHIP8State *state, uint8_t reg);
-void opFX1E(CHIP8State *state, uint8_t reg);
-void opFX29(CHIP8State *state, uint8_t reg);
-void opFX33(CHIP8State *state, uint8_t reg);
-void opFX55(CHIP8State *state, uint8_t reg);
-void opFX65(CHIP8State *state, uint8_t reg);
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "beeper.h"
+
+#define BEEPER_AMPLITUDE 3000
+
+//Sample within the callback's buffer that event plays at, which can be negative if it's overdue
+static int64_t eventSample(Beeper *beeper, const BeeperEvent *event, uint64_t now) {
+    int64_t ticks = (int64_t) (event -> time - now);
+    return ticks * beeper -> rate / (int64_t) beeper -> counterFrequency + beeper -> latencySamples;
+}
+
+static void fillBeeper(void *data, Uint8 *stream, int length) {
+    Beeper *beeper = data;
+    int16_t *out = (int16_t *) stream;
+    int count = length / (int) sizeof(int16_t);
+    uint64_t now = SDL_GetPerformanceCounter();
+
+    //SDL doesn't report underruns, but a callback arriving later than the device could buffer means it ran dry
+    if (beeper -> lastCallback != 0 && now - beeper -> lastCallback > beeper -> lateTicks) {
+        atomic_fetch_add_explicit(&(beeper -> underruns), 1, memory_order_relaxed);
+    }
+    beeper -> lastCallback = now;
+
+    //Acquire pairs with setBeeper's release, so the events up to head are fully written
+    unsigned tail = atomic_load_explicit(&(beeper -> tail), memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&(beeper -> head), memory_order_acquire);
+    uint32_t period = beeper -> rate / BEEPER_TONE;
+
+    int i = 0;
+    while (i < count) {
+        //Play the current state up to the next transition due in this buffer, or to the end of it
+        int end = count;
+        if (tail != head) {
+            int64_t at = eventSample(beeper, &(beeper -> ring[tail % BEEPER_RING]), now);
+            if (at <= i) {
+                beeper -> on = beeper -> ring[tail % BEEPER_RING].on;
+                tail++;
+                continue;
+            }
+            if (at < end) {
+                end = (int) at;
+            }
+        }
+
+        for (; i < end; i++) {
+            if (beeper -> on) {
+                out[i] = (beeper -> phase < period / 2) ? BEEPER_AMPLITUDE : -BEEPER_AMPLITUDE;
+            }
+            else {
+                out[i] = 0;
+            }
+            beeper -> phase = (beeper -> phase + 1) % period;
+        }
+    }
+
+    atomic_store_explicit(&(beeper -> tail), tail, memory_order_release);
+}
+
+Beeper* openBeeper(int rate, int samples, int latencyMs) {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+        printf("Audio could not be initialised, running silent. SDL Error: %s\n", SDL_GetError());
+        return NULL;
+    }
+
+    Beeper *beeper = calloc(1, sizeof(Beeper));
+    atomic_init(&(beeper -> head), 0);
+    atomic_init(&(beeper -> tail), 0);
+    atomic_init(&(beeper -> underruns), 0);
+
+    SDL_AudioSpec want, have;
+    SDL_zero(want);
+    want.freq = rate;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = samples;
+    want.callback = fillBeeper;
+    want.userdata = beeper;
+
+    //Take whatever rate and buffer the device prefers, but always mono 16-bit, which is all the callback writes
+    beeper -> device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if (beeper -> device == 0) {
+        printf("Audio device could not be opened, running silent. SDL Error: %s\n", SDL_GetError());
+        free(beeper);
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        return NULL;
+    }
+    beeper -> rate = have.freq;
+    beeper -> samples = have.samples;
+    beeper -> counterFrequency = SDL_GetPerformanceFrequency();
+
+    //A transition can't play before the callback after it, so the latency is at least one buffer
+    beeper -> latencySamples = (int64_t) latencyMs * beeper -> rate / 1000;
+    if (beeper -> latencySamples < beeper -> samples) {
+        beeper -> latencySamples = beeper -> samples;
+    }
+    beeper -> lateTicks = beeper -> counterFrequency * 2 * beeper -> samples / beeper -> rate;
+
+    printf("Audio: %s, %d Hz, %d sample buffer, %.1fms latency\n", SDL_GetCurrentAudioDriver(), beeper -> rate,
+        beeper -> samples, 1000.0 * beeper -> latencySamples / beeper -> rate);
+    SDL_PauseAudioDevice(beeper -> device, 0);
+    return beeper;
+}
+
+void closeBeeper(Beeper *beeper) {
+    if (beeper == NULL) {
+        return;
+    }
+    SDL_CloseAudioDevice(beeper -> device);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    printf("Audio underruns: %u, dropped transitions: %u\n", atomic_load(&(beeper -> underruns)), beeper -> dropped);
+    free(beeper);
+}
+
+void setBeeper(Beeper *beeper, bool on) {
+    if (on == beeper -> last) {
+        return;
+    }
+
+    //Acquire pairs with the callback's release, so a slot isn't overwritten before it's been read
+    unsigned head = atomic_load_explicit(&(beeper -> head), memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&(beeper -> tail), memory_order_acquire);
+    if (head - tail >= BEEPER_RING) {
+        beeper -> dropped++;
+        return;
+    }
+
+    beeper -> ring[head % BEEPER_RING].time = SDL_GetPerformanceCounter();
+    beeper -> ring[head % BEEPER_RING].on = on;
+    atomic_store_explicit(&(beeper -> head), head + 1, memory_order_release);
+    beeper -> last = on;
+}
@@ -0,0 +1,52 @@
+#ifndef BEEPER_H
+#define BEEPER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+
+//Square wave beeper for the sound timer, generated in the SDL audio callback
+//The emulation thread queues on/off transitions, stamped with the performance counter, on a single-producer
+//single-consumer ring, and the callback plays each one a fixed latency after it happened, so tones keep their length
+//however the callbacks and frames line up; neither side ever takes a lock
+#define DEFAULT_AUDIO_RATE 48000
+#define DEFAULT_AUDIO_SAMPLES 256       //5.3ms at 48kHz
+#define DEFAULT_AUDIO_LATENCY_MS 12     //From the frame that starts a tone to the callback playing it
+#define BEEPER_TONE 440
+#define BEEPER_RING 256                 //Power of two
+
+typedef struct BeeperEvent {
+    uint64_t time;                      //SDL_GetPerformanceCounter when the transition happened
+    uint8_t on;
+} BeeperEvent;
+
+typedef struct Beeper {
+    SDL_AudioDeviceID device;
+    int rate;
+    int samples;
+    int64_t latencySamples;
+    uint64_t counterFrequency;
+
+    BeeperEvent ring[BEEPER_RING];
+    _Alignas(64) atomic_uint head;      //Written by the emulation thread only
+    bool last;                          //Last state queued, so only changes are
+    uint32_t dropped;                   //Transitions lost to a full ring
+    _Alignas(64) atomic_uint tail;      //Written by the callback only
+    bool on;
+    uint32_t phase;
+    uint64_t lastCallback;
+    uint64_t lateTicks;                 //Gap between callbacks beyond which the device must have run dry
+    atomic_uint underruns;
+} Beeper;
+
+//Opens the default audio device, or whatever SDL_AUDIODRIVER names (dummy works without sound hardware)
+//samples is the device buffer size and latencyMs how long after a transition it's heard, at least one buffer
+//Returns NULL, having said why, if there's no audio to be had; the emulator runs silent then
+Beeper* openBeeper(int rate, int samples, int latencyMs);
+void closeBeeper(Beeper *beeper);
+
+//Emulation thread only: turns the tone on or off from now
+void setBeeper(Beeper *beeper, bool on);
+
+#endif
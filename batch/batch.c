@@ -0,0 +1,756 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BATCH_SIMD 1
+#endif
+
+//Byte registers for this many lanes fit in one AVX2 vector, so per-lane arrays are padded to a multiple of it
+#define LANE_VECTOR 32
+
+//remaining is 16-bit, so longer frames are run as several chunks
+#define CHUNK_LIMIT 65535
+
+//Records guest memory writes, so lanes stop sharing decoded code at those addresses
+static void markWritten(void *data, uint16_t address, uint16_t length) {
+    CHIP8Batch *batch = data;
+    for (int i = 0; i < length; i++) {
+        uint16_t a = (address + i) & 0xfff;
+        batch -> written[a >> 6] |= 1ull << (a & 63);
+    }
+}
+
+static int isWritten(CHIP8Batch *batch, uint16_t address) {
+    address &= 0xfff;
+    return (batch -> written[address >> 6] >> (address & 63)) & 1;
+}
+
+CHIP8Batch* initBatch(int lanes) {
+    if (lanes < 1) {
+        return NULL;
+    }
+
+    CHIP8Batch *b = calloc(1, sizeof(CHIP8Batch));
+    if (b == NULL) {
+        printf("Error: Unable to allocate a batch of %d lanes.\n", lanes);
+        return NULL;
+    }
+    b -> lanes = lanes;
+    b -> stride = ((lanes + LANE_VECTOR - 1) / LANE_VECTOR) * LANE_VECTOR;
+    int n = b -> stride;
+
+    b -> pc = calloc(n, sizeof(uint16_t));
+    b -> sp = calloc(n, sizeof(uint16_t));
+    b -> I = calloc(n, sizeof(uint16_t));
+    b -> delay = calloc(n, 1);
+    b -> sound = calloc(n, 1);
+    b -> halt = calloc(n, 1);
+    b -> fault = calloc(n, 1);
+    b -> faultAddress = calloc(n, sizeof(uint16_t));
+    b -> keyWait = calloc(n, 1);
+    b -> rng = calloc(n, sizeof(uint32_t));
+    b -> laneCycles = calloc(n, sizeof(uint64_t));
+    b -> memory = calloc((size_t) n * BATCH_MEMORY_SIZE, 1);
+    b -> screen = calloc((size_t) n * 32, sizeof(uint64_t));
+    b -> remaining = calloc(n, sizeof(uint16_t));
+    b -> mask16 = calloc(n, sizeof(uint16_t));
+    b -> mask8 = calloc(n, 1);
+    b -> decodeCache = calloc(4 * 1024, sizeof(CHIP8Instruction));
+
+    //Registers and keys are one block each, with register r for every lane stored together
+    b -> V[0] = calloc(16 * n, 1);
+    b -> keyState[0] = calloc(16 * n, 1);
+    b -> savedKeyState[0] = calloc(16 * n, 1);
+
+    //Aligned the way every machine is, which initCHIP8 takes care of on each platform
+    b -> scratch = initCHIP8();
+
+    if (b -> pc == NULL || b -> sp == NULL || b -> I == NULL || b -> delay == NULL || b -> sound == NULL
+        || b -> halt == NULL || b -> fault == NULL || b -> faultAddress == NULL || b -> keyWait == NULL
+        || b -> rng == NULL || b -> laneCycles == NULL || b -> memory == NULL || b -> screen == NULL
+        || b -> remaining == NULL || b -> mask16 == NULL || b -> mask8 == NULL || b -> decodeCache == NULL
+        || b -> V[0] == NULL || b -> keyState[0] == NULL || b -> savedKeyState[0] == NULL || b -> scratch == NULL) {
+        printf("Error: Unable to allocate a batch of %d lanes.\n", lanes);
+        freeBatch(b);
+        return NULL;
+    }
+    for (int r = 1; r < 16; r++) {
+        b -> V[r] = b -> V[0] + r * n;
+        b -> keyState[r] = b -> keyState[0] + r * n;
+        b -> savedKeyState[r] = b -> savedKeyState[0] + r * n;
+    }
+
+#ifdef BATCH_SIMD
+    __builtin_cpu_init();
+    b -> vector = __builtin_cpu_supports("avx2");
+#endif
+
+    seedBatch(b, 1);
+    return b;
+}
+
+void freeBatch(CHIP8Batch *batch) {
+    if (batch == NULL) {
+        return;
+    }
+
+    free(batch -> pc);
+    free(batch -> sp);
+    free(batch -> I);
+    free(batch -> delay);
+    free(batch -> sound);
+    free(batch -> halt);
+    free(batch -> fault);
+    free(batch -> faultAddress);
+    free(batch -> keyWait);
+    free(batch -> rng);
+    free(batch -> laneCycles);
+    free(batch -> memory);
+    free(batch -> screen);
+    free(batch -> remaining);
+    free(batch -> mask16);
+    free(batch -> mask8);
+    free(batch -> decodeCache);
+    free(batch -> V[0]);
+    free(batch -> keyState[0]);
+    free(batch -> savedKeyState[0]);
+    freeCHIP8(batch -> scratch);
+    free(batch);
+}
+
+//Copies one machine, including memory, screen and clock, into every lane
+void loadBatch(CHIP8Batch *batch, const CHIP8State *state) {
+    for (int l = 0; l < batch -> stride; l++) {
+        batch -> pc[l] = state -> pc;
+        batch -> sp[l] = state -> sp;
+        batch -> I[l] = state -> I;
+        batch -> delay[l] = state -> delay;
+        batch -> sound[l] = state -> sound;
+        batch -> fault[l] = state -> fault;
+        batch -> faultAddress[l] = state -> faultAddress;
+        batch -> keyWait[l] = state -> keyWait;
+        batch -> laneCycles[l] = state -> cycles;
+        for (int r = 0; r < 16; r++) {
+            batch -> V[r][l] = state -> V[r];
+            batch -> keyState[r][l] = state -> keyState[r];
+            batch -> savedKeyState[r][l] = state -> savedKeyState[r];
+        }
+        memcpy(&(batch -> memory[(size_t) l * BATCH_MEMORY_SIZE]), state -> memory, BATCH_MEMORY_SIZE);
+        memcpy(&(batch -> screen[(size_t) l * 32]), state -> screen, 32 * sizeof(uint64_t));
+
+        //Padding lanes stay halted so they never join a group
+        batch -> halt[l] = (l < batch -> lanes) ? state -> halt : 1;
+    }
+
+    batch -> cycles = state -> cycles;
+    batch -> ips = state -> ips;
+    batch -> timerBase = state -> timerBase;
+    batch -> timerTicks = state -> timerTicks;
+    batch -> nextTimerCycle = state -> nextTimerCycle;
+
+    //Every lane now holds the same code, so the shared decode cache is valid everywhere again
+    memset(batch -> written, 0, sizeof(batch -> written));
+    memset(batch -> decodeCache, 0, 4 * 1024 * sizeof(CHIP8Instruction));
+
+    seedBatch(batch, state -> seed);
+}
+
+void seedBatch(CHIP8Batch *batch, uint32_t seed) {
+    batch -> seed = seed;
+    for (int l = 0; l < batch -> stride; l++) {
+        //Lane l draws the same numbers as a machine seeded with seed + l
+        batch -> rng[l] = seedRandomCHIP8(seed + l);
+    }
+}
+
+void keyDownBatch(CHIP8Batch *batch, int lane, uint8_t key) {
+    if (lane >= 0 && lane < batch -> lanes && key < 16) {
+        batch -> keyState[key][lane] = 1;
+    }
+}
+
+void keyUpBatch(CHIP8Batch *batch, int lane, uint8_t key) {
+    if (lane >= 0 && lane < batch -> lanes && key < 16) {
+        batch -> keyState[key][lane] = 0;
+    }
+}
+
+static void loadLane(CHIP8Batch *batch, int l, CHIP8State *s) {
+    s -> pc = batch -> pc[l];
+    s -> sp = batch -> sp[l];
+    s -> I = batch -> I[l];
+    s -> delay = batch -> delay[l];
+    s -> sound = batch -> sound[l];
+    s -> halt = batch -> halt[l];
+    s -> fault = batch -> fault[l];
+    s -> faultAddress = batch -> faultAddress[l];
+    s -> keyWait = batch -> keyWait[l];
+    for (int r = 0; r < 16; r++) {
+        s -> V[r] = batch -> V[r][l];
+        s -> keyState[r] = batch -> keyState[r][l];
+        s -> savedKeyState[r] = batch -> savedKeyState[r][l];
+    }
+}
+
+static void storeLane(CHIP8Batch *batch, int l, const CHIP8State *s) {
+    batch -> pc[l] = s -> pc;
+    batch -> sp[l] = s -> sp;
+    batch -> I[l] = s -> I;
+    batch -> delay[l] = s -> delay;
+    batch -> sound[l] = s -> sound;
+    batch -> halt[l] = s -> halt;
+    batch -> fault[l] = s -> fault;
+    batch -> faultAddress[l] = s -> faultAddress;
+    batch -> keyWait[l] = s -> keyWait;
+    for (int r = 0; r < 16; r++) {
+        batch -> V[r][l] = s -> V[r];
+        batch -> savedKeyState[r][l] = s -> savedKeyState[r];
+    }
+}
+
+//A lane that halts keeps the cycle count it stopped at, and takes no further part in the run
+static void haltLane(CHIP8Batch *batch, int l, uint16_t length) {
+    batch -> halt[l] = 1;
+    batch -> laneCycles[l] += length - batch -> remaining[l];
+    batch -> remaining[l] = 0;
+}
+
+void getLaneBatch(CHIP8Batch *batch, int lane, CHIP8State *out) {
+    CHIP8Core core = out -> core;
+    void *coreData = out -> coreData;
+    void (*invalidateHook)(void *data, uint16_t address, uint16_t length) = out -> invalidateHook;
+    void *invalidateHookData = out -> invalidateHookData;
+    CHIP8LogHook logHook = out -> logHook;
+    void *logHookData = out -> logHookData;
+#ifdef CHIP8_PROFILE
+    CHIP8Profile *profile = out -> profile;
+#endif
+
+    memset(out, 0, sizeof(CHIP8State));
+    out -> core = core;
+    out -> coreData = coreData;
+    out -> invalidateHook = invalidateHook;
+    out -> invalidateHookData = invalidateHookData;
+    out -> logHook = logHook;
+    out -> logHookData = logHookData;
+#ifdef CHIP8_PROFILE
+    out -> profile = profile;
+#endif
+
+    loadLane(batch, lane, out);
+    memcpy(out -> memory, &(batch -> memory[(size_t) lane * BATCH_MEMORY_SIZE]), BATCH_MEMORY_SIZE);
+    memcpy(out -> screen, &(batch -> screen[(size_t) lane * 32]), sizeof(out -> screen));
+
+    //Every byte of memory is new to the machine, so this fills the guard and drops anything a JIT compiled from the old bytes
+    invalidateCHIP8(out, 0, BATCH_MEMORY_SIZE);
+    out -> seed = batch -> seed + lane;
+    out -> rng = batch -> rng[lane];
+    out -> cycles = batch -> laneCycles[lane];
+    out -> ips = batch -> ips;
+    out -> timerBase = batch -> timerBase;
+    out -> timerTicks = batch -> timerTicks;
+    out -> nextTimerCycle = batch -> nextTimerCycle;
+}
+
+//Picks the lowest PC among lanes still running, so lanes that branched apart meet again at the join point
+//Marks every lane at that PC in the masks, and advances their PC and remaining count
+static int selectGroupScalar(CHIP8Batch *batch, uint16_t *leader) {
+    uint32_t best = 0x10000;
+    for (int l = 0; l < batch -> stride; l++) {
+        if (batch -> remaining[l] && batch -> pc[l] < best) {
+            best = batch -> pc[l];
+        }
+    }
+    if (best == 0x10000) {
+        return 0;
+    }
+
+    int count = 0;
+    for (int l = 0; l < batch -> stride; l++) {
+        int active = batch -> remaining[l] && batch -> pc[l] == best;
+        batch -> mask16[l] = active ? 0xFFFF : 0;
+        batch -> mask8[l] = active ? 0xFF : 0;
+        if (active) {
+            batch -> pc[l] += 2;
+            batch -> remaining[l] -= 1;
+            count++;
+        }
+    }
+
+    *leader = best;
+    return count;
+}
+
+#ifdef BATCH_SIMD
+#define LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define STORE(p, v) _mm256_storeu_si256((__m256i *) (p), (v))
+#define LOAD_HALF(p) _mm_loadu_si128((const __m128i *) (p))
+
+__attribute__((target("avx2")))
+static int selectGroupAVX2(CHIP8Batch *batch, uint16_t *leader) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i best = _mm256_set1_epi16(-1);
+    __m256i any = zero;
+
+    //Lanes with nothing left count as PC 0xFFFF, so they never win the minimum unless every lane is idle
+    for (int l = 0; l < batch -> stride; l += 16) {
+        __m256i pc = LOAD(&(batch -> pc[l]));
+        __m256i remaining = LOAD(&(batch -> remaining[l]));
+        best = _mm256_min_epu16(best, _mm256_or_si256(pc, _mm256_cmpeq_epi16(remaining, zero)));
+        any = _mm256_or_si256(any, remaining);
+    }
+    if (_mm256_testz_si256(any, any)) {
+        return 0;
+    }
+
+    __m128i half = _mm_min_epu16(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    uint16_t lead = _mm_cvtsi128_si32(_mm_minpos_epu16(half)) & 0xffff;
+
+    const __m256i leadPC = _mm256_set1_epi16((short) lead);
+    const __m256i two = _mm256_set1_epi16(2);
+    int count = 0;
+
+    for (int l = 0; l < batch -> stride; l += 32) {
+        __m256i pcA = LOAD(&(batch -> pc[l]));
+        __m256i pcB = LOAD(&(batch -> pc[l + 16]));
+        __m256i remainingA = LOAD(&(batch -> remaining[l]));
+        __m256i remainingB = LOAD(&(batch -> remaining[l + 16]));
+        __m256i maskA = _mm256_andnot_si256(_mm256_cmpeq_epi16(remainingA, zero), _mm256_cmpeq_epi16(pcA, leadPC));
+        __m256i maskB = _mm256_andnot_si256(_mm256_cmpeq_epi16(remainingB, zero), _mm256_cmpeq_epi16(pcB, leadPC));
+
+        //Masks are all ones, so adding them takes 1 off remaining
+        STORE(&(batch -> pc[l]), _mm256_add_epi16(pcA, _mm256_and_si256(maskA, two)));
+        STORE(&(batch -> pc[l + 16]), _mm256_add_epi16(pcB, _mm256_and_si256(maskB, two)));
+        STORE(&(batch -> remaining[l]), _mm256_add_epi16(remainingA, maskA));
+        STORE(&(batch -> remaining[l + 16]), _mm256_add_epi16(remainingB, maskB));
+        STORE(&(batch -> mask16[l]), maskA);
+        STORE(&(batch -> mask16[l + 16]), maskB);
+
+        //Packing works within 128-bit halves, so the permute puts the lanes back in order
+        __m256i mask = _mm256_permute4x64_epi64(_mm256_packs_epi16(maskA, maskB), 0xD8);
+        STORE(&(batch -> mask8[l]), mask);
+        count += __builtin_popcount((uint32_t) _mm256_movemask_epi8(mask));
+    }
+
+    *leader = lead;
+    return count;
+}
+
+//Adds 2 to the PC of lanes whose byte in skip is set, for the conditional skips
+__attribute__((target("avx2")))
+static void skipLanes(CHIP8Batch *batch, int l, __m256i skip) {
+    const __m256i two = _mm256_set1_epi16(2);
+    __m256i low = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(skip));
+    __m256i high = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(skip, 1));
+    STORE(&(batch -> pc[l]), _mm256_add_epi16(LOAD(&(batch -> pc[l])), _mm256_and_si256(low, two)));
+    STORE(&(batch -> pc[l + 16]), _mm256_add_epi16(LOAD(&(batch -> pc[l + 16])), _mm256_and_si256(high, two)));
+}
+
+//Runs the group's instruction on every masked lane at once, with the same results as the scalar handlers
+//Returns 0 for instructions it doesn't cover, which then run one lane at a time
+__attribute__((target("avx2")))
+static int executeGroupAVX2(CHIP8Batch *batch, const CHIP8Instruction *ins, uint16_t leader, uint16_t length) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    uint8_t *vx = batch -> V[ins -> x];
+    uint8_t *vy = batch -> V[ins -> y];
+    uint8_t *vf = batch -> V[0xF];
+
+    switch (ins -> opcode) {
+        case OPCODE_IGNORED:
+            return 1;
+
+        case OPCODE_1NNN: {
+            const __m256i target = _mm256_set1_epi16(ins -> nnn);
+            for (int l = 0; l < batch -> stride; l += 16) {
+                __m256i mask = LOAD(&(batch -> mask16[l]));
+                STORE(&(batch -> pc[l]), _mm256_blendv_epi8(LOAD(&(batch -> pc[l])), target, mask));
+            }
+            //Every lane in the group jumped from the same address, so they all hit a jump to self together
+            if (ins -> nnn == leader) {
+                for (int l = 0; l < batch -> stride; l++) {
+                    if (batch -> mask8[l]) {
+                        haltLane(batch, l, length);
+                    }
+                }
+            }
+            return 1;
+        }
+
+        case OPCODE_3XNN:
+        case OPCODE_4XNN:
+        case OPCODE_5XY0:
+        case OPCODE_9XY0: {
+            const __m256i nn = _mm256_set1_epi8((char) ins -> nn);
+            int compareRegister = (ins -> opcode == OPCODE_5XY0 || ins -> opcode == OPCODE_9XY0);
+            int skipEqual = (ins -> opcode == OPCODE_3XNN || ins -> opcode == OPCODE_5XY0);
+            for (int l = 0; l < batch -> stride; l += 32) {
+                __m256i mask = LOAD(&(batch -> mask8[l]));
+                __m256i equal = _mm256_cmpeq_epi8(LOAD(&vx[l]), compareRegister ? LOAD(&vy[l]) : nn);
+                skipLanes(batch, l, skipEqual ? _mm256_and_si256(equal, mask) : _mm256_andnot_si256(equal, mask));
+            }
+            return 1;
+        }
+
+        case OPCODE_6XNN:
+        case OPCODE_7XNN: {
+            const __m256i nn = _mm256_set1_epi8((char) ins -> nn);
+            for (int l = 0; l < batch -> stride; l += 32) {
+                __m256i x = LOAD(&vx[l]);
+                __m256i result = (ins -> opcode == OPCODE_6XNN) ? nn : _mm256_add_epi8(x, nn);
+                STORE(&vx[l], _mm256_blendv_epi8(x, result, LOAD(&(batch -> mask8[l]))));
+            }
+            return 1;
+        }
+
+        case OPCODE_8XY0:
+        case OPCODE_8XY1:
+        case OPCODE_8XY2:
+        case OPCODE_8XY3:
+        case OPCODE_8XY4:
+        case OPCODE_8XY5:
+        case OPCODE_8XY6:
+        case OPCODE_8XY7:
+        case OPCODE_8XYE:
+            for (int l = 0; l < batch -> stride; l += 32) {
+                __m256i mask = LOAD(&(batch -> mask8[l]));
+                __m256i x = LOAD(&vx[l]);
+                __m256i y = LOAD(&vy[l]);
+                __m256i result;
+                __m256i flag = zero;
+                int setsFlag = 1;
+
+                switch (ins -> opcode) {
+                    case OPCODE_8XY0: result = y; setsFlag = 0; break;
+                    case OPCODE_8XY1: result = _mm256_or_si256(x, y); break;
+                    case OPCODE_8XY2: result = _mm256_and_si256(x, y); break;
+                    case OPCODE_8XY3: result = _mm256_xor_si256(x, y); break;
+                    case OPCODE_8XY4:
+                        //Carry out of an unsigned add means the sum came out smaller than VX
+                        result = _mm256_add_epi8(x, y);
+                        flag = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(result, x), result), one);
+                        break;
+                    case OPCODE_8XY5:
+                        //VF is 1 unless VY > VX
+                        result = _mm256_sub_epi8(x, y);
+                        flag = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(x, y), x), one);
+                        break;
+                    case OPCODE_8XY6:
+                        result = _mm256_and_si256(_mm256_srli_epi16(y, 1), _mm256_set1_epi8(0x7f));
+                        flag = _mm256_and_si256(y, one);
+                        break;
+                    case OPCODE_8XY7:
+                        result = _mm256_sub_epi8(y, x);
+                        flag = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(x, y), y), one);
+                        break;
+                    default:
+                        result = _mm256_add_epi8(y, y);
+                        flag = _mm256_and_si256(_mm256_srli_epi16(y, 7), one);
+                        break;
+                }
+
+                //VF is written after VX, so it wins when X is F
+                STORE(&vx[l], _mm256_blendv_epi8(x, result, mask));
+                if (setsFlag) {
+                    STORE(&vf[l], _mm256_blendv_epi8(LOAD(&vf[l]), flag, mask));
+                }
+            }
+            return 1;
+
+        case OPCODE_ANNN: {
+            const __m256i target = _mm256_set1_epi16(ins -> nnn);
+            for (int l = 0; l < batch -> stride; l += 16) {
+                __m256i mask = LOAD(&(batch -> mask16[l]));
+                STORE(&(batch -> I[l]), _mm256_blendv_epi8(LOAD(&(batch -> I[l])), target, mask));
+            }
+            return 1;
+        }
+
+        case OPCODE_EX9E:
+        case OPCODE_EXA1:
+            //Only the low nibble of VX picks a key, as in the handlers
+            for (int l = 0; l < batch -> stride; l += 32) {
+                __m256i mask = LOAD(&(batch -> mask8[l]));
+                __m256i key = _mm256_and_si256(LOAD(&vx[l]), _mm256_set1_epi8(0x0f));
+                __m256i pressed = zero;
+                for (int k = 0; k < 16; k++) {
+                    __m256i match = _mm256_cmpeq_epi8(key, _mm256_set1_epi8((char) k));
+                    pressed = _mm256_or_si256(pressed, _mm256_and_si256(match, LOAD(&(batch -> keyState[k][l]))));
+                }
+                __m256i released = _mm256_cmpeq_epi8(pressed, zero);
+                skipLanes(batch, l, (ins -> opcode == OPCODE_EX9E) ? _mm256_andnot_si256(released, mask) : _mm256_and_si256(released, mask));
+            }
+            return 1;
+
+        case OPCODE_FX07:
+        case OPCODE_FX15:
+        case OPCODE_FX18:
+            for (int l = 0; l < batch -> stride; l += 32) {
+                __m256i mask = LOAD(&(batch -> mask8[l]));
+                if (ins -> opcode == OPCODE_FX07) {
+                    STORE(&vx[l], _mm256_blendv_epi8(LOAD(&vx[l]), LOAD(&(batch -> delay[l])), mask));
+                }
+                else {
+                    uint8_t *timer = (ins -> opcode == OPCODE_FX15) ? batch -> delay : batch -> sound;
+                    STORE(&timer[l], _mm256_blendv_epi8(LOAD(&timer[l]), LOAD(&vx[l]), mask));
+                }
+            }
+            return 1;
+
+        case OPCODE_FX1E:
+        case OPCODE_FX29: {
+            const __m256i high = _mm256_set1_epi16((short) 0xF000);
+            for (int l = 0; l < batch -> stride; l += 32) {
+                __m256i mask = LOAD(&(batch -> mask8[l]));
+                __m256i flags[2];
+                for (int h = 0; h < 2; h++) {
+                    __m256i x = _mm256_cvtepu8_epi16(LOAD_HALF(&vx[l + 16 * h]));
+                    __m256i i = LOAD(&(batch -> I[l + 16 * h]));
+                    __m256i result;
+                    if (ins -> opcode == OPCODE_FX1E) {
+                        result = _mm256_add_epi16(i, x);
+                        flags[h] = _mm256_xor_si256(_mm256_cmpeq_epi16(_mm256_and_si256(result, high), zero), _mm256_set1_epi16(-1));
+                    }
+                    else {
+                        result = _mm256_add_epi16(_mm256_slli_epi16(x, 2), x);
+                    }
+                    STORE(&(batch -> I[l + 16 * h]), _mm256_blendv_epi8(i, result, LOAD(&(batch -> mask16[l + 16 * h]))));
+                }
+                if (ins -> opcode == OPCODE_FX1E) {
+                    //VF is set when I went past 0xFFF
+                    __m256i flag = _mm256_and_si256(_mm256_permute4x64_epi64(_mm256_packs_epi16(flags[0], flags[1]), 0xD8), one);
+                    STORE(&vf[l], _mm256_blendv_epi8(LOAD(&vf[l]), flag, mask));
+                }
+            }
+            return 1;
+        }
+
+        default:
+            return 0;
+    }
+}
+#endif
+
+//Copies out the instruction at address in one lane's memory
+//Lanes sit back to back with no guard, so one at 0xfff takes its second byte from the same lane's address 0
+static void laneCode(CHIP8Batch *batch, int lane, uint16_t address, uint8_t *code) {
+    const uint8_t *memory = &(batch -> memory[(size_t) lane * BATCH_MEMORY_SIZE]);
+    code[0] = memory[address];
+    code[1] = memory[(address + 1) & 0xfff];
+}
+
+//Fetches the group's instruction. Where no lane has written, every lane holds the ROM's bytes and the shared cache is used
+//Otherwise lanes at this PC may hold different code: the first lane's runs now, and the rest go back for a later group
+static int fetchGroup(CHIP8Batch *batch, uint16_t leader, CHIP8Instruction *ins) {
+    uint16_t address = leader & 0xfff;
+    uint8_t code[2];
+    if (!isWritten(batch, address) && !isWritten(batch, address + 1)) {
+        CHIP8Instruction *cached = &(batch -> decodeCache[address]);
+        if (cached -> handler == NULL) {
+            laneCode(batch, 0, address, code);
+            decodeInstructionCHIP8(code, cached);
+        }
+        *ins = *cached;
+        return 0;
+    }
+
+    int dropped = 0;
+    int found = 0;
+    uint8_t first[2];
+    for (int l = 0; l < batch -> stride; l++) {
+        if (!(batch -> mask8[l])) {
+            continue;
+        }
+
+        laneCode(batch, l, address, code);
+        if (!found) {
+            found = 1;
+            first[0] = code[0];
+            first[1] = code[1];
+            decodeInstructionCHIP8(code, ins);
+        }
+        else if (code[0] != first[0] || code[1] != first[1]) {
+            batch -> mask8[l] = 0;
+            batch -> mask16[l] = 0;
+            batch -> pc[l] -= 2;
+            batch -> remaining[l] += 1;
+            dropped++;
+        }
+    }
+    return dropped;
+}
+
+//Instructions that touch memory or the screen work on the lane's own arrays, the same way the handlers do
+//Addresses wrap at 4KB so a lane can never reach the next lane's memory
+static void drawLane(CHIP8Batch *batch, int l, const CHIP8Instruction *ins) {
+    uint8_t *memory = &(batch -> memory[(size_t) l * BATCH_MEMORY_SIZE]);
+    uint64_t *screen = &(batch -> screen[(size_t) l * 32]);
+    uint8_t x = batch -> V[ins -> x][l] & 0x3f;
+    uint8_t y = batch -> V[ins -> y][l] & 0x1f;
+    int rows = ins -> n;
+
+    if (y + rows > 32) {
+        rows = 32 - y;
+    }
+
+    uint64_t collision = 0;
+    for (int i = 0; i < rows; i++) {
+        uint64_t line = ((uint64_t) memory[(batch -> I[l] + i) & 0xfff] << 56) >> x;
+        collision |= screen[y + i] & line;
+        screen[y + i] ^= line;
+    }
+    batch -> V[0xF][l] = (collision != 0);
+}
+
+static void callLane(CHIP8Batch *batch, int l, const CHIP8Instruction *ins) {
+    uint8_t *memory = &(batch -> memory[(size_t) l * BATCH_MEMORY_SIZE]);
+    batch -> sp[l] -= 2;
+    uint16_t sp = batch -> sp[l];
+    memory[sp & 0xfff] = batch -> pc[l] >> 8;
+    memory[(sp + 1) & 0xfff] = batch -> pc[l] & 0xff;
+    batch -> pc[l] = ins -> nnn;
+    markWritten(batch, sp, 2);
+}
+
+static void returnLane(CHIP8Batch *batch, int l) {
+    uint8_t *memory = &(batch -> memory[(size_t) l * BATCH_MEMORY_SIZE]);
+    uint16_t sp = batch -> sp[l];
+    batch -> pc[l] = (memory[sp & 0xfff] << 8) | memory[(sp + 1) & 0xfff];
+    batch -> sp[l] += 2;
+}
+
+static void storeBCDLane(CHIP8Batch *batch, int l, const CHIP8Instruction *ins) {
+    uint8_t *memory = &(batch -> memory[(size_t) l * BATCH_MEMORY_SIZE]);
+    uint8_t value = batch -> V[ins -> x][l];
+    uint16_t I = batch -> I[l];
+    memory[I & 0xfff] = (value / 100) % 10;
+    memory[(I + 1) & 0xfff] = (value / 10) % 10;
+    memory[(I + 2) & 0xfff] = value % 10;
+    markWritten(batch, I, 3);
+}
+
+static void storeRegistersLane(CHIP8Batch *batch, int l, const CHIP8Instruction *ins) {
+    uint8_t *memory = &(batch -> memory[(size_t) l * BATCH_MEMORY_SIZE]);
+    uint16_t I = batch -> I[l];
+    for (int i = 0; i <= ins -> x; i++) {
+        memory[(I + i) & 0xfff] = batch -> V[i][l];
+    }
+    markWritten(batch, I, ins -> x + 1);
+    batch -> I[l] += ins -> x + 1;
+}
+
+static void loadRegistersLane(CHIP8Batch *batch, int l, const CHIP8Instruction *ins) {
+    uint8_t *memory = &(batch -> memory[(size_t) l * BATCH_MEMORY_SIZE]);
+    uint16_t I = batch -> I[l];
+    for (int i = 0; i <= ins -> x; i++) {
+        batch -> V[i][l] = memory[(I + i) & 0xfff];
+    }
+    batch -> I[l] += ins -> x + 1;
+}
+
+//Runs the group's instruction one lane at a time
+//Register-only instructions go through the ordinary handlers on a copy of the lane's registers
+static void executeGroupLanes(CHIP8Batch *batch, const CHIP8Instruction *ins, uint16_t length) {
+    for (int l = 0; l < batch -> stride; l++) {
+        if (!(batch -> mask8[l])) {
+            continue;
+        }
+
+        switch (ins -> opcode) {
+            //CXNN uses the lane's own generator rather than rand(), whichever path runs it
+            case OPCODE_CXNN: batch -> V[ins -> x][l] = nextRandomCHIP8(&(batch -> rng[l])) & ins -> nn; continue;
+            case OPCODE_DXYN: drawLane(batch, l, ins); continue;
+            case OPCODE_00E0: memset(&(batch -> screen[(size_t) l * 32]), 0, 32 * sizeof(uint64_t)); continue;
+            case OPCODE_00EE: returnLane(batch, l); continue;
+            case OPCODE_2NNN: callLane(batch, l, ins); continue;
+            case OPCODE_FX33: storeBCDLane(batch, l, ins); continue;
+            case OPCODE_FX55: storeRegistersLane(batch, l, ins); continue;
+            case OPCODE_FX65: loadRegistersLane(batch, l, ins); continue;
+            default: break;
+        }
+
+        loadLane(batch, l, batch -> scratch);
+        ins -> handler(batch -> scratch, ins);
+        storeLane(batch, l, batch -> scratch);
+
+        if (batch -> halt[l]) {
+            haltLane(batch, l, length);
+        }
+    }
+}
+
+//Runs every lane for exactly length instructions, or until it halts, and returns the total run across lanes
+static uint64_t runChunk(CHIP8Batch *batch, uint16_t length) {
+    uint64_t executed = 0;
+
+    for (int l = 0; l < batch -> stride; l++) {
+        batch -> remaining[l] = batch -> halt[l] ? 0 : length;
+    }
+
+    while (1) {
+        uint16_t leader;
+        int count;
+#ifdef BATCH_SIMD
+        count = batch -> vector ? selectGroupAVX2(batch, &leader) : selectGroupScalar(batch, &leader);
+#else
+        count = selectGroupScalar(batch, &leader);
+#endif
+        if (count == 0) {
+            break;
+        }
+
+        CHIP8Instruction ins;
+        count -= fetchGroup(batch, leader, &ins);
+        executed += count;
+        batch -> groups++;
+
+#ifdef BATCH_SIMD
+        if (batch -> vector && executeGroupAVX2(batch, &ins, leader, length)) {
+            continue;
+        }
+#endif
+        executeGroupLanes(batch, &ins, length);
+    }
+
+    for (int l = 0; l < batch -> stride; l++) {
+        if (!(batch -> halt[l])) {
+            batch -> laneCycles[l] += length;
+        }
+    }
+    return executed;
+}
+
+uint64_t runFrameBatch(CHIP8Batch *batch) {
+    //Same frame boundary as runFrameCHIP8: everything up to and including the instruction that makes the timers tick
+    uint64_t frame = batch -> nextTimerCycle - batch -> cycles;
+    uint64_t executed = 0;
+
+    while (frame > 0) {
+        uint16_t length = (frame > CHUNK_LIMIT) ? CHUNK_LIMIT : frame;
+        executed += runChunk(batch, length);
+        batch -> cycles += length;
+        frame -= length;
+    }
+
+    //A lane only ticks if it reached the tick's cycle, which a lane that halted earlier didn't
+    while (batch -> cycles >= batch -> nextTimerCycle) {
+        for (int l = 0; l < batch -> lanes; l++) {
+            if (batch -> laneCycles[l] >= batch -> nextTimerCycle) {
+                if (batch -> delay[l] > 0) {
+                    batch -> delay[l] -= 1;
+                }
+                if (batch -> sound[l] > 0) {
+                    batch -> sound[l] -= 1;
+                }
+            }
+        }
+
+        batch -> timerTicks++;
+        batch -> nextTimerCycle = batch -> timerBase + ((batch -> timerTicks + 1) * batch -> ips) / TIMER_FREQUENCY;
+    }
+
+    return executed;
+}
@@ -0,0 +1,67 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "../CHIP8emu.h"
+
+//Lockstep engine that runs many instances (lanes) of one ROM side by side
+//Each register is an array with one entry per lane, so lanes at the same PC run an instruction together,
+//using AVX2 where the host has it; lanes that branch apart run as separate groups until their PCs meet again
+#define BATCH_MEMORY_SIZE 4096
+
+typedef struct CHIP8Batch CHIP8Batch;
+
+struct CHIP8Batch {
+    int lanes;
+    int stride;                 //Lanes rounded up to whole vectors; every per-lane array has this many entries
+
+    uint16_t *pc;
+    uint16_t *sp;
+    uint16_t *I;
+    uint8_t *V[16];
+    uint8_t *delay;
+    uint8_t *sound;
+    uint8_t *halt;
+    uint8_t *fault;
+    uint16_t *faultAddress;
+    uint8_t *keyState[16];
+    uint8_t *savedKeyState[16];
+    uint8_t *keyWait;
+    uint32_t *rng;              //CXNN draws from a per-lane xorshift, so lanes are reproducible from their seeds
+    uint32_t seed;              //Lane l's generator starts as a machine's would with seedCHIP8(seed + l)
+    uint64_t *laneCycles;       //Instructions each lane has run; only falls behind cycles once a lane halts
+    uint8_t *memory;            //BATCH_MEMORY_SIZE bytes per lane
+    uint64_t *screen;           //32 rows per lane
+
+    //Every running lane shares one clock, as in CHIP8State
+    uint64_t cycles;
+    uint32_t ips;
+    uint64_t timerBase;
+    uint64_t timerTicks;
+    uint64_t nextTimerCycle;
+
+    //Lockstep bookkeeping
+    uint16_t *remaining;        //Instructions left for each lane in the current chunk, 0 once halted
+    uint16_t *mask16;           //0xFFFF for lanes in the group being executed
+    uint8_t *mask8;             //Same as mask16, one byte per lane
+    uint64_t written[BATCH_MEMORY_SIZE / 64];   //Addresses any lane has written, where lanes' code may differ
+    CHIP8Instruction *decodeCache;              //Shared by every lane for addresses nobody has written
+    uint64_t groups;            //Groups executed, so callers can see how well lanes stay together
+    int vector;
+
+    //Lanes' registers are copied in and out of this to run register-only instructions the vector path doesn't cover
+    CHIP8State *scratch;
+};
+
+//initBatch returns NULL if lanes is below 1, and prints an error and returns NULL if the lanes can't be allocated
+CHIP8Batch* initBatch(int lanes);
+void freeBatch(CHIP8Batch *batch);
+//Copies a machine into every lane, reseeding lane l's generator with the machine's seed + l
+void loadBatch(CHIP8Batch *batch, const CHIP8State *state);
+void seedBatch(CHIP8Batch *batch, uint32_t seed);
+void keyDownBatch(CHIP8Batch *batch, int lane, uint8_t key);
+void keyUpBatch(CHIP8Batch *batch, int lane, uint8_t key);
+uint64_t runFrameBatch(CHIP8Batch *batch);
+//Copies lane into out, keeping out's core and hooks, so out can go on running from where the lane is
+void getLaneBatch(CHIP8Batch *batch, int lane, CHIP8State *out);
+
+#endif
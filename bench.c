@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "machine/machine.h"
+#include "jit/jit.h"
+
+//Benchmark suite: synthetic ROMs that each stress one path through the cores, run for a fixed number of instructions
+//Every run is timed in equal samples after a warm-up sample, and the median and slow-tail 99th percentile go to a JSON file
+#define DEFAULT_INSTRUCTIONS 20000000ull
+#define DEFAULT_SAMPLES 100
+#define DEFAULT_BENCH_IPS 1000000
+#define DEFAULT_OUTPUT "bench.json"
+
+//A median more than this fraction below the one in a --compare file counts as a regression
+#define REGRESSION_THRESHOLD 0.05
+
+typedef struct Workload {
+    const char *name;
+    const char *description;
+    const uint16_t *code;
+    int length;
+} Workload;
+
+//ALU only: a loop of every 8XY* form
+static const uint16_t aluCode[] = {
+    0x6001,     //200: V0 = 1
+    0x6103,     //202: V1 = 3
+    0x8014,     //204: V0 += V1
+    0x8125,     //206: V1 -= V2
+    0x8232,     //208: V2 &= V3
+    0x8301,     //20A: V3 |= V0
+    0x8403,     //20C: V4 ^= V0
+    0x8506,     //20E: V5 >>= 1
+    0x860E,     //210: V6 <<= 1
+    0x8717,     //212: V7 = V1 - V7
+    0x8870,     //214: V8 = V7
+    0x1204,     //216: loop to 204
+};
+
+//Branch heavy: skips taken and not taken in a changing pattern, with jumps between them
+static const uint16_t branchCode[] = {
+    0x7001,     //200: V0 += 1
+    0x3000,     //202: skip if V0 == 0
+    0x1208,     //204: jump 208
+    0x7101,     //206: V1 += 1
+    0x4080,     //208: skip unless V0 == 0x80
+    0x6000,     //20A: V0 = 0
+    0x5010,     //20C: skip if V0 == V1
+    0x1200,     //20E: loop to 200
+    0x7102,     //210: V1 += 2
+    0x1200,     //212: loop to 200
+};
+
+//Sprite heavy: draws font digits across the screen, clearing it once every digit has been drawn
+static const uint16_t spriteCode[] = {
+    0x00E0,     //200: clear the screen
+    0x6000,     //202: V0 = 0, x
+    0x6100,     //204: V1 = 0, y
+    0x6200,     //206: V2 = 0, digit
+    0xF229,     //208: I = sprite for digit V2
+    0xD015,     //20A: draw it at V0, V1
+    0x7005,     //20C: x += 5
+    0x7103,     //20E: y += 3
+    0x7201,     //210: next digit
+    0x3210,     //212: skip if V2 == 16
+    0x1208,     //214: loop to 208
+    0x1200,     //216: start again from a clear screen
+};
+
+//Memory bursts: stores and loads all 16 registers through FX55 and FX65, away from the code
+static const uint16_t memoryCode[] = {
+    0xA400,     //200: I = 400
+    0xFF55,     //202: store V0 to VF
+    0xFF65,     //204: load V0 to VF
+    0x7001,     //206: V0 += 1
+    0xFF55,     //208: store V0 to VF
+    0xFF65,     //20A: load V0 to VF
+    0x1200,     //20C: loop to 200
+};
+
+#define WORKLOAD(name, description, code) { name, description, code, sizeof(code) / sizeof(code[0]) }
+
+static const Workload workloads[] = {
+    WORKLOAD("alu", "8XY* arithmetic loop", aluCode),
+    WORKLOAD("branch", "3XNN/4XNN/5XY0 skips and 1NNN jumps", branchCode),
+    WORKLOAD("sprite", "DXYN font drawing with periodic 00E0", spriteCode),
+    WORKLOAD("memory", "FX55/FX65 register bursts", memoryCode),
+};
+
+static const char *cores[] = { "dispatch", "threaded", "jit" };
+
+#define WORKLOAD_COUNT (int) (sizeof(workloads) / sizeof(workloads[0]))
+#define CORE_COUNT (int) (sizeof(cores) / sizeof(cores[0]))
+
+typedef struct BenchResult {
+    const char *workload;
+    const char *core;
+    double median;
+    double p99Slow;             //Slow tail: instructions per second that 99% of samples ran at least as fast as
+    int samples;
+    int ran;                    //0 if the core isn't available on this host
+} BenchResult;
+
+static double wallSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+//Assembles a workload into ROM bytes, big-endian as the machine reads them
+static uint16_t buildROM(const Workload *workload, uint8_t *rom) {
+    for (int i = 0; i < workload -> length; i++) {
+        rom[i * 2] = workload -> code[i] >> 8;
+        rom[i * 2 + 1] = workload -> code[i] & 0xff;
+    }
+    return workload -> length * 2;
+}
+
+static BenchResult runBenchmark(const Workload *workload, const char *core, uint64_t instructions, int samples, uint32_t ips) {
+    BenchResult result = { workload -> name, core, 0, 0, samples, 0 };
+
+    uint8_t rom[MAX_ROM_SIZE];
+    uint16_t size = buildROM(workload, rom);
+
+    CHIP8State *machine = initCHIP8();
+    resetCHIP8(machine, rom, size);
+    setSpeedCHIP8(machine, ips);
+
+    CHIP8JIT *jit = NULL;
+    if (strcmp(core, "dispatch") == 0) {
+        machine -> core = emulateCHIP8Batch;
+    }
+    else if (strcmp(core, "jit") == 0) {
+        jit = initJIT(machine);
+        if (jit == NULL) {
+            freeCHIP8(machine);
+            return result;
+        }
+    }
+
+    uint64_t sampleSize = instructions / samples;
+    double *rates = malloc(samples * sizeof(double));
+
+    //The first sample fills the decode cache and compiles blocks, and isn't counted
+    runCHIP8(machine, sampleSize);
+    for (int i = 0; i < samples; i++) {
+        double start = wallSeconds();
+        uint64_t ran = runCHIP8(machine, sampleSize);
+        double elapsed = wallSeconds() - start;
+        rates[i] = elapsed > 0 ? ran / elapsed : 0;
+    }
+
+    if (machine -> halt) {
+        printf("Warning: %s halted on the %s core, so its results are meaningless.\n", workload -> name, core);
+    }
+
+    //Rates sort slowest first, so the slow tail is at the bottom: with 100 samples, index 1 is the sample only
+    //the slowest 1% fell below; below 100 samples that 1% is less than a sample and it's the slowest one
+    qsort(rates, samples, sizeof(double), compareDoubles);
+    result.median = rates[samples / 2];
+    result.p99Slow = rates[samples / 100];
+    result.ran = 1;
+
+    free(rates);
+    freeJIT(machine, jit);
+    freeCHIP8(machine);
+    return result;
+}
+
+static int writeResults(char *filename, BenchResult *results, int count, uint64_t instructions, int samples, uint32_t ips) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return 1;
+    }
+
+    fprintf(f, "{\n  \"timestamp\": %lld,\n", (long long) time(NULL));
+    fprintf(f, "  \"instructions\": %llu,\n  \"samples\": %d,\n  \"ips\": %u,\n", (unsigned long long) instructions, samples, ips);
+    fprintf(f, "  \"results\": [\n");
+    int written = 0;
+    for (int i = 0; i < count; i++) {
+        if (!results[i].ran) {
+            continue;
+        }
+        fprintf(f, "%s    {\"workload\": \"%s\", \"core\": \"%s\", \"median\": %.0f, \"p99Slow\": %.0f}", written ? ",\n" : "",
+            results[i].workload, results[i].core, results[i].median, results[i].p99Slow);
+        written++;
+    }
+    fprintf(f, "\n  ]\n}\n");
+
+    int ok = !ferror(f);
+    fclose(f);
+    if (!ok) {
+        printf("Error: Couldn't write results to %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+//Reads the medians back out of a file writeResults wrote, matching each line on workload and core
+//Returns the number of regressions, or -1 if the file couldn't be read
+static int compareResults(char *filename, BenchResult *results, int count, uint64_t instructions, int samples, uint32_t ips) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return -1;
+    }
+
+    printf("\nCompared with %s:\n", filename);
+    int regressions = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        //Samples of a different size carry different fixed costs, so their rates aren't comparable
+        unsigned long long setting;
+        if ((sscanf(line, " \"instructions\": %llu", &setting) == 1 && setting != instructions)
+            || (sscanf(line, " \"samples\": %llu", &setting) == 1 && setting != (unsigned long long) samples)
+            || (sscanf(line, " \"ips\": %llu", &setting) == 1 && setting != ips)) {
+            printf("Warning: %s was run with different settings (%s)", filename, line);
+        }
+
+        char workload[64], core[64];
+        double median;
+        if (sscanf(line, " {\"workload\": \"%63[^\"]\", \"core\": \"%63[^\"]\", \"median\": %lf", workload, core, &median) != 3) {
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (!results[i].ran || strcmp(results[i].workload, workload) != 0 || strcmp(results[i].core, core) != 0 || median <= 0) {
+                continue;
+            }
+            double change = (results[i].median - median) / median;
+            int regressed = change < -REGRESSION_THRESHOLD;
+            regressions += regressed;
+            printf("%-8s %-9s %14.0f -> %14.0f  %+6.1f%%%s\n", workload, core, median, results[i].median, change * 100,
+                regressed ? "  REGRESSION" : "");
+        }
+    }
+    fclose(f);
+
+    return regressions;
+}
+
+static void usage(void) {
+    printf("Usage: bench [--instructions N] [--samples N] [--ips N] [--output FILE] [--compare FILE]\n");
+    printf("  --instructions N   Instructions timed per workload and core (default %llu)\n", DEFAULT_INSTRUCTIONS);
+    printf("  --samples N        Equal samples those are timed in, for the median and slow-tail p99 (default %d)\n", DEFAULT_SAMPLES);
+    printf("  --ips N            Emulated speed, which sets how often timers interrupt a batch (default %d)\n", DEFAULT_BENCH_IPS);
+    printf("  --output FILE      Where to write the results as JSON (default %s)\n", DEFAULT_OUTPUT);
+    printf("  --compare FILE     Compare medians with an earlier results file, exiting with status 1 if any fell\n");
+    printf("                     by more than %.0f%%\n", REGRESSION_THRESHOLD * 100);
+    printf("Workloads:\n");
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        printf("  %-8s %s\n", workloads[w].name, workloads[w].description);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t instructions = DEFAULT_INSTRUCTIONS;
+    int samples = DEFAULT_SAMPLES;
+    uint64_t ips = DEFAULT_BENCH_IPS;
+    char *output = DEFAULT_OUTPUT;
+    char *compare = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc) {
+            instructions = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            ips = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare = argv[++i];
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (samples < 1 || instructions < (uint64_t) samples || ips == 0 || ips > UINT32_MAX) {
+        usage();
+        return 1;
+    }
+
+    BenchResult results[WORKLOAD_COUNT * CORE_COUNT];
+    int count = 0;
+
+    printf("%-8s %-9s %14s %14s\n", "Workload", "Core", "Median IPS", "p99 slow IPS");
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        for (int c = 0; c < CORE_COUNT; c++) {
+            BenchResult result = runBenchmark(&workloads[w], cores[c], instructions, samples, (uint32_t) ips);
+            results[count++] = result;
+            if (result.ran) {
+                printf("%-8s %-9s %14.0f %14.0f\n", result.workload, result.core, result.median, result.p99Slow);
+            }
+            else {
+                printf("%-8s %-9s %14s %14s\n", result.workload, result.core, "unavailable", "");
+            }
+        }
+    }
+
+    int status = 0;
+    if (compare != NULL) {
+        int regressions = compareResults(compare, results, count, instructions, samples, (uint32_t) ips);
+        if (regressions != 0) {
+            status = 1;
+        }
+    }
+    if (writeResults(output, results, count, instructions, samples, (uint32_t) ips) != 0) {
+        status = 1;
+    }
+    else {
+        printf("\nResults written to %s\n", output);
+    }
+
+    return status;
+}
@@ -1,6 +1,70 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "display.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DISPLAY_SIMD 1
+#endif
+
+#define PIXEL_ON 0xFFFFFFFF
+#define PIXEL_OFF 0xFF000000
+
+//Expands one 64-pixel screen row (column 0 in the most significant bit) into ARGB8888 pixels
+typedef void (*ExpandRow)(uint64_t row, uint32_t *out);
+
+static void expandRowScalar(uint64_t row, uint32_t *out) {
+    for (int i = 0; i < SCREEN_WIDTH; i++) {
+        out[i] = ((row >> (63 - i)) & 1) ? PIXEL_ON : PIXEL_OFF;
+    }
+}
+
+#ifdef DISPLAY_SIMD
+//SSE2 is part of x86-64, so this needs no runtime check there
+//Each sprite byte becomes 8 pixels: broadcast it, AND with one bit per lane, and compare to get all-ones or zero
+__attribute__((target("sse2")))
+static void expandRowSSE2(uint64_t row, uint32_t *out) {
+    const __m128i highBits = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+    const __m128i lowBits = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+    const __m128i alpha = _mm_set1_epi32((int) PIXEL_OFF);
+
+    for (int k = 0; k < 8; k++) {
+        __m128i byte = _mm_set1_epi32((int) ((row >> (56 - 8 * k)) & 0xff));
+        __m128i high = _mm_cmpeq_epi32(_mm_and_si128(byte, highBits), highBits);
+        __m128i low = _mm_cmpeq_epi32(_mm_and_si128(byte, lowBits), lowBits);
+        _mm_storeu_si128((__m128i *) &out[8 * k], _mm_or_si128(high, alpha));
+        _mm_storeu_si128((__m128i *) &out[8 * k + 4], _mm_or_si128(low, alpha));
+    }
+}
+
+__attribute__((target("avx2")))
+static void expandRowAVX2(uint64_t row, uint32_t *out) {
+    const __m256i bits = _mm256_set_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+    const __m256i alpha = _mm256_set1_epi32((int) PIXEL_OFF);
+
+    for (int k = 0; k < 8; k++) {
+        __m256i byte = _mm256_set1_epi32((int) ((row >> (56 - 8 * k)) & 0xff));
+        __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits);
+        _mm256_storeu_si256((__m256i *) &out[8 * k], _mm256_or_si256(mask, alpha));
+    }
+}
+#endif
+
+static ExpandRow selectExpandRow(void) {
+#ifdef DISPLAY_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return expandRowAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return expandRowSSE2;
+    }
+#endif
+    return expandRowScalar;
+}
+
+static ExpandRow expandRow = NULL;
+
 Display* initDisplay() {
     Display* d = calloc(sizeof(Display), 1);
 
@@ -12,9 +76,16 @@ Display* initDisplay() {
     //SDL_PIXELFORMAT_RGBA8888, the easiest format to understand, is 32-bit
     //Tried SDL_PIXELFORMAT_INDEX8 first but couldn't understand how to get it to work
     d -> framebuffer = calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint32_t));
+
+    //Pick the widest pixel expansion this CPU supports, once
+    if (expandRow == NULL) {
+        expandRow = selectExpandRow();
+    }
+
+    return d;
 }
 
-bool initSDL(Display *display) {
+bool initSDL(Display *display, bool vsync) {
     //Initialisation flag
     bool success = true;
 
@@ -32,8 +103,9 @@ bool initSDL(Display *display) {
             success = false;
         }
         else {
-            //Create renderer for the window
-            display -> renderer = SDL_CreateRenderer(display -> window, -1, SDL_RENDERER_ACCELERATED);
+            //Create renderer for the window, synchronised to the display's refresh if asked and the driver can
+            Uint32 flags = SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+            display -> renderer = SDL_CreateRenderer(display -> window, -1, flags);
 
             if (display -> renderer == NULL) {
                 printf("Renderer could not be created. SDL Error: %s\n", SDL_GetError());
@@ -51,6 +123,16 @@ bool initSDL(Display *display) {
                     printf("Texture could not be created. SDL Error: %s\n", SDL_GetError());
                     success = false;
                 }
+
+                //Drivers are free to ignore the vsync flag, so ask what was actually granted
+                SDL_RendererInfo info;
+                if (SDL_GetRendererInfo(display -> renderer, &info) == 0) {
+                    display -> vsync = (info.flags & SDL_RENDERER_PRESENTVSYNC) != 0;
+                }
+                SDL_DisplayMode mode;
+                if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(display -> window), &mode) == 0) {
+                    display -> refreshRate = mode.refresh_rate;
+                }
             }
         }
     }
@@ -58,20 +140,41 @@ bool initSDL(Display *display) {
     return success;
 }
 
-void updateDisplay(CHIP8State *state, Display *display) {
-    //Need to convert 8-bit pixels into 32-bit ARGB colour format
-    //0x00FFFFFF = white, so multiply CHIP-8 pixel value (0 or 1) by this, then set opacity to max
-    for (int i = 0; i < (SCREEN_WIDTH * SCREEN_HEIGHT); i++) {
-        uint8_t screenPixel = state -> screen[i];
-        display -> framebuffer[i] = (0x00FFFFFF * screenPixel) | 0xFF000000;
+void updateDisplay(const uint64_t *screen, Display *display) {
+    //The screen arrives as a finished frame from the emulation thread, maybe after frames this thread skipped,
+    //so rows are compared with the ones last uploaded to find the ones to upload again
+    //It's presented even when nothing changed, since frames only arrive when they're due to be shown
+    uint32_t dirty = 0;
+    for (int row = 0; row < SCREEN_HEIGHT; row++) {
+        if (!(display -> drawn) || screen[row] != display -> shown[row]) {
+            dirty |= 1u << row;
+        }
     }
+    display -> drawn = true;
 
+    //Upload each run of consecutive dirty rows as one rectangle
     //Pitch = no. of bytes in a row of pixels
+    int row = 0;
+    while (row < SCREEN_HEIGHT) {
+        if (!(dirty & (1u << row))) {
+            row++;
+            continue;
+        }
+
+        int first = row;
+        while (row < SCREEN_HEIGHT && (dirty & (1u << row))) {
+            expandRow(screen[row], &(display -> framebuffer[row * SCREEN_WIDTH]));
+            display -> shown[row] = screen[row];
+            row++;
+        }
+
+        SDL_Rect rect = { 0, first, SCREEN_WIDTH, row - first };
+        SDL_UpdateTexture(display -> texture, &rect, &(display -> framebuffer[first * SCREEN_WIDTH]), SCREEN_WIDTH * sizeof(uint32_t));
+    }
+
     SDL_RenderClear(display -> renderer);
-    SDL_UpdateTexture(display -> texture, NULL, display -> framebuffer, SCREEN_WIDTH * sizeof(uint32_t));
     SDL_RenderCopy(display -> renderer, display -> texture, NULL, NULL);
     SDL_RenderPresent(display -> renderer); 
-    state -> displayFlag = 0;
 }
 
 void closeSDL(Display *display) {
@@ -3,22 +3,26 @@
 #include "../machine/machine.h"
 
 //Window, CHIP-8 dimensions and frequency constants
+//The instruction rate lives with the core, see DEFAULT_IPS and setSpeedCHIP8
 #define SCREEN_WIDTH 64
 #define SCREEN_HEIGHT 32
 #define WINDOW_WIDTH 1280
 #define WINDOW_HEIGHT 640
 #define SCREEN_FPS 60
-#define INSTRUCTION_FREQUENCY 700
 
 typedef struct Display {
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
     uint32_t *framebuffer;
+    uint64_t shown[SCREEN_HEIGHT];      //Screen rows as last uploaded, so only rows that differ are converted again
+    bool drawn;                         //Whether anything has been uploaded yet
+    bool vsync;                         //Whether presents wait for the display's vertical blank
+    int refreshRate;                    //Of the display the window opened on, or 0 if SDL doesn't know
 } Display;
 
 Display* initDisplay();
-bool initSDL(Display *display);
-void updateDisplay(CHIP8State *state, Display *display);
+bool initSDL(Display *display, bool vsync);
+void updateDisplay(const uint64_t *screen, Display *display);
 void closeSDL(Display *display);
 void closeDisplay(Display *display);
\ No newline at end of file
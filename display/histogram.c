@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+#include "histogram.h"
+
+#define HISTOGRAM_BAR 40
+
+void initHistogram(Histogram *histogram, const char *name) {
+    memset(histogram, 0, sizeof(Histogram));
+    histogram -> name = name;
+    histogram -> min = UINT64_MAX;
+}
+
+void recordHistogram(Histogram *histogram, uint64_t microseconds) {
+    uint64_t bucket = microseconds / HISTOGRAM_BUCKET_US;
+    histogram -> counts[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS]++;
+    histogram -> count++;
+    histogram -> total += microseconds;
+    if (microseconds < histogram -> min) {
+        histogram -> min = microseconds;
+    }
+    if (microseconds > histogram -> max) {
+        histogram -> max = microseconds;
+    }
+}
+
+//Upper edge of the bucket the given fraction of samples fall at or below, in milliseconds
+static double percentile(const Histogram *histogram, double fraction) {
+    uint64_t target = (uint64_t) (fraction * histogram -> count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram -> counts[i];
+        if (seen >= target) {
+            return (i + 1) * HISTOGRAM_BUCKET_US / 1000.0;
+        }
+    }
+    return histogram -> max / 1000.0;
+}
+
+void printHistogram(const Histogram *histogram) {
+    if (histogram -> count == 0) {
+        printf("%s: no samples.\n", histogram -> name);
+        return;
+    }
+
+    printf("%s: %llu samples, mean %.2fms, min %.2fms, p50 %.2fms, p95 %.2fms, p99 %.2fms, max %.2fms\n",
+        histogram -> name, (unsigned long long) histogram -> count, (double) histogram -> total / histogram -> count / 1000.0,
+        histogram -> min / 1000.0, percentile(histogram, 0.5), percentile(histogram, 0.95), percentile(histogram, 0.99),
+        histogram -> max / 1000.0);
+
+    uint64_t peak = 0;
+    for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+        if (histogram -> counts[i] > peak) {
+            peak = histogram -> counts[i];
+        }
+    }
+    for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+        uint64_t count = histogram -> counts[i];
+        if (count == 0) {
+            continue;
+        }
+        char bar[HISTOGRAM_BAR + 1];
+        int length = (int) ((count * HISTOGRAM_BAR + peak - 1) / peak);
+        memset(bar, '#', length);
+        bar[length] = '\0';
+        if (i < HISTOGRAM_BUCKETS) {
+            printf("  %6.2f-%6.2fms %10llu %6.2f%% %s\n", i * HISTOGRAM_BUCKET_US / 1000.0,
+                (i + 1) * HISTOGRAM_BUCKET_US / 1000.0, (unsigned long long) count, 100.0 * count / histogram -> count, bar);
+        }
+        else {
+            printf("  %6.2fms+      %10llu %6.2f%% %s\n", i * HISTOGRAM_BUCKET_US / 1000.0, (unsigned long long) count,
+                100.0 * count / histogram -> count, bar);
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+//Fixed-width histogram of durations in microseconds, for frame pacing and latency
+//Buckets are a quarter of a millisecond up to 50ms, so judder of a fraction of a 60Hz frame shows up, and
+//anything longer lands in the last bucket
+#define HISTOGRAM_BUCKET_US 250
+#define HISTOGRAM_BUCKETS 200
+
+typedef struct Histogram {
+    const char *name;
+    uint64_t counts[HISTOGRAM_BUCKETS + 1];
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} Histogram;
+
+void initHistogram(Histogram *histogram, const char *name);
+void recordHistogram(Histogram *histogram, uint64_t microseconds);
+
+//Prints the count, mean, percentiles and every non-empty bucket to stdout
+void printHistogram(const Histogram *histogram);
+
+#endif
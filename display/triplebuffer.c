@@ -0,0 +1,30 @@
+#include <string.h>
+#include "triplebuffer.h"
+
+#define TRIPLE_FRESH 4
+
+void initTripleBuffer(TripleBuffer *buffer) {
+    memset(buffer -> frames, 0, sizeof(buffer -> frames));
+    buffer -> back = 0;
+    atomic_init(&(buffer -> middle), 1);
+    buffer -> front = 2;
+}
+
+Frame* backTripleBuffer(TripleBuffer *buffer) {
+    return &(buffer -> frames[buffer -> back]);
+}
+
+void publishTripleBuffer(TripleBuffer *buffer) {
+    //Release makes the frame written into the back slot visible before the reader can take it
+    int old = atomic_exchange_explicit(&(buffer -> middle), buffer -> back | TRIPLE_FRESH, memory_order_acq_rel);
+    buffer -> back = old & ~TRIPLE_FRESH;
+}
+
+const Frame* takeTripleBuffer(TripleBuffer *buffer) {
+    if (!(atomic_load_explicit(&(buffer -> middle), memory_order_relaxed) & TRIPLE_FRESH)) {
+        return NULL;
+    }
+    int old = atomic_exchange_explicit(&(buffer -> middle), buffer -> front, memory_order_acq_rel);
+    buffer -> front = old & ~TRIPLE_FRESH;
+    return &(buffer -> frames[buffer -> front]);
+}
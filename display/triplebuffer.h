@@ -0,0 +1,36 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+//One finished frame: the screen, and the serial of the last keypad change the machine had seen when it ran
+typedef struct Frame {
+    uint64_t screen[32];
+    uint32_t keySerial;
+    bool resumed;               //Time passed without frames before this one, such as the machine halting
+    bool paced;                 //The writer waits for this frame to be presented before running the next one
+} Frame;
+
+//Lock-free hand-off of whole frames from one writer thread to one reader thread
+//The writer fills its back slot and publishes it; the reader takes the newest published slot as its front
+//Publishing swaps the back slot with the middle one, so neither side ever waits and the reader skips frames it was
+//too slow for rather than holding the writer up
+typedef struct TripleBuffer {
+    Frame frames[3];
+    _Alignas(64) atomic_int middle;         //Slot between the two, with TRIPLE_FRESH set until the reader takes it
+    _Alignas(64) int back;                  //Only the writer touches this
+    _Alignas(64) int front;                 //Only the reader touches this
+} TripleBuffer;
+
+void initTripleBuffer(TripleBuffer *buffer);
+
+//Writer: fill backTripleBuffer, then publishTripleBuffer hands it over and gives the writer another slot
+Frame* backTripleBuffer(TripleBuffer *buffer);
+void publishTripleBuffer(TripleBuffer *buffer);
+
+//Reader: returns the newest published frame, or NULL if nothing was published since the last call
+const Frame* takeTripleBuffer(TripleBuffer *buffer);
+
+#endif
@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "machine/machine.h"
+
+//Coverage-guided input fuzzer for ROMs
+//Each worker thread owns a CHIP8State and replays key sequences against a ROM from power-on
+//Sequences that reach new coverage join a shared corpus and their mutations are queued on the finder's deque
+//Idle workers steal queued mutations from the others, so finds spread across every thread
+//Faults (unimplemented instructions) and hangs (jumps to self) are reported once per address and the run carries on
+#define DEFAULT_FRAMES 600
+#define DEFAULT_SECONDS 10
+#define MAX_WORKERS 64
+#define MAX_EVENTS 64
+#define MAX_CORPUS 4096
+#define QUEUE_SIZE 1024                     //Jobs per worker deque, must be a power of 2
+#define MUTATIONS_PER_FIND 64               //Jobs queued for each input that finds new coverage
+#define COVERAGE_BITS 65536
+#define COVERAGE_WORDS (COVERAGE_BITS / 64)
+
+//Key event applied at the start of a frame
+typedef struct FuzzEvent {
+    uint16_t frame;
+    uint8_t key;
+    uint8_t down;
+} FuzzEvent;
+
+//Events are kept sorted by frame
+typedef struct FuzzInput {
+    int count;
+    FuzzEvent events[MAX_EVENTS];
+} FuzzInput;
+
+//Run one mutation of a corpus entry, seeded so the mutation is reproducible
+typedef struct FuzzJob {
+    int parent;
+    uint64_t seed;
+} FuzzJob;
+
+//The owner pushes and pops at the tail, thieves take the oldest jobs from the head
+typedef struct FuzzQueue {
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t tail;
+    FuzzJob jobs[QUEUE_SIZE];
+} FuzzQueue;
+
+typedef struct Fuzzer {
+    char *filename;
+    uint8_t rom[MAX_ROM_SIZE];
+    uint16_t romSize;
+    uint32_t ips;
+    int frames;
+    int workerCount;
+    uint64_t maxExecs;
+    double start;
+    atomic_int stop;
+
+    _Atomic uint64_t coverage[COVERAGE_WORDS];
+    atomic_int coverageCount;
+    atomic_uchar faultSeen[4096];
+    atomic_uchar hangSeen[4096];
+    atomic_int faults;
+    atomic_int hangs;
+
+    //Entries are written once before corpusSize is raised past them, so readers need no lock
+    pthread_mutex_t corpusLock;
+    atomic_int corpusSize;
+    FuzzInput corpus[MAX_CORPUS];
+
+    FuzzQueue queues[MAX_WORKERS];
+    pthread_mutex_t printLock;
+} Fuzzer;
+
+typedef struct Worker {
+    Fuzzer *fuzzer;
+    int id;
+    pthread_t thread;
+    CHIP8State *machine;
+    uint64_t rng;
+    uint32_t previous;                      //Hash of the last (PC, opcode) pair, for edge coverage
+    uint64_t coverage[COVERAGE_WORDS];
+    _Atomic uint64_t execs;
+} Worker;
+
+static Fuzzer fuzzer;
+static Worker workers[MAX_WORKERS];
+
+static double wallSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static uint64_t nextRandom(uint64_t *rng) {
+    uint64_t x = *rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *rng = x;
+    return x;
+}
+
+//Steps the interpreter one instruction at a time, marking the edge from the previous (PC, opcode) pair to this one
+//Used as the machine's core, so runFrameCHIP8 still does all the timer bookkeeping
+static int coverageCore(CHIP8State *state, int count) {
+    Worker *w = state -> coreData;
+    int executed = 0;
+
+    while (executed < count && !(state -> halt)) {
+        uint16_t pc = state -> pc & 0xfff;
+        uint16_t opcode = (state -> memory[pc] << 8) | state -> memory[(pc + 1) & 0xfff];
+        uint32_t current = ((pc * 0x9e37u) ^ opcode) & (COVERAGE_BITS - 1);
+        uint32_t edge = current ^ w -> previous;
+
+        w -> coverage[edge >> 6] |= 1ull << (edge & 63);
+        w -> previous = current >> 1;
+
+        emulateCHIP8(state);
+        executed++;
+    }
+    return executed;
+}
+
+//Resetting with the same ROM only restores the memory the last run wrote, so this is cheap
+static void resetMachine(Worker *w) {
+    resetCHIP8(w -> machine, w -> fuzzer -> rom, w -> fuzzer -> romSize);
+    w -> previous = 0;
+}
+
+static void runInput(Worker *w, const FuzzInput *input) {
+    CHIP8State *state = w -> machine;
+    int next = 0;
+
+    resetMachine(w);
+    memset(w -> coverage, 0, sizeof(w -> coverage));
+
+    for (int frame = 0; frame < w -> fuzzer -> frames && !(state -> halt); frame++) {
+        while (next < input -> count && input -> events[next].frame == frame) {
+            if (input -> events[next].down) {
+                keyDown(state, input -> events[next].key);
+            }
+            else {
+                keyUp(state, input -> events[next].key);
+            }
+            next++;
+        }
+        runFrameCHIP8(state);
+    }
+}
+
+//Merges this run's coverage into the shared bitmap and returns how many edges nobody had reached before
+static int mergeCoverage(Worker *w) {
+    Fuzzer *f = w -> fuzzer;
+    int fresh = 0;
+
+    for (int i = 0; i < COVERAGE_WORDS; i++) {
+        uint64_t bits = w -> coverage[i] & ~atomic_load_explicit(&f -> coverage[i], memory_order_relaxed);
+        if (bits) {
+            uint64_t old = atomic_fetch_or(&f -> coverage[i], bits);
+            fresh += __builtin_popcountll(bits & ~old);
+        }
+    }
+    if (fresh) {
+        atomic_fetch_add(&f -> coverageCount, fresh);
+    }
+    return fresh;
+}
+
+static void printInput(const FuzzInput *input) {
+    printf("  input:");
+    for (int i = 0; i < input -> count; i++) {
+        printf(" %d:%x%c", input -> events[i].frame, input -> events[i].key, input -> events[i].down ? 'v' : '^');
+    }
+    printf("%s\n", input -> count ? "" : " (no keys)");
+}
+
+static void sortInput(FuzzInput *input) {
+    //Inputs are short, so insertion sort; equal frames keep their order
+    for (int i = 1; i < input -> count; i++) {
+        FuzzEvent e = input -> events[i];
+        int j = i - 1;
+        while (j >= 0 && input -> events[j].frame > e.frame) {
+            input -> events[j + 1] = input -> events[j];
+            j--;
+        }
+        input -> events[j + 1] = e;
+    }
+}
+
+static FuzzEvent randomEvent(uint64_t *rng, int frames) {
+    FuzzEvent e;
+    uint64_t r = nextRandom(rng);
+    e.frame = r % frames;
+    e.key = (r >> 32) & 0xf;
+    e.down = (r >> 36) & 1;
+    return e;
+}
+
+//Applies one to four random edits, sometimes splicing in the tail of another corpus entry
+static void mutateInput(Fuzzer *f, FuzzInput *input, uint64_t seed) {
+    uint64_t rng = seed | 1;
+    int edits = 1 + (nextRandom(&rng) & 3);
+
+    for (int i = 0; i < edits; i++) {
+        uint64_t r = nextRandom(&rng);
+        int index = input -> count ? (r >> 8) % input -> count : 0;
+
+        switch (input -> count ? r % 6 : 0) {
+            //Insert a random event, as a press and release pair when there's room
+            case 0:
+            case 1: {
+                FuzzEvent e = randomEvent(&rng, f -> frames);
+                if (input -> count < MAX_EVENTS) {
+                    e.down = 1;
+                    input -> events[input -> count++] = e;
+                }
+                if (input -> count < MAX_EVENTS) {
+                    e.frame = (e.frame + 1 + (nextRandom(&rng) % 30)) % f -> frames;
+                    e.down = 0;
+                    input -> events[input -> count++] = e;
+                }
+                break;
+            }
+            //Delete an event
+            case 2:
+                input -> events[index] = input -> events[--input -> count];
+                break;
+            //Move an event in time
+            case 3: {
+                int shift = (int) (nextRandom(&rng) % 61) - 30;
+                int frame = input -> events[index].frame + shift;
+                input -> events[index].frame = frame < 0 ? 0 : (frame >= f -> frames ? f -> frames - 1 : frame);
+                break;
+            }
+            //Change which key an event uses
+            case 4:
+                input -> events[index].key = nextRandom(&rng) & 0xf;
+                break;
+            //Replace everything after an event with the events after the same frame in another entry
+            case 5: {
+                int size = atomic_load(&f -> corpusSize);
+                const FuzzInput *other = &f -> corpus[nextRandom(&rng) % size];
+                int frame = input -> events[index].frame;
+                int count = 0;
+                for (int j = 0; j < input -> count; j++) {
+                    if (input -> events[j].frame <= frame) {
+                        input -> events[count++] = input -> events[j];
+                    }
+                }
+                for (int j = 0; j < other -> count && count < MAX_EVENTS; j++) {
+                    if (other -> events[j].frame > frame) {
+                        input -> events[count++] = other -> events[j];
+                    }
+                }
+                input -> count = count;
+                break;
+            }
+        }
+    }
+    sortInput(input);
+}
+
+static void pushJob(FuzzQueue *q, FuzzJob job) {
+    pthread_mutex_lock(&q -> lock);
+    //A full deque drops its oldest job; there are always more mutations to try
+    if (q -> tail - q -> head == QUEUE_SIZE) {
+        q -> head++;
+    }
+    q -> jobs[q -> tail++ & (QUEUE_SIZE - 1)] = job;
+    pthread_mutex_unlock(&q -> lock);
+}
+
+static int popJob(FuzzQueue *q, FuzzJob *job) {
+    int found = 0;
+    pthread_mutex_lock(&q -> lock);
+    if (q -> tail != q -> head) {
+        *job = q -> jobs[--q -> tail & (QUEUE_SIZE - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q -> lock);
+    return found;
+}
+
+static int stealJob(FuzzQueue *q, FuzzJob *job) {
+    int found = 0;
+    //Skip the lock on deques that look empty, which is most of them most of the time
+    if (__atomic_load_n(&q -> tail, __ATOMIC_RELAXED) == __atomic_load_n(&q -> head, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    pthread_mutex_lock(&q -> lock);
+    if (q -> tail != q -> head) {
+        *job = q -> jobs[q -> head++ & (QUEUE_SIZE - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q -> lock);
+    return found;
+}
+
+//Own deque first, newest job first; then the oldest job from another worker; otherwise a random corpus entry
+static void nextJob(Worker *w, FuzzJob *job) {
+    Fuzzer *f = w -> fuzzer;
+
+    if (popJob(&f -> queues[w -> id], job)) {
+        return;
+    }
+    for (int i = 1; i < f -> workerCount; i++) {
+        if (stealJob(&f -> queues[(w -> id + i) % f -> workerCount], job)) {
+            return;
+        }
+    }
+    job -> parent = nextRandom(&w -> rng) % atomic_load(&f -> corpusSize);
+    job -> seed = nextRandom(&w -> rng);
+}
+
+static int addToCorpus(Fuzzer *f, const FuzzInput *input) {
+    int index = -1;
+    pthread_mutex_lock(&f -> corpusLock);
+    int size = atomic_load(&f -> corpusSize);
+    if (size < MAX_CORPUS) {
+        f -> corpus[size] = *input;
+        atomic_store(&f -> corpusSize, size + 1);
+        index = size;
+    }
+    pthread_mutex_unlock(&f -> corpusLock);
+    return index;
+}
+
+static void reportResult(Worker *w, const FuzzInput *input, int fresh) {
+    Fuzzer *f = w -> fuzzer;
+    CHIP8State *state = w -> machine;
+    double t = wallSeconds() - f -> start;
+
+    if (state -> fault && !atomic_exchange(&f -> faultSeen[state -> faultAddress], 1)) {
+        atomic_fetch_add(&f -> faults, 1);
+        pthread_mutex_lock(&f -> printLock);
+        printf("[%7.2fs] worker %d: fault at %04x, frame %llu\n", t, w -> id, state -> faultAddress,
+            (unsigned long long) state -> timerTicks);
+        decodeCHIP8(state -> memory, state -> faultAddress);
+        printInput(input);
+        pthread_mutex_unlock(&f -> printLock);
+    }
+    else if (!(state -> fault) && state -> halt && !atomic_exchange(&f -> hangSeen[state -> pc & 0xfff], 1)) {
+        atomic_fetch_add(&f -> hangs, 1);
+        pthread_mutex_lock(&f -> printLock);
+        printf("[%7.2fs] worker %d: hang at %04x, frame %llu\n", t, w -> id, state -> pc,
+            (unsigned long long) state -> timerTicks);
+        printInput(input);
+        pthread_mutex_unlock(&f -> printLock);
+    }
+
+    if (fresh) {
+        pthread_mutex_lock(&f -> printLock);
+        printf("[%7.2fs] worker %d: +%d edges (%d total), corpus %d\n", t, w -> id, fresh,
+            atomic_load(&f -> coverageCount), atomic_load(&f -> corpusSize));
+        pthread_mutex_unlock(&f -> printLock);
+    }
+}
+
+static void* workerMain(void *arg) {
+    Worker *w = arg;
+    Fuzzer *f = w -> fuzzer;
+    FuzzInput input;
+
+    while (!atomic_load_explicit(&f -> stop, memory_order_relaxed)) {
+        FuzzJob job;
+        nextJob(w, &job);
+        input = f -> corpus[job.parent];
+        mutateInput(f, &input, job.seed);
+
+        runInput(w, &input);
+        atomic_fetch_add_explicit(&w -> execs, 1, memory_order_relaxed);
+
+        int fresh = mergeCoverage(w);
+        if (fresh) {
+            int index = addToCorpus(f, &input);
+            if (index >= 0) {
+                for (int i = 0; i < MUTATIONS_PER_FIND; i++) {
+                    FuzzJob child = { index, nextRandom(&w -> rng) };
+                    pushJob(&f -> queues[w -> id], child);
+                }
+            }
+        }
+        if (fresh || w -> machine -> halt) {
+            reportResult(w, &input, fresh);
+        }
+    }
+    return NULL;
+}
+
+static uint64_t totalExecs(Fuzzer *f) {
+    uint64_t execs = 0;
+    for (int i = 0; i < f -> workerCount; i++) {
+        execs += atomic_load_explicit(&workers[i].execs, memory_order_relaxed);
+    }
+    return execs;
+}
+
+static void usage(void) {
+    printf("Usage: fuzz <path-to-rom> [--threads N] [--seconds N | --execs N] [--frames N] [--ips N] [--seed N]\n");
+    printf("  --threads N   Worker threads, each with its own machine (default: one per CPU, up to %d)\n", MAX_WORKERS);
+    printf("  --seconds N   Stop after N seconds (default %d)\n", DEFAULT_SECONDS);
+    printf("  --execs N     Stop after about N inputs have been run\n");
+    printf("  --frames N    60Hz frames each input runs for (default %d)\n", DEFAULT_FRAMES);
+    printf("  --ips N       Instructions per emulated second (default %d)\n", DEFAULT_IPS);
+    printf("  --seed N      Seed for the workers' random numbers\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 0;
+    }
+
+    Fuzzer *f = &fuzzer;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (cpus < MAX_WORKERS ? cpus : MAX_WORKERS) : 1;
+    double seconds = DEFAULT_SECONDS;
+    uint64_t seed = (uint64_t) time(NULL);
+    uint64_t ips = DEFAULT_IPS;
+    long frames = DEFAULT_FRAMES;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--execs") == 0 && i + 1 < argc) {
+            f -> maxExecs = strtoull(argv[++i], NULL, 10);
+            seconds = 0;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            ips = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (argv[i][0] == '-') {
+            usage();
+            return 1;
+        }
+        else {
+            f -> filename = argv[i];
+        }
+    }
+
+    if (f -> filename == NULL || threads < 1 || threads > MAX_WORKERS || frames < 1 || frames > UINT16_MAX
+        || ips == 0 || ips > UINT32_MAX || (seconds <= 0 && f -> maxExecs == 0)) {
+        usage();
+        return 1;
+    }
+
+    f -> workerCount = threads;
+    f -> frames = frames;
+    f -> ips = ips;
+    pthread_mutex_init(&f -> corpusLock, NULL);
+    pthread_mutex_init(&f -> printLock, NULL);
+
+    //The corpus starts with a single input that presses nothing
+    FuzzInput empty = { 0 };
+    addToCorpus(f, &empty);
+
+    if (readROM(f -> filename, f -> rom, &(f -> romSize)) != 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        Worker *w = &workers[i];
+        w -> fuzzer = f;
+        w -> id = i;
+        w -> rng = (seed + i + 1) * 0x9e3779b97f4a7c15ull;
+        w -> machine = initCHIP8();
+        setSpeedCHIP8(w -> machine, f -> ips);
+        w -> machine -> core = coverageCore;
+        w -> machine -> coreData = w;
+        pthread_mutex_init(&f -> queues[i].lock, NULL);
+    }
+
+    printf("Fuzzing %s with %d threads, %d frames per input, seed %llu\n", f -> filename, threads, f -> frames,
+        (unsigned long long) seed);
+
+    f -> start = wallSeconds();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]);
+    }
+
+    //Report once a second until the time or exec limit is reached
+    double lastReport = f -> start;
+    uint64_t lastExecs = 0;
+    while (1) {
+        usleep(10000);
+        double now = wallSeconds();
+        uint64_t execs = totalExecs(f);
+
+        int done = (seconds > 0 && now - f -> start >= seconds) || (f -> maxExecs && execs >= f -> maxExecs);
+        if (now - lastReport >= 1.0 || done) {
+            pthread_mutex_lock(&f -> printLock);
+            printf("[%7.2fs] execs %llu (%.0f/s), corpus %d, edges %d, faults %d, hangs %d\n", now - f -> start,
+                (unsigned long long) execs, (execs - lastExecs) / (now - lastReport), atomic_load(&f -> corpusSize),
+                atomic_load(&f -> coverageCount), atomic_load(&f -> faults), atomic_load(&f -> hangs));
+            pthread_mutex_unlock(&f -> printLock);
+            lastReport = now;
+            lastExecs = execs;
+        }
+        if (done) {
+            break;
+        }
+    }
+
+    atomic_store(&f -> stop, 1);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    double elapsed = wallSeconds() - f -> start;
+    uint64_t execs = totalExecs(f);
+    printf("Execs: %llu\n", (unsigned long long) execs);
+    printf("Execs per second: %.0f\n", elapsed > 0 ? execs / elapsed : 0.0);
+    printf("Corpus: %d\n", atomic_load(&f -> corpusSize));
+    printf("Edges: %d\n", atomic_load(&f -> coverageCount));
+    printf("Faults: %d\n", atomic_load(&f -> faults));
+    printf("Hangs: %d\n", atomic_load(&f -> hangs));
+
+    for (int i = 0; i < threads; i++) {
+        freeCHIP8(workers[i].machine);
+    }
+    return atomic_load(&f -> faults) ? 1 : 0;
+}
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "machine/machine.h"
+#include "jit/jit.h"
+#include "batch/batch.h"
+#include "machine/savestate.h"
+#include "machine/movie.h"
+#include "machine/archive.h"
+#include "profile/profile.h"
+
+//Runs a ROM with no window, renderer or sleeping, as fast as the host allows
+//Timers still tick once per emulated 60Hz frame, counted in instructions, so ROMs behave as they would on screen
+#define DEFAULT_FRAMES 600
+
+//Addresses listed in a profile's text report; the JSON has all of them
+#define PROFILE_ADDRESSES 20
+
+static double wallSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+//Key pattern for lane runs: each lane holds one key for 4 frames in every 8, choosing it from a hash of the lane
+//Returns -1 while the lane has no key held
+static int laneKey(int lane, uint64_t frame) {
+    if ((frame & 7) >= 4) {
+        return -1;
+    }
+    uint32_t h = ((uint32_t) lane * 0x9e3779b9u) ^ ((uint32_t) (frame >> 3) * 0x85ebca6bu);
+    h ^= h >> 15;
+    return h & 0xf;
+}
+
+static int sameAsLane(CHIP8State *machine, CHIP8State *lane) {
+    return machine -> pc == lane -> pc && machine -> sp == lane -> sp && machine -> I == lane -> I
+        && machine -> delay == lane -> delay && machine -> sound == lane -> sound
+        && machine -> halt == lane -> halt && machine -> cycles == lane -> cycles && machine -> rng == lane -> rng
+        && memcmp(machine -> V, lane -> V, 16) == 0
+        && memcmp(machine -> memory, lane -> memory, BATCH_MEMORY_SIZE) == 0
+        && memcmp(machine -> screen, lane -> screen, 32 * sizeof(uint64_t)) == 0;
+}
+
+//Runs the ROM in N lanes of the lockstep engine, then as N separate machines on the chosen core,
+//with the same per-lane key presses, and reports both throughputs and how many lanes ended in the same state
+static void runLanes(CHIP8State *machine, int lanes, uint64_t frames) {
+    CHIP8Batch *batch = initBatch(lanes);
+    if (batch == NULL) {
+        return;
+    }
+
+    //Each lane is read back into a machine of its own, allocated the way every machine is
+    CHIP8State *lane = initCHIP8();
+    uint8_t *snapshot = malloc(SAVE_STATE_SIZE);
+    if (lane == NULL || snapshot == NULL) {
+        printf("Error: Unable to allocate a machine to compare lanes against.\n");
+        freeBatch(batch);
+        freeCHIP8(lane);
+        free(snapshot);
+        return;
+    }
+    loadBatch(batch, machine);
+
+    uint64_t batchInstructions = 0;
+    double start = wallSeconds();
+    for (uint64_t f = 0; f < frames; f++) {
+        for (int l = 0; l < lanes; l++) {
+            int key = laneKey(l, f);
+            for (int k = 0; k < 16; k++) {
+                keyUpBatch(batch, l, k);
+            }
+            if (key >= 0) {
+                keyDownBatch(batch, l, key);
+            }
+        }
+        batchInstructions += runFrameBatch(batch);
+    }
+    double batchElapsed = wallSeconds() - start;
+
+    //Each scalar run starts from the same state, restored over the one machine from a save state image
+    writeState(machine, snapshot);
+
+    uint64_t scalarInstructions = 0;
+    double scalarElapsed = 0;
+    int matching = 0;
+    uint32_t seed = machine -> seed;
+    for (int l = 0; l < lanes; l++) {
+        readState(machine, snapshot, SAVE_STATE_SIZE);
+        seedCHIP8(machine, seed + l);
+
+        start = wallSeconds();
+        for (uint64_t f = 0; f < frames && !(machine -> halt); f++) {
+            int key = laneKey(l, f);
+            for (int k = 0; k < 16; k++) {
+                keyUp(machine, k);
+            }
+            if (key >= 0) {
+                keyDown(machine, key);
+            }
+            scalarInstructions += runFrameCHIP8(machine);
+        }
+        scalarElapsed += wallSeconds() - start;
+
+        getLaneBatch(batch, l, lane);
+        matching += sameAsLane(machine, lane);
+    }
+
+    printf("Lanes: %d (%s)\n", lanes, batch -> vector ? "AVX2" : "scalar");
+    printf("Frames: %llu\n", (unsigned long long) frames);
+    printf("Batch instructions: %llu\n", (unsigned long long) batchInstructions);
+    printf("Batch wall time: %.6f s\n", batchElapsed);
+    printf("Batch instructions per second: %.0f\n", batchElapsed > 0 ? batchInstructions / batchElapsed : 0.0);
+    printf("Average lanes per group: %.1f\n", batch -> groups ? (double) batchInstructions / batch -> groups : 0.0);
+    printf("Scalar instructions: %llu\n", (unsigned long long) scalarInstructions);
+    printf("Scalar wall time: %.6f s\n", scalarElapsed);
+    printf("Scalar instructions per second: %.0f\n", scalarElapsed > 0 ? scalarInstructions / scalarElapsed : 0.0);
+    printf("Lanes matching scalar: %d/%d\n", matching, lanes);
+
+    freeCHIP8(lane);
+    free(snapshot);
+    freeBatch(batch);
+}
+
+//Prints the profile and writes it as JSON, if this run was profiled, then detaches it from the machine
+static int finishProfile(CHIP8State *machine, char *profileFile) {
+#ifdef CHIP8_PROFILE
+    if (machine -> profile == NULL) {
+        return 0;
+    }
+    printProfile(machine -> profile, machine, PROFILE_ADDRESSES);
+    int status = writeProfileJSON(machine -> profile, machine, profileFile);
+    freeProfile(machine -> profile);
+    machine -> profile = NULL;
+    return status;
+#else
+    return 0;
+#endif
+}
+
+static int runReplay(CHIP8State *machine, char *replayFile) {
+    Movie *movie = loadMovie(replayFile);
+    if (movie == NULL) {
+        return 1;
+    }
+
+    double start = wallSeconds();
+    int result = replayMovie(movie, machine);
+    double elapsed = wallSeconds() - start;
+
+    printf("Key events: %u\n", movie -> count);
+    printf("Instructions: %llu\n", (unsigned long long) machine -> cycles);
+    printf("Fused instructions: %llu (%.1f%%)\n", (unsigned long long) machine -> fused,
+        machine -> cycles ? 100.0 * machine -> fused / machine -> cycles : 0.0);
+    printf("Idle instructions skipped: %llu (%.1f%%)\n", (unsigned long long) machine -> idle,
+        machine -> cycles ? 100.0 * machine -> idle / machine -> cycles : 0.0);
+    printf("Wall time: %.6f s\n", elapsed);
+    printf("Instructions per second: %.0f\n", elapsed > 0 ? machine -> cycles / elapsed : 0.0);
+    if (result == 0) {
+        printf("Replay matches the recorded final state (hash %016llx).\n", (unsigned long long) movie -> endHash);
+    }
+    else {
+        printf("Replay diverged: ended at instruction %llu with hash %016llx, recorded %llu with hash %016llx.\n",
+            (unsigned long long) machine -> cycles, (unsigned long long) hashCHIP8(machine),
+            (unsigned long long) movie -> endCycles, (unsigned long long) movie -> endHash);
+    }
+    if (machine -> fault) {
+        decodeCHIP8(machine -> memory, machine -> faultAddress);
+        printf("Error: Unimplemented instruction.\n");
+    }
+
+    freeMovie(movie);
+    return result;
+}
+
+//Loads the ROM from its own file, or from an archive where filename is its name or content hash
+static int loadROM(CHIP8State *machine, char *filename, char *archiveFile) {
+    if (archiveFile == NULL) {
+        return openROM(machine, filename);
+    }
+
+    ROMArchive *archive = openArchive(archiveFile);
+    if (archive == NULL) {
+        return 1;
+    }
+    const ArchiveEntry *entry = findArchiveROM(archive, filename);
+    int result = 1;
+    if (entry == NULL) {
+        printf("Error: No ROM named or hashed %s in %s\n", filename, archiveFile);
+    }
+    else {
+        result = openArchiveROM(machine, archive, entry);
+    }
+    closeArchive(archive);
+    return result;
+}
+
+static void usage(void) {
+    printf("Usage: headless <path-to-rom> [--instructions N | --frames N] [--ips N] [--core dispatch|threaded|jit] [--lanes N]\n");
+    printf("                [--load FILE] [--save FILE] [--replay FILE] [--profile FILE] [--archive FILE]\n");
+    printf("  --instructions N   Stop after N instructions\n");
+    printf("  --frames N         Stop after N emulated 60Hz frames (default %d)\n", DEFAULT_FRAMES);
+    printf("  --ips N            Instructions per emulated second (default %d)\n", DEFAULT_IPS);
+    printf("  --core NAME        dispatch: one handler call per instruction\n");
+    printf("                     threaded: computed-goto interpreter (default)\n");
+    printf("                     jit: compiled x86-64 blocks where possible\n");
+    printf("  --lanes N          Run N copies in the lockstep engine, each with its own key presses, and compare\n");
+    printf("                     against N separate machines on the chosen core\n");
+    printf("  --archive FILE     Take the ROM from an archive built by romarchive, by name or 16-digit content hash\n");
+    printf("  --load FILE        Start from a save state instead of power-on, including its speed\n");
+    printf("  --save FILE        Write a save state when the run ends\n");
+    printf("  --replay FILE      Play back a movie recorded by the emulator and check it ends in the recorded state\n");
+    printf("  --profile FILE     Count instructions by opcode and address, print the hottest and write them all to FILE\n");
+    printf("                     as JSON (headless-profile only, built with make profile)\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 0;
+    }
+
+    char *filename = NULL;
+    char *core = "threaded";
+    uint64_t maxInstructions = 0;
+    uint64_t maxFrames = 0;
+    uint64_t ips = DEFAULT_IPS;
+    int lanes = 0;
+    char *loadFile = NULL;
+    char *saveFile = NULL;
+    char *replayFile = NULL;
+    char *profileFile = NULL;
+    char *archiveFile = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc) {
+            maxInstructions = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            maxFrames = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            ips = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--core") == 0 && i + 1 < argc) {
+            core = argv[++i];
+        }
+        else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+            lanes = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            loadFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            saveFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc) {
+            archiveFile = argv[++i];
+        }
+        else if (argv[i][0] == '-') {
+            usage();
+            return 1;
+        }
+        else {
+            filename = argv[i];
+        }
+    }
+
+    //Lane runs are measured in frames, since every lane has to stop at the same point
+    if (filename == NULL || ips == 0 || ips > UINT32_MAX || lanes < 0 || (lanes && maxInstructions)) {
+        usage();
+        return 1;
+    }
+    //Movies start from power-on and set their own length
+    if (replayFile != NULL && (lanes || loadFile != NULL || maxInstructions || maxFrames)) {
+        usage();
+        return 1;
+    }
+
+#ifndef CHIP8_PROFILE
+    if (profileFile != NULL) {
+        printf("Error: Profiling isn't compiled in; build headless-profile with make profile.\n");
+        return 1;
+    }
+#endif
+
+    //Without an explicit limit, run for a fixed number of frames so the process always ends
+    if (maxInstructions == 0 && maxFrames == 0) {
+        maxFrames = DEFAULT_FRAMES;
+    }
+
+    CHIP8State *machine = initCHIP8();
+    if (loadROM(machine, filename, archiveFile) != 0) {
+        freeCHIP8(machine);
+        return 1;
+    }
+    setSpeedCHIP8(machine, (uint32_t) ips);
+    if (loadFile != NULL && loadState(machine, loadFile) != 0) {
+        freeCHIP8(machine);
+        return 1;
+    }
+
+    CHIP8JIT *jit = NULL;
+    if (strcmp(core, "dispatch") == 0) {
+        machine -> core = emulateCHIP8Batch;
+    }
+    else if (strcmp(core, "jit") == 0) {
+        jit = initJIT(machine);
+        if (jit == NULL) {
+            printf("JIT unavailable on this host, using the threaded interpreter.\n");
+        }
+    }
+    else if (strcmp(core, "threaded") != 0) {
+        usage();
+        freeCHIP8(machine);
+        return 1;
+    }
+
+    if (lanes) {
+        runLanes(machine, lanes, maxFrames);
+        freeJIT(machine, jit);
+        freeCHIP8(machine);
+        return 0;
+    }
+
+#ifdef CHIP8_PROFILE
+    if (profileFile != NULL) {
+        machine -> profile = initProfile();
+    }
+#endif
+
+    if (replayFile != NULL) {
+        int status = runReplay(machine, replayFile);
+        if (finishProfile(machine, profileFile) != 0) {
+            status = 1;
+        }
+        if (saveFile != NULL && saveState(machine, saveFile) != 0) {
+            status = 1;
+        }
+        freeJIT(machine, jit);
+        freeCHIP8(machine);
+        return status;
+    }
+
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+    double start = wallSeconds();
+
+    while (!(machine -> halt)) {
+        if (maxFrames && frames >= maxFrames) {
+            break;
+        }
+        if (maxInstructions && instructions >= maxInstructions) {
+            break;
+        }
+
+        //Run the rest of the current frame in one batch, or less if that would pass the instruction limit
+        uint64_t count = machine -> nextTimerCycle - machine -> cycles;
+        if (maxInstructions && maxInstructions - instructions < count) {
+            count = maxInstructions - instructions;
+        }
+
+        uint64_t ticks = machine -> timerTicks;
+        instructions += runCHIP8(machine, count);
+        frames += machine -> timerTicks - ticks;
+    }
+
+    double elapsed = wallSeconds() - start;
+
+    printf("Instructions: %llu\n", (unsigned long long) instructions);
+    printf("Fused instructions: %llu (%.1f%%)\n", (unsigned long long) machine -> fused,
+        instructions ? 100.0 * machine -> fused / instructions : 0.0);
+    printf("Idle instructions skipped: %llu (%.1f%%)\n", (unsigned long long) machine -> idle,
+        instructions ? 100.0 * machine -> idle / instructions : 0.0);
+    printf("Frames: %llu\n", (unsigned long long) frames);
+    printf("Wall time: %.6f s\n", elapsed);
+    printf("Instructions per second: %.0f\n", elapsed > 0 ? instructions / elapsed : 0.0);
+    if (machine -> fault) {
+        decodeCHIP8(machine -> memory, machine -> faultAddress);
+        printf("Error: Unimplemented instruction.\n");
+    }
+    else if (machine -> halt) {
+        printf("Machine halted at PC %04x.\n", machine -> pc);
+    }
+
+    int status = machine -> fault ? 1 : 0;
+    if (finishProfile(machine, profileFile) != 0) {
+        status = 1;
+    }
+    if (saveFile != NULL && saveState(machine, saveFile) != 0) {
+        status = 1;
+    }
+    freeJIT(machine, jit);
+    freeCHIP8(machine);
+    return status;
+}
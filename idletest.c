@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/machine.h"
+#include "jit/jit.h"
+
+//Idle loop tests: small ROMs run at the default speed behind a core that counts every instruction handed to it
+//runCHIP8 may skip whole trips round an idle loop, but everything it runs has to go through the machine's core,
+//so coverage hooks and compiled code see it; the count reaching the core plus the idle count must be the cycle count
+#define TEST_FRAMES 60
+
+typedef struct IdleTest {
+    const char *name;
+    const char *description;
+    const uint16_t *code;
+    int length;
+    int idle;                   //Whether the ROM spends its time in a loop runCHIP8 should skip
+} IdleTest;
+
+//Ten instructions that change registers every trip, so nothing is skipped
+static const uint16_t busyCode[] = {
+    0x7001,     //200: V0 += 1
+    0x7102,     //202: V1 += 2
+    0x7203,     //204: V2 += 3
+    0x7304,     //206: V3 += 4
+    0x7405,     //208: V4 += 5
+    0x7506,     //20A: V5 += 6
+    0x7607,     //20C: V6 += 7
+    0x7708,     //20E: V7 += 8
+    0x7809,     //210: V8 += 9
+    0x1200,     //212: loop to 200
+};
+
+//A counting loop short enough to be probed every batch, which never repeats its registers
+static const uint16_t countCode[] = {
+    0x7001,     //200: V0 += 1
+    0x1200,     //202: loop to 200
+};
+
+//Polls the delay timer, which outlasts the run, so every batch is the same trip round and round
+static const uint16_t delayCode[] = {
+    0x60FF,     //200: V0 = FF
+    0xF015,     //202: delay = V0
+    0xF007,     //204: V0 = delay
+    0x3000,     //206: skip if V0 == 0
+    0x1204,     //208: loop to 204
+    0x120A,     //20A: halt
+};
+
+//Waits in FX0A with no keys pressed
+static const uint16_t keyCode[] = {
+    0xF00A,     //200: wait for a key
+    0x1202,     //202: halt
+};
+
+#define IDLE_TEST(name, description, code, idle) { name, description, code, sizeof(code) / sizeof(code[0]), idle }
+
+static const IdleTest tests[] = {
+    IDLE_TEST("busy", "ten-instruction loop that changes registers every trip", busyCode, 0),
+    IDLE_TEST("count", "two-instruction counting loop", countCode, 0),
+    IDLE_TEST("delay", "FX07 delay timer poll", delayCode, 1),
+    IDLE_TEST("key", "FX0A with no key pressed", keyCode, 1),
+};
+
+static const char *cores[] = { "dispatch", "threaded", "jit" };
+
+#define TEST_COUNT (int) (sizeof(tests) / sizeof(tests[0]))
+#define CORE_COUNT (int) (sizeof(cores) / sizeof(cores[0]))
+
+//Installed as the machine's core in front of the one being tested, which gets its own data back while it runs
+typedef struct Counter {
+    CHIP8Core inner;
+    void *innerData;
+    uint64_t reached;
+} Counter;
+
+static int countingCore(CHIP8State *state, int count) {
+    Counter *counter = state -> coreData;
+    state -> coreData = counter -> innerData;
+    int ran = counter -> inner(state, count);
+    state -> coreData = counter;
+    counter -> reached += ran;
+    return ran;
+}
+
+//Assembles a test into ROM bytes, big-endian as the machine reads them
+static uint16_t buildROM(const IdleTest *test, uint8_t *rom) {
+    for (int i = 0; i < test -> length; i++) {
+        rom[i * 2] = test -> code[i] >> 8;
+        rom[i * 2 + 1] = test -> code[i] & 0xff;
+    }
+    return test -> length * 2;
+}
+
+//Runs the test on one core, printing a line for it; returns 1 if it failed, 0 if it passed, -1 if the core isn't available
+static int runTest(const IdleTest *test, const char *core, uint64_t *hash) {
+    uint8_t rom[MAX_ROM_SIZE];
+    uint16_t size = buildROM(test, rom);
+
+    CHIP8State *machine = initCHIP8();
+    if (machine == NULL) {
+        return -1;
+    }
+    resetCHIP8(machine, rom, size);
+    setSpeedCHIP8(machine, DEFAULT_IPS);
+
+    CHIP8JIT *jit = NULL;
+    if (strcmp(core, "dispatch") == 0) {
+        machine -> core = emulateCHIP8Batch;
+    }
+    else if (strcmp(core, "jit") == 0) {
+        jit = initJIT(machine);
+        if (jit == NULL) {
+            freeCHIP8(machine);
+            return -1;
+        }
+    }
+
+    Counter counter = { machine -> core, machine -> coreData, 0 };
+    machine -> core = countingCore;
+    machine -> coreData = &counter;
+    for (int f = 0; f < TEST_FRAMES && !(machine -> halt); f++) {
+        runFrameCHIP8(machine);
+    }
+    machine -> core = counter.inner;
+    machine -> coreData = counter.innerData;
+
+    int failures = 0;
+    if (counter.reached + machine -> idle != machine -> cycles) {
+        printf("  %s on %s: %llu instructions reached the core and %llu were skipped, of %llu run\n", test -> name, core,
+            (unsigned long long) counter.reached, (unsigned long long) machine -> idle, (unsigned long long) machine -> cycles);
+        failures++;
+    }
+    if (test -> idle ? machine -> idle == 0 : machine -> idle != 0) {
+        printf("  %s on %s: %llu instructions were skipped as idle\n", test -> name, core, (unsigned long long) machine -> idle);
+        failures++;
+    }
+    if (machine -> halt) {
+        printf("  %s on %s: halted early\n", test -> name, core);
+        failures++;
+    }
+
+    printf("%-8s %-9s %10llu %10llu %10llu %s\n", test -> name, core, (unsigned long long) machine -> cycles,
+        (unsigned long long) counter.reached, (unsigned long long) machine -> idle, failures ? "FAIL" : "ok");
+    *hash = hashCHIP8(machine);
+
+    freeJIT(machine, jit);
+    freeCHIP8(machine);
+    return failures != 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        printf("Usage: idletest\n");
+        printf("Tests:\n");
+        for (int t = 0; t < TEST_COUNT; t++) {
+            printf("  %-8s %s\n", tests[t].name, tests[t].description);
+        }
+        return 1;
+    }
+
+    int failed = 0;
+    printf("%-8s %-9s %10s %10s %10s %s\n", "Test", "Core", "Cycles", "Core ran", "Skipped", "Result");
+    for (int t = 0; t < TEST_COUNT; t++) {
+        uint64_t reference = 0;
+        int referenced = 0;
+
+        for (int c = 0; c < CORE_COUNT; c++) {
+            uint64_t hash;
+            int result = runTest(&tests[t], cores[c], &hash);
+            if (result < 0) {
+                printf("%-8s %-9s %10s\n", tests[t].name, cores[c], "unavailable");
+                continue;
+            }
+
+            //Skipping has to leave every core in the same state
+            if (referenced && hash != reference) {
+                printf("  %s on %s: state differs from %s\n", tests[t].name, cores[c], cores[0]);
+                result = 1;
+            }
+            reference = hash;
+            referenced = 1;
+            failed += result;
+        }
+    }
+
+    if (failed) {
+        printf("\n%d runs failed.\n", failed);
+        return 1;
+    }
+    printf("\nAll idle tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "jit.h"
+#include "../font4x5.h"
+
+//Profiled builds leave everything to the interpreter, since compiled blocks would skip the counters
+#if defined(__x86_64__) && defined(__linux__) && !defined(CHIP8_PROFILE)
+#include <sys/mman.h>
+
+//A block is a straight run of instructions ending at a jump, a skip, or the first instruction the JIT can't compile
+//Blocks are keyed by their start address, and are at most JIT_MAX_BLOCK instructions long
+#define JIT_MAX_BLOCK 32
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_BLOCK_HEADROOM 4096         //Comfortably more than the longest block plus prologue and epilogue
+
+enum { BLOCK_UNKNOWN = 0, BLOCK_NATIVE, BLOCK_INTERPRET };
+enum { KIND_NONE = 0, KIND_STRAIGHT, KIND_BRANCH };
+
+//x86-64 register numbers
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+//Condition codes for CMOVcc/SETcc
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+
+//ALU opcodes (op r/m32, r32) and their 0x81 /ext immediate forms
+#define OP_ADD 0x01
+#define OP_OR 0x09
+#define OP_AND 0x21
+#define OP_SUB 0x29
+#define OP_XOR 0x31
+#define OP_CMP 0x39
+#define OP_MOV 0x89
+#define EXT_ADD 0
+#define EXT_AND 4
+#define EXT_XOR 6
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+//Inside a block the state pointer stays in RDI, I in RSI, and RAX/RCX are scratch
+//V registers used by the block are pinned to these, the last six are callee-saved so get pushed if used
+static const int vRegisterPool[] = { R8, R9, R10, R11, RBX, RBP, R12, R13, R14, R15 };
+#define POOL_SIZE 10
+#define POOL_CALLER_SAVED 4
+
+typedef void (*JITCode)(CHIP8State *state);
+
+typedef struct JITBlock {
+    JITCode code;
+    uint8_t status;
+    uint8_t count;
+} JITBlock;
+
+struct CHIP8JIT {
+    uint8_t *code;
+    size_t used;
+    JITBlock blocks[4096];
+    uint64_t covered[64];       //Bit per address, set once any block entry was made from that byte, so writes elsewhere skip the scan
+};
+
+typedef struct Emitter {
+    uint8_t *p;
+} Emitter;
+
+static void emit8(Emitter *e, uint8_t byte) {
+    *(e -> p)++ = byte;
+}
+
+static void emit32(Emitter *e, uint32_t value) {
+    memcpy(e -> p, &value, 4);
+    e -> p += 4;
+}
+
+static void emitRex(Emitter *e, int reg, int rm, int force) {
+    uint8_t rex = 0x40 | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if (rex != 0x40 || force) {
+        emit8(e, rex);
+    }
+}
+
+static void emitRegReg(Emitter *e, uint8_t opcode, int dst, int src) {
+    emitRex(e, src, dst, 0);
+    emit8(e, opcode);
+    emit8(e, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void emitRegImm(Emitter *e, int ext, int dst, uint32_t imm) {
+    emitRex(e, 0, dst, 0);
+    emit8(e, 0x81);
+    emit8(e, 0xc0 | (ext << 3) | (dst & 7));
+    emit32(e, imm);
+}
+
+static void emitMovImm(Emitter *e, int dst, uint32_t imm) {
+    emitRex(e, 0, dst, 0);
+    emit8(e, 0xb8 | (dst & 7));
+    emit32(e, imm);
+}
+
+static void emitShift(Emitter *e, int ext, int dst, uint8_t amount) {
+    emitRex(e, 0, dst, 0);
+    emit8(e, 0xc1);
+    emit8(e, 0xc0 | (ext << 3) | (dst & 7));
+    emit8(e, amount);
+}
+
+static void emitCmov(Emitter *e, uint8_t cc, int dst, int src) {
+    emitRex(e, dst, src, 0);
+    emit8(e, 0x0f);
+    emit8(e, 0x40 | cc);
+    emit8(e, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+static void emitImulImm(Emitter *e, int dst, int src, uint8_t imm) {
+    emitRex(e, dst, src, 0);
+    emit8(e, 0x6b);
+    emit8(e, 0xc0 | ((dst & 7) << 3) | (src & 7));
+    emit8(e, imm);
+}
+
+//MOVZX r32, byte or word [RDI + offset]
+static void emitLoadState(Emitter *e, uint8_t opcode, int dst, uint32_t offset) {
+    emitRex(e, dst, RDI, 0);
+    emit8(e, 0x0f);
+    emit8(e, opcode);
+    emit8(e, 0x80 | ((dst & 7) << 3) | RDI);
+    emit32(e, offset);
+}
+
+static void emitStoreByte(Emitter *e, int src, uint32_t offset) {
+    //Always emit REX so register numbers 4-7 mean SPL/BPL/SIL/DIL rather than AH/CH/DH/BH
+    emitRex(e, src, RDI, 1);
+    emit8(e, 0x88);
+    emit8(e, 0x80 | ((src & 7) << 3) | RDI);
+    emit32(e, offset);
+}
+
+static void emitStoreWord(Emitter *e, int src, uint32_t offset) {
+    emit8(e, 0x66);
+    emitRex(e, src, RDI, 0);
+    emit8(e, 0x89);
+    emit8(e, 0x80 | ((src & 7) << 3) | RDI);
+    emit32(e, offset);
+}
+
+static void emitPush(Emitter *e, int reg) {
+    emitRex(e, 0, reg, 0);
+    emit8(e, 0x50 | (reg & 7));
+}
+
+static void emitPop(Emitter *e, int reg) {
+    emitRex(e, 0, reg, 0);
+    emit8(e, 0x58 | (reg & 7));
+}
+
+//Whether the instruction can go in a block, and whether it ends one
+static int classify(uint8_t *code, uint16_t address) {
+    uint16_t nnn = ((code[0] & 0xf) << 8) | code[1];
+    switch (code[0] >> 4) {
+        //A jump to itself is left to the interpreter, which sets the halt flag
+        case 0x1: return (nnn == address) ? KIND_NONE : KIND_BRANCH;
+        //The interpreter ignores the last nibble of 5XY0 and 9XY0, so the JIT does too
+        case 0x3: case 0x4: case 0x5: case 0x9: return KIND_BRANCH;
+        case 0x6: case 0x7: case 0xa: return KIND_STRAIGHT;
+        case 0x8:
+            switch (code[1] & 0xf) {
+                case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 0xe: return KIND_STRAIGHT;
+                default: return KIND_NONE;
+            }
+        case 0xf:
+            switch (code[1]) {
+                case 0x07: case 0x15: case 0x18: case 0x1e: case 0x29: return KIND_STRAIGHT;
+                default: return KIND_NONE;
+            }
+        default: return KIND_NONE;
+    }
+}
+
+//Bitmask of V registers an instruction reads or writes
+static uint16_t registersUsed(uint8_t *code) {
+    uint16_t x = 1 << (code[0] & 0xf);
+    uint16_t y = 1 << (code[1] >> 4);
+    switch (code[0] >> 4) {
+        case 0x3: case 0x4: case 0x6: case 0x7: return x;
+        case 0x5: case 0x9: return x | y;
+        case 0x8: return ((code[1] & 0xf) == 0) ? (x | y) : (x | y | 0x8000);
+        case 0xf: return (code[1] == 0x1e) ? (x | 0x8000) : x;
+        default: return 0;
+    }
+}
+
+//Bitmask of V registers an instruction writes, so the epilogue only stores those back
+static uint16_t registersWritten(uint8_t *code) {
+    uint16_t x = 1 << (code[0] & 0xf);
+    switch (code[0] >> 4) {
+        case 0x6: case 0x7: return x;
+        case 0x8: return ((code[1] & 0xf) == 0) ? x : (x | 0x8000);
+        case 0xf:
+            switch (code[1]) {
+                case 0x07: return x;
+                case 0x1e: return 0x8000;
+                default: return 0;
+            }
+        default: return 0;
+    }
+}
+
+static void flushJIT(CHIP8JIT *jit) {
+    jit -> used = 0;
+    memset(jit -> blocks, 0, sizeof(jit -> blocks));
+    memset(jit -> covered, 0, sizeof(jit -> covered));
+}
+
+//Bits stay set after the blocks over them are dropped, which only costs a scan that finds nothing
+static void markCovered(CHIP8JIT *jit, uint16_t start, int length) {
+    for (int i = 0; i < length; i++) {
+        uint16_t address = (start + i) & 0xfff;
+        jit -> covered[address >> 6] |= 1ull << (address & 63);
+    }
+}
+
+//Tests the range a 64-bit word at a time, since most writes are FX55 bursts of up to 16 bytes
+static int isCovered(CHIP8JIT *jit, uint16_t start, int length) {
+    int i = 0;
+    while (i < length) {
+        uint16_t address = (start + i) & 0xfff;
+        int bits = 64 - (address & 63);
+        if (bits > length - i) {
+            bits = length - i;
+        }
+        uint64_t mask = ((bits == 64) ? ~0ull : ((1ull << bits) - 1)) << (address & 63);
+        if (jit -> covered[address >> 6] & mask) {
+            return 1;
+        }
+        i += bits;
+    }
+    return 0;
+}
+
+static void emitInstruction(Emitter *e, uint8_t *code, uint16_t address, int *hostReg) {
+    uint8_t x = code[0] & 0xf;
+    uint8_t y = code[1] >> 4;
+    uint8_t nn = code[1];
+    uint16_t nnn = ((code[0] & 0xf) << 8) | code[1];
+    int vx = hostReg[x];
+    int vy = hostReg[y];
+    int vf = hostReg[0xf];
+    uint8_t cc = CC_E;
+
+    switch (code[0] >> 4) {
+        case 0x1:
+            emitMovImm(e, RAX, nnn);
+            emitStoreWord(e, RAX, offsetof(CHIP8State, pc));
+            break;
+        case 0x4: case 0x9:
+            cc = CC_NE;
+            //Fall through
+        case 0x3: case 0x5:
+            //PC = condition ? address + 4 : address + 2, with no host branch
+            emitMovImm(e, RAX, address + 2);
+            emitMovImm(e, RCX, address + 4);
+            if ((code[0] >> 4) == 0x3 || (code[0] >> 4) == 0x4) {
+                emitRegImm(e, EXT_CMP, vx, nn);
+            }
+            else {
+                emitRegReg(e, OP_CMP, vx, vy);
+            }
+            emitCmov(e, cc, RAX, RCX);
+            emitStoreWord(e, RAX, offsetof(CHIP8State, pc));
+            break;
+        case 0x6:
+            emitMovImm(e, vx, nn);
+            break;
+        case 0x7:
+            emitRegImm(e, EXT_ADD, vx, nn);
+            emitRegImm(e, EXT_AND, vx, 0xff);
+            break;
+        case 0x8:
+            switch (code[1] & 0xf) {
+                case 0: emitRegReg(e, OP_MOV, vx, vy); break;
+                case 1: emitRegReg(e, OP_OR, vx, vy); emitMovImm(e, vf, 0); break;
+                case 2: emitRegReg(e, OP_AND, vx, vy); emitMovImm(e, vf, 0); break;
+                case 3: emitRegReg(e, OP_XOR, vx, vy); emitMovImm(e, vf, 0); break;
+                case 4:
+                    //Carry is bit 8 of the 32-bit sum
+                    emitRegReg(e, OP_MOV, RAX, vx);
+                    emitRegReg(e, OP_ADD, RAX, vy);
+                    emitRegReg(e, OP_MOV, RCX, RAX);
+                    emitRegImm(e, EXT_AND, RCX, 0xff);
+                    emitRegReg(e, OP_MOV, vx, RCX);
+                    emitShift(e, EXT_SHR, RAX, 8);
+                    emitRegReg(e, OP_MOV, vf, RAX);
+                    break;
+                case 5: case 7:
+                    //A borrow leaves the 32-bit difference negative, VF is the inverted sign bit
+                    if ((code[1] & 0xf) == 5) {
+                        emitRegReg(e, OP_MOV, RAX, vx);
+                        emitRegReg(e, OP_SUB, RAX, vy);
+                    }
+                    else {
+                        emitRegReg(e, OP_MOV, RAX, vy);
+                        emitRegReg(e, OP_SUB, RAX, vx);
+                    }
+                    emitRegReg(e, OP_MOV, RCX, RAX);
+                    emitRegImm(e, EXT_AND, RCX, 0xff);
+                    emitRegReg(e, OP_MOV, vx, RCX);
+                    emitShift(e, EXT_SHR, RAX, 31);
+                    emitRegImm(e, EXT_XOR, RAX, 1);
+                    emitRegReg(e, OP_MOV, vf, RAX);
+                    break;
+                case 6:
+                    emitRegReg(e, OP_MOV, RAX, vy);
+                    emitRegReg(e, OP_MOV, RCX, RAX);
+                    emitShift(e, EXT_SHR, RCX, 1);
+                    emitRegReg(e, OP_MOV, vx, RCX);
+                    emitRegImm(e, EXT_AND, RAX, 1);
+                    emitRegReg(e, OP_MOV, vf, RAX);
+                    break;
+                case 0xe:
+                    emitRegReg(e, OP_MOV, RAX, vy);
+                    emitRegReg(e, OP_MOV, RCX, RAX);
+                    emitShift(e, EXT_SHL, RCX, 1);
+                    emitRegImm(e, EXT_AND, RCX, 0xff);
+                    emitRegReg(e, OP_MOV, vx, RCX);
+                    emitShift(e, EXT_SHR, RAX, 7);
+                    emitRegReg(e, OP_MOV, vf, RAX);
+                    break;
+            }
+            break;
+        case 0xa:
+            emitMovImm(e, RSI, nnn);
+            break;
+        case 0xf:
+            switch (code[1]) {
+                case 0x07: emitLoadState(e, 0xb6, vx, offsetof(CHIP8State, delay)); break;
+                case 0x15: emitStoreByte(e, vx, offsetof(CHIP8State, delay)); break;
+                case 0x18: emitStoreByte(e, vx, offsetof(CHIP8State, sound)); break;
+                case 0x1e:
+                    //I is 16 bits wide, and VF flags it going past the 12-bit address space
+                    emitRegReg(e, OP_ADD, RSI, vx);
+                    emitRegImm(e, EXT_AND, RSI, 0xffff);
+                    emitRegReg(e, OP_XOR, RAX, RAX);
+                    emitRegImm(e, EXT_CMP, RSI, 0xfff);
+                    emit8(e, 0x0f);
+                    emit8(e, 0x90 | CC_A);
+                    emit8(e, 0xc0);                 //SETA AL
+                    emitRegReg(e, OP_MOV, vf, RAX);
+                    break;
+                case 0x29:
+                    emitImulImm(e, RSI, vx, 5);
+                    if (FONT_BASE) {
+                        emitRegImm(e, EXT_ADD, RSI, FONT_BASE);
+                    }
+                    break;
+            }
+            break;
+    }
+}
+
+static void compileBlock(CHIP8State *state, CHIP8JIT *jit, uint16_t start) {
+    int hostReg[16];
+    uint16_t used = 0;
+    uint16_t written = 0;
+    int allocated = 0;
+    int count = 0;
+    int branch = 0;
+    int usesI = 0;
+    uint16_t address = start;
+
+    for (int i = 0; i < 16; i++) {
+        hostReg[i] = -1;
+    }
+
+    //First pass finds where the block ends and gives each V register it touches a host register
+    while (count < JIT_MAX_BLOCK && address + 1 < 4096) {
+        uint8_t *code = &(state -> memory[address]);
+        int kind = classify(code, address);
+        if (kind == KIND_NONE) {
+            break;
+        }
+
+        uint16_t fresh = registersUsed(code) & ~used;
+        if (allocated + __builtin_popcount(fresh) > POOL_SIZE) {
+            break;
+        }
+        for (int r = 0; r < 16; r++) {
+            if (fresh & (1 << r)) {
+                hostReg[r] = vRegisterPool[allocated++];
+            }
+        }
+        used |= fresh;
+        written |= registersWritten(code);
+        usesI |= ((code[0] >> 4) == 0xa) || ((code[0] >> 4) == 0xf && (code[1] == 0x1e || code[1] == 0x29));
+
+        count++;
+        address += 2;
+        if (kind == KIND_BRANCH) {
+            branch = 1;
+            break;
+        }
+    }
+
+    //Nothing compilable here, so remember to hand this address straight to the interpreter
+    if (count == 0) {
+        jit -> blocks[start].status = BLOCK_INTERPRET;
+        jit -> blocks[start].count = 1;
+        markCovered(jit, start, 2);
+        return;
+    }
+
+    if (jit -> used + JIT_BLOCK_HEADROOM > JIT_CODE_SIZE) {
+        flushJIT(jit);
+    }
+
+    Emitter e = { jit -> code + jit -> used };
+    uint8_t *entry = e.p;
+
+    //Prologue: save any callee-saved registers in use, then load V registers and I
+    for (int i = POOL_CALLER_SAVED; i < allocated; i++) {
+        emitPush(&e, vRegisterPool[i]);
+    }
+    for (int r = 0; r < 16; r++) {
+        if (hostReg[r] >= 0) {
+            emitLoadState(&e, 0xb6, hostReg[r], offsetof(CHIP8State, V) + r);
+        }
+    }
+    if (usesI) {
+        emitLoadState(&e, 0xb7, RSI, offsetof(CHIP8State, I));
+    }
+
+    address = start;
+    for (int i = 0; i < count; i++) {
+        emitInstruction(&e, &(state -> memory[address]), address, hostReg);
+        address += 2;
+    }
+
+    //A block that stopped before an unsupported instruction continues at that instruction
+    if (!branch) {
+        emitMovImm(&e, RAX, address);
+        emitStoreWord(&e, RAX, offsetof(CHIP8State, pc));
+    }
+
+    //Epilogue: write back modified registers and restore the callee-saved ones
+    for (int r = 0; r < 16; r++) {
+        if (written & (1 << r)) {
+            emitStoreByte(&e, hostReg[r], offsetof(CHIP8State, V) + r);
+        }
+    }
+    if (usesI) {
+        emitStoreWord(&e, RSI, offsetof(CHIP8State, I));
+    }
+    for (int i = allocated - 1; i >= POOL_CALLER_SAVED; i--) {
+        emitPop(&e, vRegisterPool[i]);
+    }
+    emit8(&e, 0xc3);
+
+    jit -> used += e.p - entry;
+    jit -> blocks[start].code = (JITCode) entry;
+    jit -> blocks[start].status = BLOCK_NATIVE;
+    jit -> blocks[start].count = count;
+    markCovered(jit, start, count * 2);
+}
+
+static void invalidateBlocks(void *data, uint16_t address, uint16_t length) {
+    CHIP8JIT *jit = data;
+
+    //Most writes are to data, which no block was compiled from
+    if (!isCovered(jit, address, length)) {
+        return;
+    }
+
+    //Blocks starting up to a full block before the write may still cover it
+    for (int i = -(JIT_MAX_BLOCK * 2); i < length; i++) {
+        JITBlock *block = &(jit -> blocks[(address + i) & 0xfff]);
+        if (block -> status != BLOCK_UNKNOWN && i + (block -> count * 2) > 0) {
+            block -> status = BLOCK_UNKNOWN;
+        }
+    }
+}
+
+CHIP8JIT* initJIT(CHIP8State *state) {
+    CHIP8JIT *jit = calloc(1, sizeof(CHIP8JIT));
+    if (jit == NULL) {
+        return NULL;
+    }
+
+    jit -> code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit -> code == MAP_FAILED) {
+        logCHIP8(state, "Error: Couldn't map executable memory for the JIT.");
+        free(jit);
+        return NULL;
+    }
+
+    //The core tells us about every guest memory write so overwritten code gets recompiled
+    state -> invalidateHook = invalidateBlocks;
+    state -> invalidateHookData = jit;
+
+    //runCHIP8 now hands its batches to the JIT
+    state -> core = emulateJITBatch;
+    state -> coreData = jit;
+    return jit;
+}
+
+void freeJIT(CHIP8State *state, CHIP8JIT *jit) {
+    if (jit == NULL) {
+        return;
+    }
+
+    if (state -> invalidateHookData == jit) {
+        state -> invalidateHook = NULL;
+        state -> invalidateHookData = NULL;
+    }
+    if (state -> coreData == jit) {
+        state -> core = emulateCHIP8Threaded;
+        state -> coreData = NULL;
+    }
+    munmap(jit -> code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+int emulateJIT(CHIP8State *state, CHIP8JIT *jit, int budget) {
+    uint16_t address = state -> pc;
+    if (address >= 4096) {
+        emulateCHIP8(state);
+        return 1;
+    }
+
+    JITBlock *block = &(jit -> blocks[address]);
+    if (block -> status == BLOCK_UNKNOWN) {
+        compileBlock(state, jit, address);
+    }
+
+    //Never run past the caller's budget, so timers see exactly the same instruction counts as the interpreter
+    if (block -> status == BLOCK_NATIVE && block -> count <= budget) {
+        block -> code(state);
+        return block -> count;
+    }
+
+    emulateCHIP8(state);
+    return 1;
+}
+
+int emulateJITBatch(CHIP8State *state, int count) {
+    CHIP8JIT *jit = state -> coreData;
+    int executed = 0;
+    while (executed < count && !(state -> halt)) {
+        executed += emulateJIT(state, jit, count - executed);
+    }
+    return executed;
+}
+
+#else
+
+//No code generator for this host, so initJIT reports that and callers stay on the interpreter
+CHIP8JIT* initJIT(CHIP8State *state) {
+    return NULL;
+}
+
+void freeJIT(CHIP8State *state, CHIP8JIT *jit) {
+}
+
+int emulateJIT(CHIP8State *state, CHIP8JIT *jit, int budget) {
+    emulateCHIP8(state);
+    return 1;
+}
+
+int emulateJITBatch(CHIP8State *state, int count) {
+    return emulateCHIP8Threaded(state, count);
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "../CHIP8emu.h"
+
+//Optional x86-64 dynamic recompiler for straight-line runs of CHIP-8 instructions
+//initJIT returns NULL on hosts it can't generate code for, callers then just use emulateCHIP8
+//Otherwise it becomes the state's core, so runCHIP8 runs compiled blocks
+typedef struct CHIP8JIT CHIP8JIT;
+
+CHIP8JIT* initJIT(CHIP8State *state);
+void freeJIT(CHIP8State *state, CHIP8JIT *jit);
+int emulateJIT(CHIP8State *state, CHIP8JIT *jit, int budget);
+int emulateJITBatch(CHIP8State *state, int count);
+
+#endif
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "archive.h"
+#include "machine.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define ARCHIVE_MMAP 1
+#endif
+
+_Static_assert(sizeof(ArchiveHeader) == 32, "archive header layout changed size");
+_Static_assert(sizeof(ArchiveEntry) == 32, "archive entry layout changed size");
+
+uint64_t hashROM(const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+//Puts entry number index into the first free slot from hash on, as stored in the file (number + 1)
+static void insertSlot(uint32_t *table, uint32_t slots, uint64_t hash, uint32_t index) {
+    uint32_t slot = (uint32_t) hash & (slots - 1);
+    while (table[slot] != 0) {
+        slot = (slot + 1) & (slots - 1);
+    }
+    table[slot] = LE32(index + 1);
+}
+
+static const char* baseName(const char *path) {
+    const char *name = path;
+    for (const char *c = path; *c; c++) {
+        if (*c == '/' || *c == '\\') {
+            name = c + 1;
+        }
+    }
+    return name;
+}
+
+//Everything an archive holds before it's laid out, with offsets of names and data relative to their own blobs
+typedef struct ArchiveBuilder {
+    ArchiveEntry *entries;
+    uint32_t count;
+    uint32_t slots;
+    uint32_t *hashTable;
+    uint32_t *nameTable;
+    char *names;
+    size_t namesSize;
+    uint8_t *data;
+    size_t dataSize;
+} ArchiveBuilder;
+
+static int addArchiveROM(ArchiveBuilder *builder, char *path) {
+    uint8_t rom[MAX_ROM_SIZE];
+    uint16_t size;
+    if (readROM(path, rom, &size) != 0) {
+        return 1;
+    }
+    uint64_t hash = hashROM(rom, size);
+    uint32_t index = builder -> count;
+    uint32_t mask = builder -> slots - 1;
+
+    //Identical contents are stored once, and every name for them points at the same bytes
+    const ArchiveEntry *same = NULL;
+    for (uint32_t slot = (uint32_t) hash & mask; builder -> hashTable[slot] != 0; slot = (slot + 1) & mask) {
+        const ArchiveEntry *other = &(builder -> entries[LE32(builder -> hashTable[slot]) - 1]);
+        if (LE64(other -> hash) == hash && LE16(other -> size) == size
+            && memcmp(builder -> data + LE32(other -> offset), rom, size) == 0) {
+            same = other;
+            break;
+        }
+    }
+    uint32_t offset;
+    if (same != NULL) {
+        offset = LE32(same -> offset);
+    }
+    else {
+        offset = (uint32_t) builder -> dataSize;
+        builder -> data = realloc(builder -> data, builder -> dataSize + size);
+        memcpy(builder -> data + builder -> dataSize, rom, size);
+        builder -> dataSize += size;
+        insertSlot(builder -> hashTable, builder -> slots, hash, index);
+    }
+
+    //Names are file names, so ROMs from different directories can share one; the first keeps it
+    const char *name = baseName(path);
+    size_t nameLength = strlen(name);
+    if (nameLength > UINT16_MAX) {
+        printf("Error: ROM name too long: %s\n", name);
+        return 1;
+    }
+    uint64_t nameHash = hashROM(name, nameLength);
+    bool taken = false;
+    for (uint32_t slot = (uint32_t) nameHash & mask; builder -> nameTable[slot] != 0; slot = (slot + 1) & mask) {
+        const ArchiveEntry *other = &(builder -> entries[LE32(builder -> nameTable[slot]) - 1]);
+        if (LE16(other -> nameLength) == nameLength && memcmp(builder -> names + LE32(other -> nameOffset), name, nameLength) == 0) {
+            taken = true;
+            break;
+        }
+    }
+    if (taken) {
+        printf("Warning: %s has the same name as an earlier ROM, and can only be found by hash\n", path);
+    }
+    else {
+        insertSlot(builder -> nameTable, builder -> slots, nameHash, index);
+    }
+
+    ArchiveEntry *entry = &(builder -> entries[index]);
+    entry -> hash = LE64(hash);
+    entry -> nameHash = LE64(nameHash);
+    entry -> offset = LE32(offset);
+    entry -> nameOffset = LE32((uint32_t) builder -> namesSize);
+    entry -> size = LE16(size);
+    entry -> nameLength = LE16((uint16_t) nameLength);
+    builder -> names = realloc(builder -> names, builder -> namesSize + nameLength);
+    memcpy(builder -> names + builder -> namesSize, name, nameLength);
+    builder -> namesSize += nameLength;
+    builder -> count++;
+    return 0;
+}
+
+//Lays the archive out and writes it; entries and tables are 4-byte aligned after the 32-byte header,
+//so they can be read in place from the mapping
+static int writeArchiveBuilder(ArchiveBuilder *builder, char *filename) {
+    uint64_t entriesOffset = sizeof(ArchiveHeader);
+    uint64_t hashTableOffset = entriesOffset + (uint64_t) builder -> count * sizeof(ArchiveEntry);
+    uint64_t nameTableOffset = hashTableOffset + (uint64_t) builder -> slots * sizeof(uint32_t);
+    uint64_t namesOffset = nameTableOffset + (uint64_t) builder -> slots * sizeof(uint32_t);
+    uint64_t dataOffset = namesOffset + builder -> namesSize;
+    uint64_t size = dataOffset + builder -> dataSize;
+    if (size > UINT32_MAX) {
+        printf("Error: Archive would be larger than 4GB.\n");
+        return 1;
+    }
+
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, 4);
+    header.version = LE16(ARCHIVE_VERSION);
+    header.headerSize = LE16(sizeof(ArchiveHeader));
+    header.count = LE32(builder -> count);
+    header.slots = LE32(builder -> slots);
+    header.entriesOffset = LE32((uint32_t) entriesOffset);
+    header.hashTableOffset = LE32((uint32_t) hashTableOffset);
+    header.nameTableOffset = LE32((uint32_t) nameTableOffset);
+    header.size = LE32((uint32_t) size);
+    for (uint32_t i = 0; i < builder -> count; i++) {
+        ArchiveEntry *entry = &(builder -> entries[i]);
+        entry -> offset = LE32(LE32(entry -> offset) + (uint32_t) dataOffset);
+        entry -> nameOffset = LE32(LE32(entry -> nameOffset) + (uint32_t) namesOffset);
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(builder -> entries, sizeof(ArchiveEntry), builder -> count, f);
+    fwrite(builder -> hashTable, sizeof(uint32_t), builder -> slots, f);
+    fwrite(builder -> nameTable, sizeof(uint32_t), builder -> slots, f);
+    fwrite(builder -> names, 1, builder -> namesSize, f);
+    fwrite(builder -> data, 1, builder -> dataSize, f);
+    int ok = !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+        printf("Error: Couldn't write archive to %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+int writeArchive(char *filename, char **roms, int count) {
+    //Tables at most half full keep probes short, and always leave an empty slot to end a search for a missing key
+    ArchiveBuilder builder = {0};
+    builder.slots = 2;
+    while (builder.slots < 2 * (uint32_t) count) {
+        builder.slots *= 2;
+    }
+    builder.entries = calloc(count ? count : 1, sizeof(ArchiveEntry));
+    builder.hashTable = calloc(builder.slots, sizeof(uint32_t));
+    builder.nameTable = calloc(builder.slots, sizeof(uint32_t));
+
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        result = addArchiveROM(&builder, roms[i]);
+    }
+    if (result == 0) {
+        result = writeArchiveBuilder(&builder, filename);
+    }
+
+    free(builder.entries);
+    free(builder.hashTable);
+    free(builder.nameTable);
+    free(builder.names);
+    free(builder.data);
+    return result;
+}
+
+//Checks everything the lookups rely on once, so they can index the file without bounds checks
+static int validArchive(const ROMArchive *archive) {
+    const ArchiveHeader *header = archive -> header;
+    if (archive -> size < sizeof(ArchiveHeader) || memcmp(header -> magic, ARCHIVE_MAGIC, 4) != 0
+        || LE16(header -> version) != ARCHIVE_VERSION || LE16(header -> headerSize) != sizeof(ArchiveHeader)
+        || LE32(header -> size) != archive -> size) {
+        return 0;
+    }
+
+    uint64_t count = LE32(header -> count);
+    uint64_t slots = LE32(header -> slots);
+    uint64_t entriesOffset = LE32(header -> entriesOffset);
+    uint64_t hashTableOffset = LE32(header -> hashTableOffset);
+    uint64_t nameTableOffset = LE32(header -> nameTableOffset);
+    if (slots == 0 || (slots & (slots - 1)) != 0 || slots < count
+        || entriesOffset % 4 != 0 || hashTableOffset % 4 != 0 || nameTableOffset % 4 != 0
+        || entriesOffset + count * sizeof(ArchiveEntry) > archive -> size
+        || hashTableOffset + slots * sizeof(uint32_t) > archive -> size
+        || nameTableOffset + slots * sizeof(uint32_t) > archive -> size) {
+        return 0;
+    }
+
+    const ArchiveEntry *entries = (const ArchiveEntry *) (archive -> data + entriesOffset);
+    for (uint64_t i = 0; i < count; i++) {
+        if (LE16(entries[i].size) > MAX_ROM_SIZE
+            || (uint64_t) LE32(entries[i].offset) + LE16(entries[i].size) > archive -> size
+            || (uint64_t) LE32(entries[i].nameOffset) + LE16(entries[i].nameLength) > archive -> size) {
+            return 0;
+        }
+    }
+
+    //A full table would make a probe for a missing key loop forever, and a slot past count would index past the entries
+    const uint32_t *tables[2] = {(const uint32_t *) (archive -> data + hashTableOffset), (const uint32_t *) (archive -> data + nameTableOffset)};
+    for (int t = 0; t < 2; t++) {
+        uint64_t used = 0;
+        for (uint64_t slot = 0; slot < slots; slot++) {
+            uint32_t index = LE32(tables[t][slot]);
+            if (index > count) {
+                return 0;
+            }
+            used += index != 0;
+        }
+        if (used == slots) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+ROMArchive* openArchive(char *filename) {
+    ROMArchive *archive = calloc(1, sizeof(ROMArchive));
+
+#ifdef ARCHIVE_MMAP
+    //Map the whole file once; ROMs are then copied straight out of the page cache
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Couldn't open %s\n", filename);
+        free(archive);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(ArchiveHeader)) {
+        printf("Error: %s isn't a ROM archive.\n", filename);
+        close(fd);
+        free(archive);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Error: Couldn't map %s\n", filename);
+        free(archive);
+        return NULL;
+    }
+    archive -> data = data;
+    archive -> size = st.st_size;
+    archive -> mapped = 1;
+#else
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        free(archive);
+        return NULL;
+    }
+
+    ArchiveHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        printf("Error: %s isn't a ROM archive.\n", filename);
+        fclose(f);
+        free(archive);
+        return NULL;
+    }
+
+    //The header says how big the file is, so it can be read in one go
+    size_t size = LE32(header.size) > sizeof(header) ? LE32(header.size) : sizeof(header);
+    uint8_t *data = malloc(size);
+    memcpy(data, &header, sizeof(header));
+    size = sizeof(header) + fread(data + sizeof(header), 1, size - sizeof(header), f);
+    fclose(f);
+    archive -> data = data;
+    archive -> size = size;
+#endif
+
+    archive -> header = (const ArchiveHeader *) archive -> data;
+    if (!validArchive(archive)) {
+        printf("Error: %s isn't a ROM archive.\n", filename);
+        closeArchive(archive);
+        return NULL;
+    }
+    archive -> entries = (const ArchiveEntry *) (archive -> data + LE32(archive -> header -> entriesOffset));
+    archive -> hashTable = (const uint32_t *) (archive -> data + LE32(archive -> header -> hashTableOffset));
+    archive -> nameTable = (const uint32_t *) (archive -> data + LE32(archive -> header -> nameTableOffset));
+    return archive;
+}
+
+void closeArchive(ROMArchive *archive) {
+    if (archive == NULL) {
+        return;
+    }
+#ifdef ARCHIVE_MMAP
+    if (archive -> mapped) {
+        munmap((void *) archive -> data, archive -> size);
+    }
+#else
+    free((void *) archive -> data);
+#endif
+    free(archive);
+}
+
+const ArchiveEntry* findArchiveHash(const ROMArchive *archive, uint64_t hash) {
+    uint32_t mask = LE32(archive -> header -> slots) - 1;
+    for (uint32_t slot = (uint32_t) hash & mask; archive -> hashTable[slot] != 0; slot = (slot + 1) & mask) {
+        const ArchiveEntry *entry = &(archive -> entries[LE32(archive -> hashTable[slot]) - 1]);
+        if (LE64(entry -> hash) == hash) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const ArchiveEntry* findArchiveName(const ROMArchive *archive, const char *name) {
+    size_t length = strlen(name);
+    uint64_t hash = hashROM(name, length);
+    uint32_t mask = LE32(archive -> header -> slots) - 1;
+    for (uint32_t slot = (uint32_t) hash & mask; archive -> nameTable[slot] != 0; slot = (slot + 1) & mask) {
+        const ArchiveEntry *entry = &(archive -> entries[LE32(archive -> nameTable[slot]) - 1]);
+        if (LE64(entry -> nameHash) == hash && LE16(entry -> nameLength) == length
+            && memcmp(archiveROMName(archive, entry), name, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const ArchiveEntry* findArchiveROM(const ROMArchive *archive, const char *key) {
+    const ArchiveEntry *entry = findArchiveName(archive, key);
+    if (entry == NULL && strlen(key) == 16 && strspn(key, "0123456789abcdefABCDEF") == 16) {
+        entry = findArchiveHash(archive, strtoull(key, NULL, 16));
+    }
+    return entry;
+}
+
+const uint8_t* archiveROMData(const ROMArchive *archive, const ArchiveEntry *entry) {
+    return archive -> data + LE32(entry -> offset);
+}
+
+const char* archiveROMName(const ROMArchive *archive, const ArchiveEntry *entry) {
+    return (const char *) (archive -> data + LE32(entry -> nameOffset));
+}
+
+int openArchiveROM(CHIP8State *state, const ROMArchive *archive, const ArchiveEntry *entry) {
+    uint16_t size = LE16(entry -> size);
+    memcpy(&(state -> memory[ROM_BASE]), archiveROMData(archive, entry), size);
+
+    //Memory no longer matches whatever ROM the last reset loaded
+    state -> rom = NULL;
+    invalidateCHIP8(state, ROM_BASE, size);
+
+    return 0;
+}
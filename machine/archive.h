@@ -0,0 +1,71 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include "../CHIP8emu.h"
+#include "savestate.h"         //For the little-endian conversions
+
+//A ROM archive packs many ROMs into one little-endian file, indexed by a hash of their contents and of their names:
+//a 32-byte header, the entries, two open-addressed tables of entry numbers (by content hash, then by name hash),
+//the names, then the ROM data, with ROMs that have identical contents stored once
+//Opening maps the whole file, so finding a ROM is a hash probe and loading it is one copy out of the page cache
+#define ARCHIVE_MAGIC "C8RA"
+#define ARCHIVE_VERSION 1
+
+typedef struct __attribute__((packed)) ArchiveHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t count;             //Entries
+    uint32_t slots;             //In each table, a power of two at least twice count
+    uint32_t entriesOffset;
+    uint32_t hashTableOffset;
+    uint32_t nameTableOffset;
+    uint32_t size;              //Of the whole file
+} ArchiveHeader;
+
+typedef struct __attribute__((packed)) ArchiveEntry {
+    uint64_t hash;              //hashROM of the contents
+    uint64_t nameHash;          //hashROM of the name
+    uint32_t offset;            //Of the contents, from the start of the file
+    uint32_t nameOffset;
+    uint16_t size;
+    uint16_t nameLength;
+    uint32_t spare;
+} ArchiveEntry;
+
+typedef struct ROMArchive {
+    const uint8_t *data;
+    size_t size;
+    int mapped;                 //Whether data is a mapping rather than a heap copy
+    const ArchiveHeader *header;
+    const ArchiveEntry *entries;
+    const uint32_t *hashTable;  //Entry number + 1, or 0 for an empty slot
+    const uint32_t *nameTable;
+} ROMArchive;
+
+//FNV-1a over bytes, used for both ROM contents and names
+uint64_t hashROM(const void *data, size_t size);
+
+//writeArchive packs count ROMs read from files, named by their file names without directories; returns 0 on success
+int writeArchive(char *filename, char **roms, int count);
+
+//openArchive returns NULL, having said why, if the file isn't an archive this version understands
+ROMArchive* openArchive(char *filename);
+void closeArchive(ROMArchive *archive);
+
+//Return NULL if no ROM has that content hash or name
+const ArchiveEntry* findArchiveHash(const ROMArchive *archive, uint64_t hash);
+const ArchiveEntry* findArchiveName(const ROMArchive *archive, const char *name);
+
+//Finds a ROM by name, or by its content hash written as 16 hex digits
+const ArchiveEntry* findArchiveROM(const ROMArchive *archive, const char *key);
+
+//ROM contents and name inside the mapping; the name isn't terminated, see nameLength
+const uint8_t* archiveROMData(const ROMArchive *archive, const ArchiveEntry *entry);
+const char* archiveROMName(const ROMArchive *archive, const ArchiveEntry *entry);
+
+//Copies a ROM from the mapping straight into memory at 0x200, like openROM does from a file
+int openArchiveROM(CHIP8State *state, const ROMArchive *archive, const ArchiveEntry *entry);
+
+#endif
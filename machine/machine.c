@@ -3,39 +3,44 @@
 #include <stdbool.h>
 #include "machine.h"
 
-int openROM(CHIP8State *state, char *filename) {
+//Reads a ROM file into buffer, which must have room for MAX_ROM_SIZE bytes, and stores its length in size
+int readROM(char *filename, uint8_t *buffer, uint16_t *size) {
     FILE *f = fopen(filename, "rb");
     if (f == NULL) {
         printf("Error: Couldn't open %s\n", filename);
         return 1;
     }
 
-    //Get file size
-    fseek(f, 0L, SEEK_END);
-    int fsize = ftell(f);
-    fseek(f, 0L, SEEK_SET);
-
     //CHIP-8 convention puts programs into memory at 0x200, with hardcoded addresses expecting this
-    //Therefore programs can't be larger than the 4KB of memory minus 512 bytes 
-    if (fsize > (4096 - 0x200)) {
-        printf("Error: File size is greater than available memory space (4096 - 0x200 = 3584 bytes).\n");
+    //Therefore programs can't be larger than the 4KB of memory minus 512 bytes
+    //Read up to that straight into the buffer, and only then check there's nothing left, rather than seeking for the size
+    size_t fsize = fread(buffer, 1, MAX_ROM_SIZE, f);
+    if (ferror(f)) {
+        printf("Error: Couldn't read %s\n", filename);
         fclose(f);
         return 1;
     }
-
-    //Read file into memory buffer and close it
-    uint8_t *buffer = malloc(fsize);
-    if (buffer == NULL) {
-        printf("Error: Unable to allocate memory for file %s.\n", filename);
+    if (fsize == MAX_ROM_SIZE && fgetc(f) != EOF) {
+        printf("Error: File size is greater than available memory space (4096 - 0x200 = 3584 bytes).\n");
         fclose(f);
         return 1;
     }
-    fread(buffer, fsize, 1, f);
     fclose(f);
-    
-    //Copy buffer into memory at 0x200, then free it as it's no longer needed
-    memcpy(&(state -> memory[0x200]), buffer, fsize);
-    free(buffer);
+
+    *size = (uint16_t) fsize;
+    return 0;
+}
+
+int openROM(CHIP8State *state, char *filename) {
+    //Read the file straight into memory at 0x200
+    uint16_t size;
+    if (readROM(filename, &(state -> memory[ROM_BASE]), &size) != 0) {
+        return 1;
+    }
+
+    //Memory no longer matches whatever ROM the last reset loaded
+    state -> rom = NULL;
+    invalidateCHIP8(state, ROM_BASE, size);
 
     return 0;
 }
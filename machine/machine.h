@@ -2,6 +2,7 @@
 #include <time.h>
 #include "../CHIP8emu.h"
 
+int readROM(char *filename, uint8_t *buffer, uint16_t *size);
 int openROM(CHIP8State *state, char *filename);
 
 void keyDown(CHIP8State *state, uint8_t key);
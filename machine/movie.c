@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "movie.h"
+#include "machine.h"
+#include "savestate.h"
+
+#define MOVIE_MAGIC "C8MV"
+
+//File layout: this header, then count events; every field is little-endian
+typedef struct __attribute__((packed)) MovieHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t ips;
+    uint32_t seed;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t startHash;
+    uint64_t endCycles;
+    uint64_t endHash;
+} MovieHeader;
+
+typedef struct __attribute__((packed)) MovieRecord {
+    uint64_t cycles;
+    uint8_t key;
+    uint8_t down;
+    uint8_t padding[6];
+} MovieRecord;
+
+_Static_assert(sizeof(MovieHeader) == 48, "movie header layout changed size");
+_Static_assert(sizeof(MovieRecord) == 16, "movie event layout changed size");
+
+Movie* startMovie(const CHIP8State *state, uint32_t seed) {
+    Movie *movie = calloc(1, sizeof(Movie));
+    if (movie == NULL) {
+        printf("Error: Unable to allocate a movie.\n");
+        return NULL;
+    }
+    movie -> ips = state -> ips;
+    movie -> seed = seed;
+    movie -> startHash = hashCHIP8(state);
+    memcpy(movie -> keys, state -> keyState, 16);
+    return movie;
+}
+
+//Returns non-zero, leaving the events recorded so far as they were, if there's no room for another
+static int addEvent(Movie *movie, uint64_t cycles, uint8_t key, uint8_t down) {
+    if (movie -> count == movie -> capacity) {
+        uint32_t capacity = movie -> capacity ? movie -> capacity * 2 : 256;
+        MovieEvent *events = (capacity > movie -> capacity) ? realloc(movie -> events, (size_t) capacity * sizeof(MovieEvent)) : NULL;
+        if (events == NULL) {
+            printf("Error: Unable to allocate room for %u movie events.\n", movie -> count + 1);
+            return 1;
+        }
+        movie -> events = events;
+        movie -> capacity = capacity;
+    }
+    MovieEvent *event = &(movie -> events[movie -> count++]);
+    event -> cycles = cycles;
+    event -> key = key;
+    event -> down = down;
+    return 0;
+}
+
+int captureMovie(Movie *movie, const CHIP8State *state) {
+    //A press and release between two captures never reached the machine, so comparing states loses nothing
+    for (int i = 0; i < 16; i++) {
+        if (state -> keyState[i] != movie -> keys[i]) {
+            if (addEvent(movie, state -> cycles, i, state -> keyState[i]) != 0) {
+                return 1;
+            }
+            movie -> keys[i] = state -> keyState[i];
+        }
+    }
+    return 0;
+}
+
+int finishMovie(Movie *movie, const CHIP8State *state, char *filename) {
+    //A movie missing a key change would replay differently, so it isn't worth writing
+    if (captureMovie(movie, state) != 0) {
+        printf("Error: Movie is missing key changes, so it wasn't written to %s\n", filename);
+        return 1;
+    }
+    movie -> endCycles = state -> cycles;
+    movie -> endHash = hashCHIP8(state);
+
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return 1;
+    }
+
+    MovieHeader header;
+    memcpy(header.magic, MOVIE_MAGIC, 4);
+    header.version = LE16(MOVIE_VERSION);
+    header.headerSize = LE16(sizeof(MovieHeader));
+    header.ips = LE32(movie -> ips);
+    header.seed = LE32(movie -> seed);
+    header.count = LE32(movie -> count);
+    header.reserved = 0;
+    header.startHash = LE64(movie -> startHash);
+    header.endCycles = LE64(movie -> endCycles);
+    header.endHash = LE64(movie -> endHash);
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    for (uint32_t i = 0; i < movie -> count && ok; i++) {
+        MovieRecord record = {0};
+        record.cycles = LE64(movie -> events[i].cycles);
+        record.key = movie -> events[i].key;
+        record.down = movie -> events[i].down;
+        ok = fwrite(&record, sizeof(record), 1, f) == 1;
+    }
+    fclose(f);
+
+    if (!ok) {
+        printf("Error: Couldn't write movie to %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+Movie* loadMovie(char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return NULL;
+    }
+
+    MovieHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, MOVIE_MAGIC, 4) != 0) {
+        printf("Error: Not a CHIP-8 movie.\n");
+        fclose(f);
+        return NULL;
+    }
+    if (LE16(header.version) != MOVIE_VERSION || LE16(header.headerSize) != sizeof(MovieHeader)) {
+        printf("Error: Movie version %d isn't supported (expected %d).\n", LE16(header.version), MOVIE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+
+    Movie *movie = calloc(1, sizeof(Movie));
+    if (movie == NULL) {
+        printf("Error: Unable to allocate a movie.\n");
+        fclose(f);
+        return NULL;
+    }
+    movie -> ips = LE32(header.ips);
+    movie -> seed = LE32(header.seed);
+    movie -> startHash = LE64(header.startHash);
+    movie -> endCycles = LE64(header.endCycles);
+    movie -> endHash = LE64(header.endHash);
+
+    uint32_t count = LE32(header.count);
+    for (uint32_t i = 0; i < count; i++) {
+        MovieRecord record;
+        if (fread(&record, sizeof(record), 1, f) != 1 || record.key > 0xf) {
+            printf("Error: Movie %s is truncated or damaged.\n", filename);
+            fclose(f);
+            freeMovie(movie);
+            return NULL;
+        }
+        if (addEvent(movie, LE64(record.cycles), record.key, record.down != 0) != 0) {
+            fclose(f);
+            freeMovie(movie);
+            return NULL;
+        }
+    }
+    fclose(f);
+
+    return movie;
+}
+
+void freeMovie(Movie *movie) {
+    if (movie == NULL) {
+        return;
+    }
+    free(movie -> events);
+    free(movie);
+}
+
+int replayMovie(Movie *movie, CHIP8State *state) {
+    setSpeedCHIP8(state, movie -> ips);
+    seedCHIP8(state, movie -> seed);
+    if (hashCHIP8(state) != movie -> startHash) {
+        printf("Error: Movie was recorded with a different ROM.\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < movie -> count; i++) {
+        MovieEvent *event = &(movie -> events[i]);
+        if (event -> cycles > state -> cycles) {
+            runCHIP8(state, event -> cycles - state -> cycles);
+        }
+
+        //A machine that halted sooner than it did when recording has already diverged
+        if (state -> cycles != event -> cycles) {
+            break;
+        }
+
+        if (event -> down) {
+            keyDown(state, event -> key);
+        }
+        else {
+            keyUp(state, event -> key);
+        }
+    }
+    if (state -> cycles < movie -> endCycles) {
+        runCHIP8(state, movie -> endCycles - state -> cycles);
+    }
+
+    return (state -> cycles == movie -> endCycles && hashCHIP8(state) == movie -> endHash) ? 0 : 1;
+}
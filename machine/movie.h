@@ -0,0 +1,46 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "../CHIP8emu.h"
+
+//Movies record every key press and release from power-on, stamped with the instruction count it took effect at,
+//along with the speed and the seed of the machine's random number generator
+//Replaying feeds the same keys in at the same instruction counts and checks the machine ends in the same state
+//Version 2 hashes FX0A's saved key state too, so version 1 movies' hashes no longer match any machine
+#define MOVIE_VERSION 2
+
+typedef struct MovieEvent {
+    uint64_t cycles;
+    uint8_t key;
+    uint8_t down;
+} MovieEvent;
+
+typedef struct Movie {
+    uint32_t ips;
+    uint32_t seed;
+    uint64_t startHash;         //hashCHIP8 at power-on, which identifies the ROM
+    uint64_t endCycles;
+    uint64_t endHash;
+
+    MovieEvent *events;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t keys[16];           //Keys held at the last capture, so only changes are recorded
+} Movie;
+
+//startMovie begins recording a machine at power-on; captureMovie records any key changes since the last capture,
+//and must be called before the machine runs again whenever keys may have changed
+//Both print an error if they run out of memory: startMovie then returns NULL, and captureMovie returns non-zero,
+//after which the movie can't be finished
+Movie* startMovie(const CHIP8State *state, uint32_t seed);
+int captureMovie(Movie *movie, const CHIP8State *state);
+int finishMovie(Movie *movie, const CHIP8State *state, char *filename);
+
+Movie* loadMovie(char *filename);
+void freeMovie(Movie *movie);
+
+//Runs a machine fresh from power-on with the movie's ROM through the movie as fast as the core allows
+//Returns 0 if it ends in the recorded state
+int replayMovie(Movie *movie, CHIP8State *state);
+
+#endif
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "pool.h"
+#include "machine.h"
+
+CHIP8Pool* initPool(int capacity) {
+    if (capacity < 1) {
+        return NULL;
+    }
+
+    CHIP8Pool *pool = calloc(1, sizeof(CHIP8Pool));
+    if (pool == NULL) {
+        printf("Error: Unable to allocate a pool of %d machines.\n", capacity);
+        return NULL;
+    }
+    pool -> capacity = capacity;
+    pool -> freeList = calloc(capacity, sizeof(int));
+#ifdef _WIN32
+    pool -> states = _aligned_malloc((size_t) capacity * sizeof(CHIP8State), _Alignof(CHIP8State));
+#else
+    pool -> states = aligned_alloc(_Alignof(CHIP8State), (size_t) capacity * sizeof(CHIP8State));
+#endif
+    if (pool -> states == NULL || pool -> freeList == NULL) {
+        printf("Error: Unable to allocate a pool of %d machines.\n", capacity);
+        freePool(pool);
+        return NULL;
+    }
+
+    //Lowest indices are handed out first
+    for (int i = 0; i < capacity; i++) {
+        setupCHIP8(&(pool -> states[i]));
+        pool -> freeList[i] = capacity - 1 - i;
+    }
+    pool -> freeCount = capacity;
+
+    return pool;
+}
+
+void freePool(CHIP8Pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+#ifdef _WIN32
+    _aligned_free(pool -> states);
+#else
+    free(pool -> states);
+#endif
+    free(pool -> freeList);
+    free(pool);
+}
+
+int loadPoolROM(CHIP8Pool *pool, char *filename) {
+    if (readROM(filename, pool -> rom, &(pool -> romSize)) != 0) {
+        return 1;
+    }
+
+    //The buffer is the same but its contents aren't, so the next reset of each machine has to reload everything
+    for (int i = 0; i < pool -> capacity; i++) {
+        pool -> states[i].rom = NULL;
+    }
+    return 0;
+}
+
+//Returns a machine at power-on with the pool's ROM loaded, or NULL if every machine is in use
+//A machine that ran this ROM before only has the memory it wrote restored
+CHIP8State* acquirePool(CHIP8Pool *pool) {
+    if (pool -> freeCount == 0) {
+        return NULL;
+    }
+
+    CHIP8State *state = &(pool -> states[pool -> freeList[--pool -> freeCount]]);
+    resetCHIP8(state, pool -> rom, pool -> romSize);
+    return state;
+}
+
+//Any JIT attached to the machine must be freed first
+void releasePool(CHIP8Pool *pool, CHIP8State *state) {
+    pool -> freeList[pool -> freeCount++] = state - pool -> states;
+}
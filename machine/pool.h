@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "../CHIP8emu.h"
+
+//Fixed set of machines in one aligned allocation, all running the pool's ROM
+//Acquiring resets a machine in place rather than allocating, so creating and discarding machines never touches malloc
+//Not thread-safe: give each thread its own pool, or acquire everything up front
+typedef struct CHIP8Pool {
+    CHIP8State *states;
+    int capacity;
+    int *freeList;              //Indices of machines not in use, acquired from the end
+    int freeCount;
+    uint8_t rom[MAX_ROM_SIZE];
+    uint16_t romSize;
+} CHIP8Pool;
+
+//initPool returns NULL if capacity is below 1, and prints an error and returns NULL if the machines can't be allocated
+CHIP8Pool* initPool(int capacity);
+void freePool(CHIP8Pool *pool);
+int loadPoolROM(CHIP8Pool *pool, char *filename);
+CHIP8State* acquirePool(CHIP8Pool *pool);
+void releasePool(CHIP8Pool *pool, CHIP8State *state);
+
+#endif
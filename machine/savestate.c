@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "savestate.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define SAVE_STATE_MMAP 1
+#endif
+
+#define SAVE_STATE_MAGIC "C8SV"
+
+//The file image, field for field; everything after the header sits at the same offset in every version so far
+//Multi-byte fields are little-endian, so on little-endian hosts loading is a straight copy out of the mapping
+typedef struct __attribute__((packed)) SaveImage {
+    char magic[4];
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t size;
+    uint32_t flags;             //Always 0 so far
+
+    uint16_t pc;
+    uint16_t sp;
+    uint16_t I;
+    uint16_t faultAddress;
+    uint8_t V[16];
+    uint8_t keyState[16];
+    uint8_t savedKeyState[16];
+    uint8_t delay;
+    uint8_t sound;
+    uint8_t halt;
+    uint8_t fault;
+    uint8_t keyWait;
+    uint8_t padding[3];
+    uint32_t ips;
+    uint32_t rng;               //Reserved and 0 in version 1
+    uint64_t cycles;
+    uint64_t timerBase;
+    uint64_t timerTicks;
+    uint64_t nextTimerCycle;
+    uint32_t seed;              //Reserved and 0 in version 1
+    uint8_t spare[4];
+
+    uint8_t memory[4096];
+    uint64_t screen[32];
+} SaveImage;
+
+_Static_assert(sizeof(SaveImage) == SAVE_STATE_SIZE, "save state layout changed size");
+_Static_assert(offsetof(SaveImage, pc) == 16, "registers must follow the 16-byte header");
+_Static_assert(offsetof(SaveImage, memory) == 128, "memory must start at a fixed offset");
+_Static_assert(offsetof(SaveImage, screen) % 8 == 0, "screen rows must stay 8-byte aligned");
+
+void writeState(const CHIP8State *state, void *buffer) {
+    SaveImage *image = buffer;
+
+    memcpy(image -> magic, SAVE_STATE_MAGIC, 4);
+    image -> version = LE16(SAVE_STATE_VERSION);
+    image -> headerSize = LE16(offsetof(SaveImage, pc));
+    image -> size = LE32(SAVE_STATE_SIZE);
+    image -> flags = 0;
+
+    image -> pc = LE16(state -> pc);
+    image -> sp = LE16(state -> sp);
+    image -> I = LE16(state -> I);
+    image -> faultAddress = LE16(state -> faultAddress);
+    memcpy(image -> V, state -> V, 16);
+    memcpy(image -> keyState, state -> keyState, 16);
+    memcpy(image -> savedKeyState, state -> savedKeyState, 16);
+    image -> delay = state -> delay;
+    image -> sound = state -> sound;
+    image -> halt = state -> halt;
+    image -> fault = state -> fault;
+    image -> keyWait = state -> keyWait;
+    memset(image -> padding, 0, sizeof(image -> padding));
+    image -> ips = LE32(state -> ips);
+    image -> rng = LE32(state -> rng);
+    image -> cycles = LE64(state -> cycles);
+    image -> timerBase = LE64(state -> timerBase);
+    image -> timerTicks = LE64(state -> timerTicks);
+    image -> nextTimerCycle = LE64(state -> nextTimerCycle);
+    image -> seed = LE32(state -> seed);
+    memset(image -> spare, 0, sizeof(image -> spare));
+
+    memcpy(image -> memory, state -> memory, 4096);
+    for (int i = 0; i < 32; i++) {
+        image -> screen[i] = LE64(state -> screen[i]);
+    }
+}
+
+int readState(CHIP8State *state, const void *buffer, size_t size) {
+    const SaveImage *image = buffer;
+
+    if (size < SAVE_STATE_SIZE || memcmp(image -> magic, SAVE_STATE_MAGIC, 4) != 0) {
+        printf("Error: Not a CHIP-8 save state.\n");
+        return 1;
+    }
+    int version = LE16(image -> version);
+    if (version < SAVE_STATE_OLDEST_VERSION || version > SAVE_STATE_VERSION || LE32(image -> size) != SAVE_STATE_SIZE) {
+        printf("Error: Save state version %d isn't supported (expected %d to %d).\n", version, SAVE_STATE_OLDEST_VERSION,
+            SAVE_STATE_VERSION);
+        return 1;
+    }
+    if (LE16(image -> headerSize) != offsetof(SaveImage, pc)) {
+        printf("Error: Save state header is %d bytes (expected %d).\n", LE16(image -> headerSize), (int) offsetof(SaveImage, pc));
+        return 1;
+    }
+
+    //The timers run off ips and the next tick's cycle, so a state with no speed or a tick already behind the clock
+    //would spin tickTimers forever or hand runCHIP8 an underflowed batch; nothing is loaded unless the clock adds up
+    uint32_t ips = LE32(image -> ips);
+    uint64_t cycles = LE64(image -> cycles);
+    uint64_t timerBase = LE64(image -> timerBase);
+    uint64_t timerTicks = LE64(image -> timerTicks);
+    uint64_t nextTimerCycle = LE64(image -> nextTimerCycle);
+    if (ips == 0 || nextTimerCycle < cycles || timerBase > cycles
+        || nextTimerCycle != timerBase + ((timerTicks + 1) * ips) / TIMER_FREQUENCY) {
+        printf("Error: Save state has an inconsistent clock.\n");
+        return 1;
+    }
+
+    state -> pc = LE16(image -> pc);
+    state -> sp = LE16(image -> sp);
+    state -> I = LE16(image -> I);
+    state -> faultAddress = LE16(image -> faultAddress);
+    memcpy(state -> V, image -> V, 16);
+    memcpy(state -> keyState, image -> keyState, 16);
+    memcpy(state -> savedKeyState, image -> savedKeyState, 16);
+    state -> delay = image -> delay;
+    state -> sound = image -> sound;
+    state -> halt = image -> halt;
+    state -> fault = image -> fault;
+    state -> keyWait = image -> keyWait;
+    state -> ips = ips;
+    state -> cycles = cycles;
+    state -> timerBase = timerBase;
+    state -> timerTicks = timerTicks;
+    state -> nextTimerCycle = nextTimerCycle;
+    if (version >= 2) {
+        state -> rng = LE32(image -> rng);
+        state -> seed = LE32(image -> seed);
+    }
+
+    memcpy(state -> memory, image -> memory, 4096);
+    for (int i = 0; i < 32; i++) {
+        state -> screen[i] = LE64(image -> screen[i]);
+    }
+
+    //Every byte of memory may have changed, and the screen needs showing again
+    invalidateCHIP8(state, 0, 4096);
+    state -> displayFlag = 1;
+
+    return 0;
+}
+
+int saveState(const CHIP8State *state, char *filename) {
+    uint8_t buffer[SAVE_STATE_SIZE];
+    writeState(state, buffer);
+
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return 1;
+    }
+    if (fwrite(buffer, SAVE_STATE_SIZE, 1, f) != 1) {
+        printf("Error: Couldn't write save state to %s\n", filename);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    return 0;
+}
+
+int loadState(CHIP8State *state, char *filename) {
+#ifdef SAVE_STATE_MMAP
+    //Map the file and copy straight out of the page cache, with no intermediate read buffer
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Couldn't open %s\n", filename);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < SAVE_STATE_SIZE) {
+        printf("Error: Not a CHIP-8 save state.\n");
+        close(fd);
+        return 1;
+    }
+
+    void *image = mmap(NULL, SAVE_STATE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("Error: Couldn't map %s\n", filename);
+        return 1;
+    }
+
+    int result = readState(state, image, st.st_size);
+    munmap(image, SAVE_STATE_SIZE);
+    return result;
+#else
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return 1;
+    }
+
+    uint8_t buffer[SAVE_STATE_SIZE];
+    size_t size = fread(buffer, 1, SAVE_STATE_SIZE, f);
+    fclose(f);
+
+    return readState(state, buffer, size);
+#endif
+}
@@ -0,0 +1,32 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+#include "../CHIP8emu.h"
+
+//Save states are a fixed-size little-endian image: a 16-byte versioned header, the registers, stack pointer,
+//timers, keys, random number generator and clock at fixed offsets, then the 4KB of memory (which holds the stack) and the 32 screen rows
+//Version 2 added the random number generator; version 1 states still load and leave the machine's generator alone
+#define SAVE_STATE_VERSION 2
+#define SAVE_STATE_OLDEST_VERSION 1
+#define SAVE_STATE_SIZE 4480
+
+//Converts between host order and the little-endian order of files on disk, in either direction
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE16(x) __builtin_bswap16(x)
+#define LE32(x) __builtin_bswap32(x)
+#define LE64(x) __builtin_bswap64(x)
+#else
+#define LE16(x) (x)
+#define LE32(x) (x)
+#define LE64(x) (x)
+#endif
+
+//writeState fills SAVE_STATE_SIZE bytes of buffer; readState returns non-zero if buffer isn't a state it understands
+void writeState(const CHIP8State *state, void *buffer);
+int readState(CHIP8State *state, const void *buffer, size_t size);
+
+int saveState(const CHIP8State *state, char *filename);
+int loadState(CHIP8State *state, char *filename);
+
+#endif
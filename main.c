@@ -1,145 +1,531 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
 #include "display/display.h"
+#include "display/triplebuffer.h"
+#include "display/histogram.h"
+#include "audio/beeper.h"
+#include "machine/savestate.h"
+#include "rewind/rewind.h"
+#include "machine/movie.h"
+
+//Writes out the movie being recorded, if any; loading a state or rewinding ends a recording, as a movie can't jump
+static void stopRecording(Movie **movie, CHIP8State *machine, char *movieFile) {
+    if (*movie == NULL) {
+        return;
+    }
+    if (finishMovie(*movie, machine, movieFile) == 0) {
+        printf("Recorded %u key events over %llu instructions to %s\n", (*movie) -> count, (unsigned long long) machine -> cycles, movieFile);
+    }
+    freeMovie(*movie);
+    *movie = NULL;
+}
+
+//The core reports faults and infinite loops through its log hook rather than printing them itself
+static void printLog(void *data, const char *message) {
+    printf("%s\n", message);
+}
+
+//Bits of Emulator.requests, set by the main thread and handled by the emulation thread before its next frame
+#define REQUEST_SAVE 1
+#define REQUEST_LOAD 2
+
+//The machine runs on its own thread, so a slow present or a dragged window can't delay emulated time,
+//while SDL rendering and events stay on the main thread as SDL requires
+//The emulation thread owns the machine, the rewind history and the movie; the main thread only touches the fields
+//below them, and only through atomics, the triple buffer and the semaphore
+typedef struct Emulator {
+    CHIP8State *machine;
+    Rewind *history;
+    Movie *movie;
+    char *movieFile;
+    char *stateFile;
+    Beeper *beeper;             //NULL when running silent
+    uint64_t soundTicks;        //machine -> soundTicks when the beeper was last updated
+    uint32_t keySerial;         //keyChanges when the keys were last applied
+    bool resumed;               //Time passed without frames, so the next one published doesn't count towards pacing
+
+    TripleBuffer frames;        //Finished frames on their way to the main thread
+    _Atomic uint32_t keys;      //Bit n set while keypad key n is held
+    atomic_uint keyChanges;     //Counts changes to keys, so a frame can say which ones it saw
+    bool displayLocked;         //Frames run as each one is presented rather than by the timer; set before the thread starts
+    SDL_sem *presented;         //Posted by the main thread after each present while display-locked
+    atomic_int requests;
+    atomic_bool rewinding;
+    atomic_bool quit;
+    atomic_bool framePosted;    //A frame event is queued that the main thread hasn't handled yet
+    SDL_sem *wake;              //Posted whenever the emulation thread should act before its next frame is due
+    uint32_t frameEvent;
+} Emulator;
+
+//Sleeps for less than a millisecond, which SDL can't express
+static void sleepFraction(uint64_t ticks, uint64_t frequency) {
+#ifdef _WIN32
+    //Windows has no sub-millisecond sleep without a high resolution timer, so just give up the time slice
+    (void) ticks;
+    (void) frequency;
+    SDL_Delay(0);
+#else
+    struct timespec ts = {0, (long) (ticks * 1000000000ull / frequency)};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+//Blocks until the performance counter reaches deadline, and returns false if wake was posted first
+//Whole milliseconds are left to the semaphore, so requests still wake it; the last fraction of one is slept separately,
+//rather than truncating to a millisecond and waking early or rounding up and oversleeping
+static bool waitForFrame(SDL_sem *wake, uint64_t deadline) {
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t now = SDL_GetPerformanceCounter();
+    while (now < deadline) {
+        uint64_t ms = ((deadline - now) * 1000) / frequency;
+        if (ms > 0) {
+            if (SDL_SemWaitTimeout(wake, (uint32_t) ms) == 0) {
+                return false;
+            }
+        }
+        else {
+            sleepFraction(deadline - now, frequency);
+        }
+        now = SDL_GetPerformanceCounter();
+    }
+    return true;
+}
+
+//Takes every post the semaphore holds without blocking
+static void drainSemaphore(SDL_sem *sem) {
+    while (SDL_SemTryWait(sem) == 0) {
+    }
+}
+
+//Brings the machine's keypad in line with the keys the main thread says are held
+static void applyKeys(CHIP8State *machine, uint32_t keys) {
+    for (uint8_t key = 0; key < 16; key++) {
+        bool held = (keys >> key) & 1;
+        if (held && !(machine -> keyState[key])) {
+            keyDown(machine, key);
+        }
+        else if (!held && machine -> keyState[key]) {
+            keyUp(machine, key);
+        }
+    }
+}
+
+//Hands the screen to the main thread, and queues an event to wake it unless one is already waiting
+//paced says whether the emulation thread will wait for this frame's present, so the main thread only reports those
+static void publishFrame(Emulator *emulator, bool paced) {
+    CHIP8State *machine = emulator -> machine;
+    Frame *frame = backTripleBuffer(&(emulator -> frames));
+    memcpy(frame -> screen, machine -> screen, sizeof(machine -> screen));
+    frame -> keySerial = emulator -> keySerial;
+    frame -> resumed = emulator -> resumed;
+    frame -> paced = paced;
+    emulator -> resumed = false;
+    publishTripleBuffer(&(emulator -> frames));
+    machine -> displayFlag = 0;
+
+    if (!atomic_exchange(&(emulator -> framePosted), true)) {
+        SDL_Event e;
+        SDL_zero(e);
+        e.type = emulator -> frameEvent;
+        SDL_PushEvent(&e);
+    }
+}
+
+//Sounds the tone for any frame in which a timer tick found the sound timer running, while the machine is playing
+static void updateBeeper(Emulator *emulator, bool playing) {
+    if (emulator -> beeper == NULL) {
+        return;
+    }
+    setBeeper(emulator -> beeper, playing && emulator -> machine -> soundTicks != emulator -> soundTicks);
+    emulator -> soundTicks = emulator -> machine -> soundTicks;
+}
+
+static int runEmulator(void *data) {
+    Emulator *emulator = data;
+    CHIP8State *machine = emulator -> machine;
+
+    //Frames are due every 1/60 of a second, 1/60 = 16.667ms = 16667us
+    uint64_t ticksPerFrame = SDL_GetPerformanceFrequency() / SCREEN_FPS;
+    uint64_t nextFrame = SDL_GetPerformanceCounter();
+
+    while (true) {
+        //wake only says there is something to look at, and everything it could be for is read after this,
+        //so posts that piled up while the thread was busy are dropped rather than waking it again later for nothing
+        drainSemaphore(emulator -> wake);
+        if (atomic_load(&(emulator -> quit))) {
+            break;
+        }
+
+        int requests = atomic_exchange(&(emulator -> requests), 0);
+        if (requests & REQUEST_SAVE) {
+            if (saveState(machine, emulator -> stateFile) == 0) {
+                printf("Saved state to %s\n", emulator -> stateFile);
+            }
+        }
+        if (requests & REQUEST_LOAD) {
+            stopRecording(&(emulator -> movie), machine, emulator -> movieFile);
+            if (loadState(machine, emulator -> stateFile) == 0) {
+                printf("Loaded state from %s\n", emulator -> stateFile);
+            }
+        }
+        if (requests) {
+            emulator -> resumed = true;
+        }
+
+        //Frames are shown as they're run, but a state loaded into a halted machine still needs showing
+        if (machine -> displayFlag && (machine -> halt)) {
+            publishFrame(emulator, false);
+        }
+
+        //A halted machine has nothing left to run, so it sleeps until input changes that, such as F9 or Backspace
+        bool rewinding = atomic_load(&(emulator -> rewinding)) && emulator -> history != NULL;
+        if ((machine -> halt) && !rewinding) {
+            updateBeeper(emulator, false);
+            SDL_SemWait(emulator -> wake);
+            nextFrame = SDL_GetPerformanceCounter();
+            emulator -> resumed = true;
+
+            //The last frame before halting was presented long ago, so its post mustn't let the next frame start early
+            drainSemaphore(emulator -> presented);
+            continue;
+        }
+        if (emulator -> displayLocked) {
+            //Run the next frame as soon as the last one is on screen, so each refresh shows exactly one frame
+            //If the display stalls, the timer takes over half a frame late, so emulated time carries on at 60Hz
+            if (!waitForFrame(emulator -> presented, nextFrame + ticksPerFrame / 2)) {
+                nextFrame = SDL_GetPerformanceCounter();
+            }
+        }
+        else if (!waitForFrame(emulator -> wake, nextFrame)) {
+            continue;
+        }
+
+        //Each 60Hz frame runs IPS / 60 instructions in one batch, and the core ticks the timers by instruction count
+        //Wall-clock time only decides when the next frame is due, so it can't stretch or squeeze emulated time
+        //Acquire pairs with the main thread's release, so the keys read include every change up to the serial
+        emulator -> keySerial = atomic_load_explicit(&(emulator -> keyChanges), memory_order_acquire);
+        applyKeys(machine, atomic_load(&(emulator -> keys)));
+        if (rewinding) {
+            stopRecording(&(emulator -> movie), machine, emulator -> movieFile);
+
+            //Keep the keys being held now, rather than the ones held in the frame being restored
+            uint8_t keyState[16];
+            memcpy(keyState, machine -> keyState, 16);
+            stepBackRewind(emulator -> history, machine);
+            memcpy(machine -> keyState, keyState, 16);
+            updateBeeper(emulator, false);
+        }
+        else {
+            //A movie that lost a key change can't be replayed, so recording ends without writing it
+            if (emulator -> movie != NULL && captureMovie(emulator -> movie, machine) != 0) {
+                printf("Stopped recording; %s was not written.\n", emulator -> movieFile);
+                freeMovie(emulator -> movie);
+                emulator -> movie = NULL;
+            }
+            runFrameCHIP8(machine);
+            updateBeeper(emulator, true);
+
+            //The log hook has already said why; a fault ends the session, an infinite loop just stops the machine
+            if (machine -> fault) {
+                SDL_Event e;
+                SDL_zero(e);
+                e.type = SDL_QUIT;
+                SDL_PushEvent(&e);
+                return 1;
+            }
+
+            if (emulator -> history != NULL) {
+                pushRewind(emulator -> history, machine);
+            }
+        }
+        publishFrame(emulator, emulator -> displayLocked);
+
+        //After a long stall, such as the machine halting, carry on from now rather than racing to catch up
+        uint64_t now = SDL_GetPerformanceCounter();
+        nextFrame += ticksPerFrame;
+        if (now > nextFrame + ticksPerFrame) {
+            nextFrame = now + ticksPerFrame;
+        }
+    }
+    return 0;
+}
+
+//Keyboard keys for each keypad key, indexed by keypad key
+//Original CHIP-8 keypad was 123C, 456D, 789E, A0BF
+//Modern CHIP-8 emulators typically use 1234, QWER, ASDF, ZXCV to replace original keypad
+static const SDL_Keycode keypadKeys[16] = {
+    SDLK_x, SDLK_1, SDLK_2, SDLK_3,
+    SDLK_q, SDLK_w, SDLK_e, SDLK_a,
+    SDLK_s, SDLK_d, SDLK_z, SDLK_c,
+    SDLK_4, SDLK_r, SDLK_f, SDLK_v
+};
+
+//Returns the keypad key a keyboard key stands for, or -1
+static int keypadKey(SDL_Keycode sym) {
+    for (int key = 0; key < 16; key++) {
+        if (keypadKeys[key] == sym) {
+            return key;
+        }
+    }
+    return -1;
+}
+
+//Main thread only: how evenly frames reach the screen, and how long a keypad change takes to be shown
+typedef struct Pacing {
+    Histogram frameTime;        //Between consecutive presents
+    Histogram latency;          //From a keypad change to the present of the first frame that saw it
+    uint64_t lastPresent;
+    uint64_t inputTime;         //When the oldest keypad change not yet shown happened, or 0
+    uint32_t inputSerial;       //keyChanges after that change
+} Pacing;
+
+static uint64_t counterMicroseconds(uint64_t ticks) {
+    return ticks * 1000000 / SDL_GetPerformanceFrequency();
+}
+
+//Records a keypad change, unless an earlier one is still waiting to be shown
+static void pacingInput(Pacing *pacing, uint32_t serial) {
+    if (pacing -> inputTime == 0) {
+        pacing -> inputTime = SDL_GetPerformanceCounter();
+        pacing -> inputSerial = serial;
+    }
+}
+
+static void pacingPresent(Pacing *pacing, const Frame *frame) {
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (pacing -> lastPresent != 0 && !(frame -> resumed)) {
+        recordHistogram(&(pacing -> frameTime), counterMicroseconds(now - pacing -> lastPresent));
+    }
+    pacing -> lastPresent = now;
+
+    //Serials only grow, so any frame that saw this change or a later one shows it
+    if (pacing -> inputTime != 0 && (int32_t) (frame -> keySerial - pacing -> inputSerial) >= 0) {
+        recordHistogram(&(pacing -> latency), counterMicroseconds(now - pacing -> inputTime));
+        pacing -> inputTime = 0;
+    }
+}
+
+static void printPacing(Pacing *pacing) {
+    printHistogram(&(pacing -> frameTime));
+    printHistogram(&(pacing -> latency));
+}
+
+//Sets a request bit and wakes the emulation thread, in case it's asleep until the next frame or halted
+static void request(Emulator *emulator, int bits) {
+    atomic_fetch_or(&(emulator -> requests), bits);
+    SDL_SemPost(emulator -> wake);
+}
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        printf("Usage: emulator.exe <path-to-rom>\n");
+        printf("Usage: emulator.exe <path-to-rom> [--ips N] [--rewind SECONDS] [--rewind-kb N] [--record FILE] [--seed N] [--audio-samples N] [--audio-latency MS] [--mute] [--pacing vsync|timer]\n");
         return 0;
     }
 
+    char *filename = NULL;
+    uint32_t ips = DEFAULT_IPS;
+    int rewindSeconds = DEFAULT_REWIND_SECONDS;
+    size_t rewindBytes = DEFAULT_REWIND_BYTES;
+    char *movieFile = NULL;
+    uint32_t seed = (uint32_t) time(NULL);
+    int audioSamples = DEFAULT_AUDIO_SAMPLES;
+    int audioLatency = DEFAULT_AUDIO_LATENCY_MS;
+    bool mute = false;
+    bool vsync = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            ips = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            rewindSeconds = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rewind-kb") == 0 && i + 1 < argc) {
+            rewindBytes = strtoull(argv[++i], NULL, 10) * 1024;
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            movieFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--audio-samples") == 0 && i + 1 < argc) {
+            audioSamples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--audio-latency") == 0 && i + 1 < argc) {
+            audioLatency = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mute") == 0) {
+            mute = true;
+        }
+        else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+            vsync = strcmp(argv[++i], "timer") != 0;
+        }
+        else {
+            filename = argv[i];
+        }
+    }
+
     //Start the CHIP-8 interpreter machine and load the program
     CHIP8State *machine = initCHIP8();
-    char *filename = argv[1];
-    if (openROM(machine, filename) != 0) {
+    machine -> logHook = printLog;
+    printf("Initialised CHIP8State.\n");
+    if (filename == NULL || openROM(machine, filename) != 0) {
         return 1;
     }
+    setSpeedCHIP8(machine, ips);
+    seedCHIP8(machine, seed);
+
+    //A movie records every key change from power-on, so headless --replay can repeat the session exactly
+    Movie *movie = NULL;
+    if (movieFile != NULL) {
+        movie = startMovie(machine, seed);
+        if (movie == NULL) {
+            return 1;
+        }
+    }
 
-    //Set up timers for updating the display at 60Hz
-    uint64_t currentTick = SDL_GetPerformanceCounter();
-    uint64_t lastTick = 0;
-    double elapsedTicks = 0;
-    double delta = 0.0;
-    double timer = 0.0;
+    //F5 saves the machine next to the ROM and F9 loads it back
+    char *stateFile = malloc(strlen(filename) + 5);
+    sprintf(stateFile, "%s.sav", filename);
+
+    //Every frame is captured for rewinding, which Backspace does one frame at a time for as long as it's held
+    //If the history can't be allocated the emulator still runs, just without rewinding
+    Rewind *history = NULL;
+    if (rewindSeconds > 0) {
+        history = initRewind(rewindSeconds * SCREEN_FPS, rewindBytes, DEFAULT_REWIND_KEYFRAME);
+    }
 
     //Start up SDL and create a window
     Display *display = initDisplay();
 
-    if (!initSDL(display)) {
+    Emulator emulator = {.machine = machine, .history = history, .movie = movie, .movieFile = movieFile, .stateFile = stateFile};
+    initTripleBuffer(&(emulator.frames));
+    atomic_init(&(emulator.keys), 0);
+    atomic_init(&(emulator.requests), 0);
+    atomic_init(&(emulator.rewinding), false);
+    atomic_init(&(emulator.quit), false);
+    atomic_init(&(emulator.framePosted), false);
+    atomic_init(&(emulator.keyChanges), 0);
+    SDL_Thread *thread = NULL;
+
+    Pacing pacing = {0};
+    initHistogram(&(pacing.frameTime), "Frame time");
+    initHistogram(&(pacing.latency), "Input to present");
+
+    if (!initSDL(display, vsync)) {
         printf("Failed to initialise.\n");
     }
     else {
-        //Main loop flag
-        bool quit = false;
+        //The sound timer drives a beeper unless muted; without an audio device the emulator just runs silent
+        if (!mute) {
+            emulator.beeper = openBeeper(DEFAULT_AUDIO_RATE, audioSamples, audioLatency);
+        }
+
+        //With vsync on a 60Hz display, each present paces the next frame, so every refresh shows exactly one frame
+        //Anywhere else presents can't pace emulated time, so the timer does and vsync at most stops tearing
+        emulator.displayLocked = display -> vsync && display -> refreshRate >= SCREEN_FPS - 1 && display -> refreshRate <= SCREEN_FPS + 1;
+        if (emulator.displayLocked) {
+            printf("Pacing: vsync, one frame per refresh at %dHz\n", display -> refreshRate);
+        }
+        else if (display -> vsync) {
+            printf("Pacing: timer, with vsync on a %dHz display\n", display -> refreshRate);
+        }
+        else {
+            printf("Pacing: timer\n");
+        }
+
+        emulator.wake = SDL_CreateSemaphore(0);
+        emulator.presented = SDL_CreateSemaphore(0);
+        emulator.frameEvent = SDL_RegisterEvents(1);
+        if (emulator.frameEvent == (uint32_t) -1) {
+            emulator.frameEvent = SDL_USEREVENT;
+        }
+        if (emulator.wake != NULL && emulator.presented != NULL) {
+            thread = SDL_CreateThread(runEmulator, "emulator", &emulator);
+        }
+        if (thread == NULL) {
+            printf("Emulation thread could not be started. SDL Error: %s\n", SDL_GetError());
+            machine -> fault = 1;
+        }
+    }
 
+    if (thread != NULL) {
         //Event handler
         SDL_Event e;
 
-        //While the application is running
-        while (!quit) {
-            //Handle events in queue
-            while (SDL_PollEvent(&e) != 0) {
-                //User requests quit
+        //The main thread only handles input and draws frames, so it sleeps until there's one of those to do
+        bool quit = false;
+        while (!quit && SDL_WaitEvent(&e)) {
+            do {
+                //User requests quit, or the emulation thread stopped on a fault
                 if (e.type == SDL_QUIT) {
                     quit = true;
                 }
-
-                //Handle key presses and releases
-                //Original CHIP-8 keypad was 123C, 456D, 789E, A0BF
-                //Modern CHIP-8 emulators typically use 1234, QWER, ASDF, ZXCV to replace original keypad
-                if (e.type == SDL_KEYDOWN) {
-                    switch (e.key.keysym.sym) {
-                        case SDLK_1: keyDown(machine, 1); break;
-                        case SDLK_2: keyDown(machine, 2); break;
-                        case SDLK_3: keyDown(machine, 3); break;
-                        case SDLK_4: keyDown(machine, 0xc); break;
-
-                        case SDLK_q: keyDown(machine, 4); break;
-                        case SDLK_w: keyDown(machine, 5); break;
-                        case SDLK_e: keyDown(machine, 6); break;
-                        case SDLK_r: keyDown(machine, 0xd); break;
-                        
-                        case SDLK_a: keyDown(machine, 7); break;
-                        case SDLK_s: keyDown(machine, 8); break;
-                        case SDLK_d: keyDown(machine, 9); break;
-                        case SDLK_f: keyDown(machine, 0xe); break;
-
-                        case SDLK_z: keyDown(machine, 0xa); break;
-                        case SDLK_x: keyDown(machine, 0); break;
-                        case SDLK_c: keyDown(machine, 0xb); break;
-                        case SDLK_v: keyDown(machine, 0xf); break;
-                        case SDLK_ESCAPE: machine -> halt = 1; quit = true; break;
-
-                        default: break;
-                    }
-                }
-                else if (e.type == SDL_KEYUP) {
-                    switch (e.key.keysym.sym) {
-                        case SDLK_1: keyUp(machine, 1); break;
-                        case SDLK_2: keyUp(machine, 2); break;
-                        case SDLK_3: keyUp(machine, 3); break;
-                        case SDLK_4: keyUp(machine, 0xc); break;
-
-                        case SDLK_q: keyUp(machine, 4); break;
-                        case SDLK_w: keyUp(machine, 5); break;
-                        case SDLK_e: keyUp(machine, 6); break;
-                        case SDLK_r: keyUp(machine, 0xd); break;
-                        
-                        case SDLK_a: keyUp(machine, 7); break;
-                        case SDLK_s: keyUp(machine, 8); break;
-                        case SDLK_d: keyUp(machine, 9); break;
-                        case SDLK_f: keyUp(machine, 0xe); break;
-
-                        case SDLK_z: keyUp(machine, 0xa); break;
-                        case SDLK_x: keyUp(machine, 0); break;
-                        case SDLK_c: keyUp(machine, 0xb); break;
-                        case SDLK_v: keyUp(machine, 0xf); break;
-                        default: break;
+                else if (e.type == emulator.frameEvent) {
+                    //Clear the flag before taking the frame, so a frame published after this still posts an event
+                    atomic_store(&(emulator.framePosted), false);
+                    const Frame *frame = takeTripleBuffer(&(emulator.frames));
+                    if (frame != NULL) {
+                        updateDisplay(frame -> screen, display);
+                        pacingPresent(&pacing, frame);
+                        if (frame -> paced) {
+                            SDL_SemPost(emulator.presented);
+                        }
                     }
                 }
-            }
 
-            //CHIP-8 updates the display at 60Hz, 1/60 = 16.667ms = 16667us
-            currentTick = SDL_GetPerformanceCounter();
-            elapsedTicks = (double) (currentTick - lastTick);
-            delta = (double) ((double) (elapsedTicks * 1000.0) / (double) SDL_GetPerformanceFrequency());
-            lastTick = currentTick;
-            timer += delta;
-
-            if (timer > 1000 / INSTRUCTION_FREQUENCY) {
-                //If CHIP-8 is waiting, then don't do anything and return out, otherwise execute an instruction
-                if (!(machine -> halt)) {
-                    emulateCHIP8(machine);
-                }
-            }
-
-            if (timer > 1000 / SCREEN_FPS) {
-                timer = 0.0;
-
-                if (!machine -> halt) {
-                    if (machine -> delay > 0) {
-                        machine -> delay -= 1;
+                //Keypad keys only change the held mask, which the emulation thread reads before each frame
+                else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+                    bool down = e.type == SDL_KEYDOWN;
+                    int key = keypadKey(e.key.keysym.sym);
+                    if (key >= 0) {
+                        //Key repeats don't change the mask, so they aren't counted as input
+                        uint32_t old = down ? atomic_fetch_or(&(emulator.keys), 1u << key) : atomic_fetch_and(&(emulator.keys), ~(1u << key));
+                        if (((old >> key) & 1) != down) {
+                            //Release pairs with the emulation thread's acquire, after the mask change it counts
+                            pacingInput(&pacing, atomic_fetch_add_explicit(&(emulator.keyChanges), 1, memory_order_release) + 1);
+                        }
+                        continue;
                     }
 
-                    if (machine -> sound > 0) {
-                        machine -> sound -= 1;
-                    } 
-                }
-
-                //Update pixel array and load it into the texture, but only if the display flag is on
-                if (machine -> displayFlag) {
-                    updateDisplay(machine, display);
+                    switch (e.key.keysym.sym) {
+                        case SDLK_ESCAPE: if (down) quit = true; break;
+                        case SDLK_F3: if (down) printPacing(&pacing); break;
+                        case SDLK_F5: if (down) request(&emulator, REQUEST_SAVE); break;
+                        case SDLK_F9: if (down) request(&emulator, REQUEST_LOAD); break;
+                        case SDLK_BACKSPACE:
+                            atomic_store(&(emulator.rewinding), down);
+                            SDL_SemPost(emulator.wake);
+                            break;
+                        default: break;
+                    }
                 }
-            }
-            //Sleep for the rest of the frame to reduce CPU usage
-            else {
-                SDL_Delay((1000 / SCREEN_FPS) - timer);
-            }
+            } while (!quit && SDL_PollEvent(&e));
         }
+
+        atomic_store(&(emulator.quit), true);
+        SDL_SemPost(emulator.wake);
+        SDL_WaitThread(thread, NULL);
+        printPacing(&pacing);
+    }
+    if (emulator.wake != NULL) {
+        SDL_DestroySemaphore(emulator.wake);
+    }
+    if (emulator.presented != NULL) {
+        SDL_DestroySemaphore(emulator.presented);
     }
 
-    //Free resources and close SDL
+    //Free resources and close SDL, exiting with an error status if the ROM faulted
+    int status = machine -> fault ? 1 : 0;
+    stopRecording(&(emulator.movie), machine, movieFile);
+    free(stateFile);
+    freeRewind(history);
     freeCHIP8(machine);
+    closeBeeper(emulator.beeper);
     closeDisplay(display);
 
-    return 0;
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/machine.h"
+#include "jit/jit.h"
+#include "batch/batch.h"
+
+//Memory model tests: small ROMs that push every multi-byte access across the 0xfff/0x000 boundary
+//Each one runs on every core and in a lane of the lockstep engine. The end state has to match the bytes and registers
+//listed for it, and every core has to end in the same state as the first, so none of them can read or write outside the 4KB
+#define TEST_IPS 6000
+
+typedef enum ExpectKind {
+    EXPECT_V,
+    EXPECT_I,
+    EXPECT_PC,
+    EXPECT_SP,
+    EXPECT_MEMORY,
+    EXPECT_ROW,                 //Leftmost 8 pixels of a screen row
+    EXPECT_HALTED,              //Stopped on a jump to itself rather than a fault
+    EXPECT_RUNNING,
+} ExpectKind;
+
+typedef struct Expect {
+    ExpectKind kind;
+    uint16_t at;
+    uint16_t value;
+} Expect;
+
+typedef struct MemoryTest {
+    const char *name;
+    const char *description;
+    const uint16_t *code;
+    int length;
+    int sp;                     //Stack pointer to start from, or -1 for the one reset gives
+    int frames;
+    const Expect *expect;
+    int expectCount;
+} MemoryTest;
+
+//FX55 then FX65 of all 16 registers from 0xff8, so each burst runs 8 bytes past the end
+static const uint16_t burstCode[] = {
+    0x6001, 0x6102, 0x6203, 0x6304,     //200: V0-VF = 1-16
+    0x6405, 0x6506, 0x6607, 0x6708,
+    0x6809, 0x690A, 0x6A0B, 0x6B0C,
+    0x6C0D, 0x6D0E, 0x6E0F, 0x6F10,
+    0xAFF8,     //220: I = FF8
+    0xFF55,     //222: store V0-VF at FF8-FFF and 000-007
+    0x6000, 0x6100, 0x6200, 0x6300,     //224: clear V0-VF
+    0x6400, 0x6500, 0x6600, 0x6700,
+    0x6800, 0x6900, 0x6A00, 0x6B00,
+    0x6C00, 0x6D00, 0x6E00, 0x6F00,
+    0xAFF8,     //244: I = FF8
+    0xFF65,     //246: load them back
+    0x1248,     //248: halt
+};
+
+static const Expect burstExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_PC, 0, 0x248}, {EXPECT_I, 0, 0x1008},
+    {EXPECT_V, 0x0, 1}, {EXPECT_V, 0x7, 8}, {EXPECT_V, 0x8, 9}, {EXPECT_V, 0xF, 16},
+    {EXPECT_MEMORY, 0xFF8, 1}, {EXPECT_MEMORY, 0xFFF, 8}, {EXPECT_MEMORY, 0x000, 9}, {EXPECT_MEMORY, 0x007, 16},
+    {EXPECT_MEMORY, 0x008, 0x20},       //Font byte just past the burst is untouched
+};
+
+//A 15-row sprite from 0xffc, whose last 11 rows come from the start of memory
+static const uint16_t spriteCode[] = {
+    0x6081, 0x6142, 0x6224, 0x6318,     //200: rows 0-3
+    0x6401, 0x6502, 0x6604, 0x6708,     //208: rows 4-14
+    0x6810, 0x6920, 0x6A40, 0x6B80,
+    0x6CC0, 0x6D60, 0x6E30,
+    0xAFFC,     //21E: I = FFC
+    0xFE55,     //220: rows go to FFC-FFF and 000-00A
+    0x6000,     //222: V0 = 0
+    0xAFFC,     //224: I = FFC
+    0xD00F,     //226: draw 15 rows at 0, 0
+    0x1228,     //228: halt
+};
+
+static const Expect spriteExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_V, 0xF, 0},
+    {EXPECT_ROW, 0, 0x81}, {EXPECT_ROW, 3, 0x18}, {EXPECT_ROW, 4, 0x01}, {EXPECT_ROW, 11, 0x80}, {EXPECT_ROW, 14, 0x30},
+    {EXPECT_ROW, 15, 0x00},
+};
+
+//BCD of 255 at 0xffe, so the last digit wraps to 0, then read back across the same edge
+static const uint16_t bcdCode[] = {
+    0x60FF,     //200: V0 = 255
+    0xAFFE,     //202: I = FFE
+    0xF033,     //204: 2, 5, 5 at FFE, FFF, 000
+    0xAFFE,     //206: I = FFE
+    0xF265,     //208: load V0-V2
+    0x120A,     //20A: halt
+};
+
+static const Expect bcdExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_V, 0x0, 2}, {EXPECT_V, 0x1, 5}, {EXPECT_V, 0x2, 5},
+    {EXPECT_MEMORY, 0xFFE, 2}, {EXPECT_MEMORY, 0xFFF, 5}, {EXPECT_MEMORY, 0x000, 5}, {EXPECT_MEMORY, 0x001, 0x90},
+};
+
+//An instruction at 0xfff whose second byte is at 0x000: 12F0, a jump to 2F0
+static const uint16_t edgeCode[] = {
+    0x6012,     //200: V0 = 12
+    0x61F0,     //202: V1 = F0
+    0xAFFF,     //204: I = FFF
+    0xF155,     //206: 12 at FFF, F0 at 000
+    0x1FFF,     //208: jump to FFF
+    [0x78] = 0x12F0,    //2F0: halt
+};
+
+static const Expect edgeExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_PC, 0, 0x2F0}, {EXPECT_MEMORY, 0xFFF, 0x12}, {EXPECT_MEMORY, 0x000, 0xF0},
+};
+
+//One call and return with the stack pointer started at 0 or 1
+static const uint16_t callCode[] = {
+    0x2280,     //200: call 280
+    0x1202,     //202: halt
+    [0x40] = 0x00EE,    //280: return
+};
+
+static const Expect callEdgeExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_PC, 0, 0x202}, {EXPECT_SP, 0, 0x0001},
+    {EXPECT_MEMORY, 0xFFF, 0x02}, {EXPECT_MEMORY, 0x000, 0x02},
+};
+
+static const Expect callZeroExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_PC, 0, 0x202}, {EXPECT_SP, 0, 0x0000},
+    {EXPECT_MEMORY, 0xFFE, 0x02}, {EXPECT_MEMORY, 0xFFF, 0x02}, {EXPECT_MEMORY, 0x000, 0x60},
+};
+
+//17 nested calls from a stack pointer of 8, which runs down through 0 and on from 0xffe
+static const uint16_t recursionCode[] = {
+    0x6010,     //200: V0 = 16
+    0x2206,     //202: call 206
+    0x1204,     //204: halt
+    0x3000,     //206: skip if V0 == 0
+    0x120C,     //208: go deeper
+    0x00EE,     //20A: return
+    0x70FF,     //20C: V0 -= 1
+    0x2206,     //20E: call 206
+    0x00EE,     //210: return
+};
+
+static const Expect recursionExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_PC, 0, 0x204}, {EXPECT_SP, 0, 0x0008}, {EXPECT_V, 0x0, 0},
+    {EXPECT_MEMORY, 0x006, 0x02}, {EXPECT_MEMORY, 0x007, 0x04},
+    {EXPECT_MEMORY, 0xFFE, 0x02}, {EXPECT_MEMORY, 0xFFF, 0x10},
+    {EXPECT_MEMORY, 0xFE6, 0x02}, {EXPECT_MEMORY, 0xFE7, 0x10}, {EXPECT_MEMORY, 0xFE5, 0x00},
+};
+
+//I climbs by 15 with every sprite and load, through the top of memory, past 0xffff and round again
+static const uint16_t readSweepCode[] = {
+    0xAF00,     //200: I = F00
+    0xDFFF,     //202: draw 15 rows at VF, VF
+    0xFE65,     //204: load V0-VE, I += 15
+    0x1202,     //206: loop to 202
+};
+
+static const Expect readSweepExpect[] = {
+    {EXPECT_RUNNING, 0, 0}, {EXPECT_MEMORY, 0x200, 0xAF}, {EXPECT_MEMORY, 0x207, 0x02},
+};
+
+//40 stores of all 16 registers from 0xf08 up, one of them straddling 0xfff, stopping short of the code at 0x200
+static const uint16_t writeSweepCode[] = {
+    0xAF08,     //200: I = F08
+    0x6128,     //202: V1 = 40, the count
+    0x6FAA,     //204: VF = AA
+    0xFF55,     //206: store V0-VF, I += 16
+    0x7001,     //208: V0 += 1
+    0x71FF,     //20A: V1 -= 1
+    0x3100,     //20C: skip if V1 == 0
+    0x1206,     //20E: loop to 206
+    0x1210,     //210: halt
+};
+
+static const Expect writeSweepExpect[] = {
+    {EXPECT_HALTED, 0, 0}, {EXPECT_I, 0, 0x1188}, {EXPECT_V, 0x0, 40}, {EXPECT_V, 0x1, 0},
+    {EXPECT_MEMORY, 0xFF8, 15}, {EXPECT_MEMORY, 0xFF9, 25}, {EXPECT_MEMORY, 0x007, 0xAA},
+    {EXPECT_MEMORY, 0x178, 39}, {EXPECT_MEMORY, 0x179, 1}, {EXPECT_MEMORY, 0x187, 0xAA}, {EXPECT_MEMORY, 0x188, 0x00},
+    {EXPECT_MEMORY, 0x200, 0xAF},
+};
+
+#define MEMORY_TEST(name, description, code, sp, frames, expect) \
+    { name, description, code, sizeof(code) / sizeof(code[0]), sp, frames, expect, sizeof(expect) / sizeof(expect[0]) }
+
+static const MemoryTest tests[] = {
+    MEMORY_TEST("burst", "FX55/FX65 of 16 bytes from 0xff8", burstCode, -1, 5, burstExpect),
+    MEMORY_TEST("sprite", "DXYN of 15 rows from 0xffc", spriteCode, -1, 5, spriteExpect),
+    MEMORY_TEST("bcd", "FX33 at 0xffe", bcdCode, -1, 5, bcdExpect),
+    MEMORY_TEST("edge", "instruction at 0xfff", edgeCode, -1, 5, edgeExpect),
+    MEMORY_TEST("call-sp1", "2NNN/00EE with sp at 1", callCode, 0x0001, 5, callEdgeExpect),
+    MEMORY_TEST("call-sp0", "2NNN/00EE with sp at 0", callCode, 0x0000, 5, callZeroExpect),
+    MEMORY_TEST("recursion", "17 nested calls from sp 8", recursionCode, 0x0008, 5, recursionExpect),
+    MEMORY_TEST("read-sweep", "DXYN/FX65 with I over every 16-bit value", readSweepCode, -1, 150, readSweepExpect),
+    MEMORY_TEST("write-sweep", "FX55 across 0xfff up to 0x187", writeSweepCode, -1, 5, writeSweepExpect),
+};
+
+static const char *cores[] = { "dispatch", "threaded", "jit", "batch" };
+
+#define TEST_COUNT (int) (sizeof(tests) / sizeof(tests[0]))
+#define CORE_COUNT (int) (sizeof(cores) / sizeof(cores[0]))
+
+//Assembles a test into ROM bytes, big-endian as the machine reads them
+static uint16_t buildROM(const MemoryTest *test, uint8_t *rom) {
+    for (int i = 0; i < test -> length; i++) {
+        rom[i * 2] = test -> code[i] >> 8;
+        rom[i * 2 + 1] = test -> code[i] & 0xff;
+    }
+    return test -> length * 2;
+}
+
+//Runs the test on one core and returns the machine it ended in, which the caller frees, or NULL if the core isn't available
+static CHIP8State* runTest(const MemoryTest *test, const char *core) {
+    uint8_t rom[MAX_ROM_SIZE];
+    uint16_t size = buildROM(test, rom);
+
+    CHIP8State *machine = initCHIP8();
+    if (machine == NULL) {
+        return NULL;
+    }
+    resetCHIP8(machine, rom, size);
+    setSpeedCHIP8(machine, TEST_IPS);
+    if (test -> sp >= 0) {
+        machine -> sp = test -> sp;
+    }
+
+    if (strcmp(core, "batch") == 0) {
+        CHIP8Batch *batch = initBatch(1);
+        if (batch == NULL) {
+            freeCHIP8(machine);
+            return NULL;
+        }
+        loadBatch(batch, machine);
+        for (int f = 0; f < test -> frames; f++) {
+            runFrameBatch(batch);
+        }
+        getLaneBatch(batch, 0, machine);
+        freeBatch(batch);
+        return machine;
+    }
+
+    CHIP8JIT *jit = NULL;
+    if (strcmp(core, "dispatch") == 0) {
+        machine -> core = emulateCHIP8Batch;
+    }
+    else if (strcmp(core, "jit") == 0) {
+        jit = initJIT(machine);
+        if (jit == NULL) {
+            freeCHIP8(machine);
+            return NULL;
+        }
+    }
+
+    for (int f = 0; f < test -> frames && !(machine -> halt); f++) {
+        runFrameCHIP8(machine);
+    }
+    freeJIT(machine, jit);
+    return machine;
+}
+
+//Prints each expectation the machine doesn't meet, and returns how many there were
+static int checkExpect(const MemoryTest *test, const char *core, const CHIP8State *machine) {
+    int failures = 0;
+    for (int i = 0; i < test -> expectCount; i++) {
+        const Expect *e = &(test -> expect[i]);
+        int actual = 0;
+        const char *what = "";
+        switch (e -> kind) {
+            case EXPECT_V: actual = machine -> V[e -> at]; what = "V"; break;
+            case EXPECT_I: actual = machine -> I; what = "I"; break;
+            case EXPECT_PC: actual = machine -> pc; what = "pc"; break;
+            case EXPECT_SP: actual = machine -> sp; what = "sp"; break;
+            case EXPECT_MEMORY: actual = machine -> memory[e -> at]; what = "memory"; break;
+            case EXPECT_ROW: actual = machine -> screen[e -> at] >> 56; what = "row"; break;
+            case EXPECT_HALTED: actual = machine -> halt && !(machine -> fault); what = "halted"; break;
+            case EXPECT_RUNNING: actual = !(machine -> halt); what = "running"; break;
+        }
+
+        int expected = (e -> kind == EXPECT_HALTED || e -> kind == EXPECT_RUNNING) ? 1 : e -> value;
+        if (actual != expected) {
+            printf("  %s on %s: %s", test -> name, core, what);
+            if (e -> kind == EXPECT_V || e -> kind == EXPECT_MEMORY || e -> kind == EXPECT_ROW) {
+                printf("[%03x]", e -> at);
+            }
+            printf(" is %04x, expected %04x\n", actual, expected);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+//A lane that halts keeps the cycle count it stopped at while the batch's timers carry on, so a lane is compared on what
+//the lockstep engine keeps for each lane, as headless --lanes does, rather than on the whole hash
+static int sameAsLane(const CHIP8State *machine, const CHIP8State *lane) {
+    return machine -> pc == lane -> pc && machine -> sp == lane -> sp && machine -> I == lane -> I
+        && machine -> halt == lane -> halt && machine -> fault == lane -> fault && machine -> cycles == lane -> cycles
+        && memcmp(machine -> V, lane -> V, 16) == 0
+        && memcmp(machine -> memory, lane -> memory, 4096) == 0
+        && memcmp(machine -> screen, lane -> screen, sizeof(machine -> screen)) == 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        printf("Usage: memtest\n");
+        printf("Tests:\n");
+        for (int t = 0; t < TEST_COUNT; t++) {
+            printf("  %-12s %s\n", tests[t].name, tests[t].description);
+        }
+        return 1;
+    }
+
+    int failed = 0;
+    printf("%-12s %-9s %-16s %s\n", "Test", "Core", "Hash", "Result");
+    for (int t = 0; t < TEST_COUNT; t++) {
+        const MemoryTest *test = &tests[t];
+        CHIP8State *reference = NULL;
+
+        for (int c = 0; c < CORE_COUNT; c++) {
+            CHIP8State *machine = runTest(test, cores[c]);
+            if (machine == NULL) {
+                printf("%-12s %-9s %-16s %s\n", test -> name, cores[c], "", "unavailable");
+                continue;
+            }
+
+            //Every core has to agree with the first one on the whole state, not just the bytes listed
+            uint64_t hash = hashCHIP8(machine);
+            int failures = checkExpect(test, cores[c], machine);
+            if (reference != NULL) {
+                int same = (strcmp(cores[c], "batch") == 0) ? sameAsLane(reference, machine) : hash == hashCHIP8(reference);
+                if (!same) {
+                    printf("  %s on %s: state differs from %s\n", test -> name, cores[c], cores[0]);
+                    failures++;
+                }
+            }
+
+            printf("%-12s %-9s %016llx %s\n", test -> name, cores[c], (unsigned long long) hash, failures ? "FAIL" : "ok");
+            failed += failures != 0;
+            if (reference == NULL) {
+                reference = machine;
+            }
+            else {
+                freeCHIP8(machine);
+            }
+        }
+        freeCHIP8(reference);
+    }
+
+    if (failed) {
+        printf("\n%d runs failed.\n", failed);
+        return 1;
+    }
+    printf("\nAll memory tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+#ifdef CHIP8_PROFILE
+
+static uint64_t wallNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+CHIP8Profile* initProfile(void) {
+    CHIP8Profile *profile = calloc(1, sizeof(CHIP8Profile));
+
+    //Cheapest of many back-to-back reads is what every sample pays just for timing itself
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t start = profileClock();
+        uint64_t ticks = profileClock() - start;
+        if (ticks < overhead) {
+            overhead = ticks;
+        }
+    }
+    profile -> clockOverhead = overhead;
+    profile -> startTicks = profileClock();
+    profile -> startNanoseconds = wallNanoseconds();
+
+    return profile;
+}
+
+void freeProfile(CHIP8Profile *profile) {
+    free(profile);
+}
+
+//Nanoseconds per clock tick, measured over everything since initProfile
+static double nanosecondsPerTick(CHIP8Profile *profile) {
+    uint64_t ticks = profileClock() - profile -> startTicks;
+    uint64_t nanoseconds = wallNanoseconds() - profile -> startNanoseconds;
+    return ticks ? (double) nanoseconds / ticks : 1.0;
+}
+
+static double handlerNanoseconds(CHIP8Profile *profile, uint64_t ticks, uint64_t count, double scale) {
+    uint64_t overhead = count * profile -> clockOverhead;
+    return (ticks > overhead ? ticks - overhead : 0) * scale;
+}
+
+static uint64_t totalCount(CHIP8Profile *profile) {
+    uint64_t total = 0;
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        total += profile -> opcodeCount[op];
+    }
+    return total;
+}
+
+typedef struct ProfileEntry {
+    int index;
+    uint64_t count;
+} ProfileEntry;
+
+static int compareEntries(const void *a, const void *b) {
+    uint64_t x = ((const ProfileEntry *) a) -> count;
+    uint64_t y = ((const ProfileEntry *) b) -> count;
+    return (x < y) - (x > y);
+}
+
+//Fills order with the indices of non-zero counts, highest first, and returns how many there are
+static int sortByCount(const uint64_t *counts, int n, int *order) {
+    ProfileEntry entries[4096];
+    int used = 0;
+    for (int i = 0; i < n; i++) {
+        if (counts[i]) {
+            entries[used].index = i;
+            entries[used].count = counts[i];
+            used++;
+        }
+    }
+    qsort(entries, used, sizeof(ProfileEntry), compareEntries);
+    for (int i = 0; i < used; i++) {
+        order[i] = entries[i].index;
+    }
+    return used;
+}
+
+void printProfile(CHIP8Profile *profile, CHIP8State *state, int addresses) {
+    double scale = nanosecondsPerTick(profile);
+    uint64_t total = totalCount(profile);
+    if (total == 0) {
+        printf("Profile: no instructions executed.\n");
+        return;
+    }
+
+    int order[4096];
+    int used = sortByCount(profile -> opcodeCount, OPCODE_COUNT, order);
+
+    printf("Profile: %llu instructions\n", (unsigned long long) total);
+    printf("%-8s %14s %7s %12s %9s\n", "Opcode", "Count", "%", "Host ns", "ns/op");
+    for (int i = 0; i < used; i++) {
+        int op = order[i];
+        uint64_t count = profile -> opcodeCount[op];
+        double ns = handlerNanoseconds(profile, profile -> opcodeTicks[op], count, scale);
+        printf("%-8s %14llu %6.2f%% %12.0f %9.2f\n", opcodeInfoCHIP8[op].name, (unsigned long long) count,
+            100.0 * count / total, ns, ns / count);
+    }
+    if (profile -> draws) {
+        printf("DXYN collisions: %llu of %llu draws (%.1f%%)\n", (unsigned long long) profile -> collisions,
+            (unsigned long long) profile -> draws, 100.0 * profile -> collisions / profile -> draws);
+    }
+
+    //Hottest addresses, each followed by its disassembly as memory holds it now
+    used = sortByCount(profile -> addressCount, 4096, order);
+    if (used > addresses) {
+        used = addresses;
+    }
+    printf("Hottest addresses:\n");
+    for (int i = 0; i < used; i++) {
+        int address = order[i];
+        uint64_t count = profile -> addressCount[address];
+        char line[64];
+        disassembleCHIP8(state -> memory, address, line, sizeof(line));
+        printf("%14llu %6.2f%% %12.0f ns  %s\n", (unsigned long long) count, 100.0 * count / total,
+            handlerNanoseconds(profile, profile -> addressTicks[address], count, scale), line);
+    }
+}
+
+int writeProfileJSON(CHIP8Profile *profile, CHIP8State *state, char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        printf("Error: Couldn't open %s\n", filename);
+        return 1;
+    }
+
+    double scale = nanosecondsPerTick(profile);
+    fprintf(f, "{\n  \"instructions\": %llu,\n", (unsigned long long) totalCount(profile));
+    fprintf(f, "  \"draws\": %llu,\n  \"collisions\": %llu,\n", (unsigned long long) profile -> draws,
+        (unsigned long long) profile -> collisions);
+
+    int order[4096];
+    int used = sortByCount(profile -> opcodeCount, OPCODE_COUNT, order);
+    fprintf(f, "  \"opcodes\": [\n");
+    for (int i = 0; i < used; i++) {
+        int op = order[i];
+        fprintf(f, "    {\"opcode\": \"%s\", \"count\": %llu, \"ns\": %.0f}%s\n", opcodeInfoCHIP8[op].name,
+            (unsigned long long) profile -> opcodeCount[op],
+            handlerNanoseconds(profile, profile -> opcodeTicks[op], profile -> opcodeCount[op], scale),
+            (i + 1 < used) ? "," : "");
+    }
+    fprintf(f, "  ],\n");
+
+    used = sortByCount(profile -> addressCount, 4096, order);
+    fprintf(f, "  \"addresses\": [\n");
+    for (int i = 0; i < used; i++) {
+        int address = order[i];
+        fprintf(f, "    {\"address\": %d, \"instruction\": \"%02x%02x\", \"count\": %llu, \"ns\": %.0f}%s\n", address,
+            state -> memory[address], state -> memory[(address + 1) & 0xfff],
+            (unsigned long long) profile -> addressCount[address],
+            handlerNanoseconds(profile, profile -> addressTicks[address], profile -> addressCount[address], scale),
+            (i + 1 < used) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    int ok = !ferror(f);
+    fclose(f);
+    if (!ok) {
+        printf("Error: Couldn't write profile to %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
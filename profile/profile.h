@@ -0,0 +1,65 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "../CHIP8emu.h"
+
+//Execution profiler for the interpreter, only built with -DCHIP8_PROFILE (make profile)
+//Counts every instruction by opcode and by address, with host time spent in its handler, and how many DXYN collided
+//Without the flag none of this is compiled and CHIP8State has no profile pointer, so normal builds pay nothing
+#ifdef CHIP8_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+struct CHIP8Profile {
+    uint64_t opcodeCount[OPCODE_COUNT];
+    uint64_t opcodeTicks[OPCODE_COUNT];
+    uint64_t addressCount[4096];
+    uint64_t addressTicks[4096];
+    uint64_t draws;
+    uint64_t collisions;        //DXYN that set VF
+
+    //Clock calibration: ticks are converted to nanoseconds over the whole run, less the cost of reading the clock
+    uint64_t startTicks;
+    uint64_t startNanoseconds;
+    uint64_t clockOverhead;
+};
+
+//Timestamp counter where there is one, since it costs a few cycles rather than a system call
+static inline uint64_t profileClock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline void recordProfile(CHIP8Profile *profile, const CHIP8State *state, const CHIP8Instruction *ins, uint16_t address, uint64_t start) {
+    uint64_t ticks = profileClock() - start;
+    profile -> opcodeCount[ins -> opcode]++;
+    profile -> opcodeTicks[ins -> opcode] += ticks;
+    profile -> addressCount[address]++;
+    profile -> addressTicks[address] += ticks;
+    if (ins -> opcode == OPCODE_DXYN) {
+        profile -> draws++;
+        profile -> collisions += state -> V[0xf];
+    }
+}
+
+CHIP8Profile* initProfile(void);
+void freeProfile(CHIP8Profile *profile);
+
+//printProfile writes the opcode table and the hottest addresses with their disassembly to stdout
+//writeProfileJSON writes every opcode and every executed address to filename
+void printProfile(CHIP8Profile *profile, CHIP8State *state, int addresses);
+int writeProfileJSON(CHIP8Profile *profile, CHIP8State *state, char *filename);
+
+#endif
+
+#endif
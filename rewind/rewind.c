@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rewind.h"
+#include "../machine/savestate.h"
+
+//Bytes at the start of an image holding the header and registers, copied whole into every delta
+//Everything after it (memory and screen) is compared against the keyframe 8 bytes at a time
+#define REGISTER_BYTES 128
+
+//Each run in a delta is a 2-byte image offset and a 2-byte length, followed by that many bytes
+#define RUN_HEADER 4
+
+//Records start on 8-byte boundaries
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
+
+Rewind* initRewind(int frames, size_t bytes, int keyframeInterval) {
+    Rewind *history = calloc(1, sizeof(Rewind));
+    if (history == NULL) {
+        printf("Error: Unable to allocate the rewind history.\n");
+        return NULL;
+    }
+
+    //Always leave room for a couple of keyframes, or nothing could ever be stepped back to
+    if (bytes < 2 * SAVE_STATE_SIZE) {
+        bytes = 2 * SAVE_STATE_SIZE;
+    }
+    if (frames < 2) {
+        frames = 2;
+    }
+    //Evicting a keyframe takes its deltas with it, so keep groups small enough that doing so loses little history
+    if (keyframeInterval > frames / 4) {
+        keyframeInterval = frames / 4;
+    }
+    if (keyframeInterval < 1) {
+        keyframeInterval = 1;
+    }
+
+    history -> data = malloc(bytes);
+    history -> capacity = bytes;
+    history -> frames = calloc(frames, sizeof(RewindFrame));
+    history -> maxFrames = frames;
+    history -> keyframeInterval = keyframeInterval;
+    history -> image = malloc(SAVE_STATE_SIZE);
+    history -> delta = malloc(SAVE_STATE_SIZE);
+    if (history -> data == NULL || history -> frames == NULL || history -> image == NULL || history -> delta == NULL) {
+        printf("Error: Unable to allocate %d frames of rewind history in %llu bytes.\n", frames, (unsigned long long) bytes);
+        freeRewind(history);
+        return NULL;
+    }
+
+    return history;
+}
+
+void freeRewind(Rewind *history) {
+    if (history == NULL) {
+        return;
+    }
+    free(history -> data);
+    free(history -> frames);
+    free(history -> image);
+    free(history -> delta);
+    free(history);
+}
+
+void clearRewind(Rewind *history) {
+    history -> head = 0;
+    history -> first = 0;
+    history -> count = 0;
+}
+
+static RewindFrame* getFrame(Rewind *history, uint64_t number) {
+    return &(history -> frames[number % history -> maxFrames]);
+}
+
+//Drops the oldest frame, then any deltas left behind without their keyframe
+static void evictOldest(Rewind *history) {
+    do {
+        history -> first++;
+        history -> count--;
+    } while (history -> count > 0 && getFrame(history, history -> first) -> keyframe != history -> first);
+
+    if (history -> count == 0) {
+        history -> head = 0;
+    }
+}
+
+//Finds size bytes for a new record at head, or at the start of data if the end is too short
+//Returns 0 if the oldest live records are in the way
+static int findRoom(Rewind *history, size_t size, size_t *offset) {
+    if (history -> count == 0) {
+        *offset = 0;
+        return size <= history -> capacity;
+    }
+
+    size_t tail = getFrame(history, history -> first) -> offset;
+    if (history -> head > tail) {
+        //Live records run from tail to head, with free space either side
+        if (history -> capacity - history -> head >= size) {
+            *offset = history -> head;
+            return 1;
+        }
+        if (tail >= size) {
+            *offset = 0;
+            return 1;
+        }
+        return 0;
+    }
+
+    //Live records have wrapped, so the only free space is between head and tail
+    if (tail - history -> head >= size) {
+        *offset = history -> head;
+        return 1;
+    }
+    return 0;
+}
+
+//Writes the runs of words in image that differ from keyframe, returning the delta's size
+//Returns 0 if the delta passes half an image, since a keyframe is a better use of the space by then
+static size_t encodeDelta(const uint8_t *keyframe, const uint8_t *image, uint8_t *delta) {
+    size_t limit = SAVE_STATE_SIZE / 2;
+    size_t size = REGISTER_BYTES;
+    memcpy(delta, image, REGISTER_BYTES);
+
+    size_t i = REGISTER_BYTES;
+    while (i < SAVE_STATE_SIZE) {
+        uint64_t a, b;
+        memcpy(&a, keyframe + i, 8);
+        memcpy(&b, image + i, 8);
+        if (a == b) {
+            i += 8;
+            continue;
+        }
+
+        //Extend the run over every consecutive word that differs
+        size_t start = i;
+        do {
+            i += 8;
+            if (i >= SAVE_STATE_SIZE) {
+                break;
+            }
+            memcpy(&a, keyframe + i, 8);
+            memcpy(&b, image + i, 8);
+        } while (a != b);
+
+        uint16_t runOffset = (uint16_t) start;
+        uint16_t runLength = (uint16_t) (i - start);
+        if (size + RUN_HEADER + runLength > limit) {
+            return 0;
+        }
+        memcpy(delta + size, &runOffset, 2);
+        memcpy(delta + size + 2, &runLength, 2);
+        memcpy(delta + size + RUN_HEADER, image + start, runLength);
+        size += RUN_HEADER + runLength;
+    }
+
+    return size;
+}
+
+static void applyDelta(const uint8_t *delta, size_t size, uint8_t *image) {
+    memcpy(image, delta, REGISTER_BYTES);
+
+    size_t i = REGISTER_BYTES;
+    while (i < size) {
+        uint16_t runOffset, runLength;
+        memcpy(&runOffset, delta + i, 2);
+        memcpy(&runLength, delta + i + 2, 2);
+        memcpy(image + runOffset, delta + i + RUN_HEADER, runLength);
+        i += RUN_HEADER + runLength;
+    }
+}
+
+void pushRewind(Rewind *history, const CHIP8State *state) {
+    writeState(state, history -> image);
+
+    uint64_t number = history -> first + history -> count;
+    uint64_t keyframe = 0;
+    int key = 1;
+    size_t size = SAVE_STATE_SIZE;
+
+    if (history -> count > 0) {
+        keyframe = getFrame(history, number - 1) -> keyframe;
+        if (number - keyframe < (uint64_t) history -> keyframeInterval) {
+            size = encodeDelta(history -> data + getFrame(history, keyframe) -> offset, history -> image, history -> delta);
+            key = size == 0;
+        }
+    }
+    if (key) {
+        size = SAVE_STATE_SIZE;
+    }
+
+    if (history -> count == (uint64_t) history -> maxFrames) {
+        evictOldest(history);
+    }
+
+    //Make room by dropping the oldest frames; if that takes the keyframe the delta was made against, store a keyframe instead
+    size_t offset;
+    while (!findRoom(history, ALIGN8(size), &offset)) {
+        evictOldest(history);
+        if (!key && (history -> count == 0 || history -> first > keyframe)) {
+            key = 1;
+            size = SAVE_STATE_SIZE;
+        }
+    }
+    number = history -> first + history -> count;
+
+    memcpy(history -> data + offset, key ? history -> image : history -> delta, size);
+    RewindFrame *frame = getFrame(history, number);
+    frame -> offset = (uint32_t) offset;
+    frame -> size = (uint32_t) size;
+    frame -> keyframe = key ? number : keyframe;
+
+    history -> head = offset + ALIGN8(size);
+    history -> count++;
+}
+
+int stepBackRewind(Rewind *history, CHIP8State *state) {
+    if (history -> count < 2) {
+        return 1;
+    }
+
+    //Records are written in order, so the newest one's space is the next to be reused
+    uint64_t newest = history -> first + history -> count - 1;
+    history -> head = getFrame(history, newest) -> offset;
+    history -> count--;
+
+    RewindFrame *frame = getFrame(history, newest - 1);
+    RewindFrame *keyframe = getFrame(history, frame -> keyframe);
+    memcpy(history -> image, history -> data + keyframe -> offset, SAVE_STATE_SIZE);
+    if (frame != keyframe) {
+        applyDelta(history -> data + frame -> offset, frame -> size, history -> image);
+    }
+
+    return readState(state, history -> image, SAVE_STATE_SIZE);
+}
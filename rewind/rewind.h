@@ -0,0 +1,45 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include "../CHIP8emu.h"
+
+//Ring buffer of recent frames for stepping the machine backwards
+//Every keyframe stores a whole save state image; the frames after it store the full registers plus runs of the
+//memory and screen bytes that differ from that keyframe, so restoring any frame takes one keyframe and one delta
+#define DEFAULT_REWIND_SECONDS 30
+#define DEFAULT_REWIND_BYTES (4 * 1024 * 1024)
+#define DEFAULT_REWIND_KEYFRAME 60
+
+typedef struct RewindFrame {
+    uint32_t offset;            //Start of this frame's record in data
+    uint32_t size;
+    uint64_t keyframe;          //Number of the keyframe this frame is stored against, its own number for keyframes
+} RewindFrame;
+
+typedef struct Rewind {
+    uint8_t *data;              //Records, written in order and wrapping to the start when they reach the end
+    size_t capacity;
+    size_t head;                //Where the next record goes
+    RewindFrame *frames;        //Indexed by frame number modulo maxFrames
+    int maxFrames;
+    int keyframeInterval;
+    uint64_t first;             //Number of the oldest frame held
+    uint64_t count;
+
+    uint8_t *image;             //Scratch save state image for capturing and restoring
+    uint8_t *delta;             //Scratch delta, abandoned for a keyframe if it grows past half an image
+} Rewind;
+
+//Holds at most frames frames in bytes of records, dropping the oldest first; keyframeInterval is in frames
+//Prints an error and returns NULL if the history can't be allocated
+Rewind* initRewind(int frames, size_t bytes, int keyframeInterval);
+void freeRewind(Rewind *history);
+void clearRewind(Rewind *history);
+
+//pushRewind captures the machine as the newest frame
+//stepBackRewind drops the newest frame and restores the machine to the one before it, returning non-zero if there isn't one
+void pushRewind(Rewind *history, const CHIP8State *state);
+int stepBackRewind(Rewind *history, CHIP8State *state);
+
+#endif
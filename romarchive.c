@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine/archive.h"
+
+static void usage(void) {
+    printf("Usage: romarchive build ARCHIVE ROM...\n");
+    printf("       romarchive list ARCHIVE\n");
+    printf("  build   Pack the ROMs into ARCHIVE, indexed by content hash and by file name\n");
+    printf("  list    Print each ROM's content hash, size and name\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "build") == 0) {
+        if (writeArchive(argv[2], &argv[3], argc - 3) != 0) {
+            return 1;
+        }
+        printf("Packed %d ROMs into %s\n", argc - 3, argv[2]);
+        return 0;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "list") == 0) {
+        ROMArchive *archive = openArchive(argv[2]);
+        if (archive == NULL) {
+            return 1;
+        }
+        uint32_t count = LE32(archive -> header -> count);
+        for (uint32_t i = 0; i < count; i++) {
+            const ArchiveEntry *entry = &(archive -> entries[i]);
+            printf("%016llx %5u %.*s\n", (unsigned long long) LE64(entry -> hash), LE16(entry -> size),
+                LE16(entry -> nameLength), archiveROMName(archive, entry));
+        }
+        closeArchive(archive);
+        return 0;
+    }
+
+    usage();
+    return 1;
+}